@@ -62,6 +62,8 @@
  *
  */
 
+#include "eeprom.h"
+
 /* One of the 2 adc units.
  * Some STM32 devices have 3, we only have 2
  */
@@ -112,12 +114,17 @@ struct adc {
 #define CR_EOCIE	0x20		/* enable EOC interrupts */
 #define CR_AWDIE	0x40		/* enable AWD interrupts */
 #define CR_JEOCIE	0x80		/* enable JEOC interrupts */
+#define CR_SCAN		0x100		/* scan the sequence */
+#define CR_AWDSGL	0x200		/* watchdog on one channel */
+#define CR_AWDEN	0x800000	/* watchdog on regular channels */
+#define AWDCH_MASK	0x1f
 
 /* Bits in CR2 */
 #define CR_ON		0x1		/* turn on the ADC */
 #define CR_CONT		0x2		/* continuous mode */
 #define CR_CAL		0x4
 #define CR_RSTCAL	0x8
+#define CR_DMA		0x100		/* DMA request on each EOC */
 #define CR_EXTTRIG	0x100000	/* enable ext trigger */
 #define CR_JSWSTART	0x200000	/* SW start injected */
 #define CR_SWSTART	0x400000	/* SW start regular */
@@ -146,41 +153,148 @@ struct adc {
 void adc_start ( void );
 void adc_on ( void );
 void adc_set_chan ( int );
+void adc_scan_stop ( void );
+int adc_scan_running ( void );
+void adc_dual_stop ( void );
+int adc_dual_running ( void );
 
 /* It is not clear whether conversions are full scale at 3.6 volts
  * or at the actual Vcc voltage - it seems to be actual Vcc, maybe.
  */
 // #define ADC_SUPPLY 3080
-#define ADC_SUPPLY 3310
+// #define ADC_SUPPLY 3310
 // #define ADC_SUPPLY 3600
 
+/* Both of these are settings now, see eeprom.c */
+#define ADC_SUPPLY	eeprom_get ( KEY_SUPPLY )
+#define VREF_MV		eeprom_get ( KEY_VREF )
+
+/* It is the actual Vcc (there is no Vref+ pin on our package),
+ * and Vcc moves around, the USB supply sags when the board
+ * is busy.  So we no longer trust ADC_SUPPLY except as a
+ * starting point.  Any time we convert channel 17 (the 1.2 volt
+ * internal reference) we work out what Vcc must be and run
+ * that through a simple IIR filter.  All the conversions
+ * to millivolts below use that estimate.
+ *
+ * The F103 has no factory calibration for Vrefint, so
+ * VREF_MV is the one number that might want adjusting
+ * for a particular chip (1.16 to 1.26 volts), which
+ * is "set vref" on the console.
+ *
+ * The estimate is kept in millivolts * 16, so a count
+ * times it, shifted down 16, is millivolts.
+ */
+#define SUPPLY_SHIFT	3		/* filter gain 1/8 */
+
+static volatile int supply_16;		/* seeded in adc_init */
+
+/* Temperature sensor, in tenths of a degree C */
+#define TEMP_V25	1430		/* mV at 25 C */
+#define TEMP_SLOPE	43		/* tenths of mV per degree */
+
+static volatile int adc_temp_10 = 250;
+
+/* Feed in a Vrefint reading (raw counts) */
+static void
+adc_supply_update ( int vref )
+{
+	int new;
+
+	if ( vref <= 0 )
+	    return;
+
+	new = VREF_MV * 4096 * 16 / vref;
+	supply_16 += (new - supply_16) >> SUPPLY_SHIFT;
+}
+
+/* Feed in a temperature sensor reading (raw counts) */
+static void
+adc_temp_update ( int raw )
+{
+	int mv = (raw * supply_16) >> 16;
+
+	adc_temp_10 = (TEMP_V25 - mv) * 100 / TEMP_SLOPE + 250;
+}
+
+/* Raw counts to millivolts */
+int
+adc_mv ( int counts )
+{
+	/* unsigned, so mV * 16 (from the decimator) still fits */
+	return ((unsigned long) counts * supply_16) >> 16;
+}
+
+/* Millivolts to raw counts */
+int
+adc_counts ( int mv )
+{
+	return (mv << 16) / supply_16;
+}
+
+/* Current Vcc estimate in millivolts */
+int
+adc_supply ( void )
+{
+	return supply_16 >> 4;
+}
+
+/* Chip temperature in tenths of a degree */
+int
+adc_temp ( void )
+{
+	return adc_temp_10;
+}
+
 static volatile char adc_finished; 
 static volatile int adc_val;
 
+static void (*awd_func) ( void );
+
 /* ADC 1 and 2 share a common interrupt */
 void
 adc_handler ( void )
 {
 	struct adc *ap = ADC1_BASE;
+	void (*func) ( void );
+	int seen = 0;
 	// int x;
 	// int y;
 
 	// printf ( "ADC interrupt\n" );
 	// serial_puts ( "ADC interrupt\n" );
 
+	/* The watchdog is one shot, it has done its job.
+	 * Turn it off entirely, or the hardware keeps setting
+	 * SR_AWD on every conversion outside the window.
+	 * An EOC may have come along with it, so we go on.
+	 */
+	if ( ap->sr & SR_AWD ) {
+	    func = awd_func;
+	    awd_func = 0;
+	    ap->cr1 &= ~(CR_AWDEN | CR_AWDIE);
+	    ap->sr = ~SR_AWD;
+	    if ( func )
+		( *func ) ();
+	    seen = 1;
+	}
+
+	/* With DMA running we still get EOC, but the
+	 * interrupt is off and the DMA clears it.
+	 */
 	if ( ap->sr & SR_EOC ) {
 	    // x = ap->dr;
 	    // y = ADC_SUPPLY * x / 4096;
 	    // printf ( "ADC eoc: %08x %d %d\n", x, x, y );
 	    adc_val = ap->dr;
 	    adc_finished = 1;
-	} else {
+	} else if ( ! seen ) {
 	    serial_puts ( "unexpected ADC interrupt\n" );
 	}
 }
 
 int
-adc_read ( void )
+adc_read_raw ( void )
 {
 	int tmo;
 
@@ -198,7 +312,34 @@ adc_read ( void )
 	    printf ( "ADC read timeout %d, %08x\n", tmo, adc_val );
 	}
 
-	return ADC_SUPPLY * adc_val / 4096;
+	return adc_val;
+}
+
+int
+adc_read ( void )
+{
+	return adc_mv ( adc_read_raw () );
+}
+
+/* Take a few readings of Vrefint and the temperature
+ * sensor when nothing else is using the ADC.
+ * The scan and dual engines keep this up to date
+ * by themselves while they run.
+ */
+void
+adc_supply_measure ( void )
+{
+	int i;
+
+	if ( adc_scan_running () || adc_dual_running () )
+	    return;
+
+	adc_set_chan ( CHAN_VREF );
+	for ( i=0; i<4 << SUPPLY_SHIFT; i++ )
+	    adc_supply_update ( adc_read_raw () );
+
+	adc_set_chan ( CHAN_TEMP );
+	adc_temp_update ( adc_read_raw () );
 }
 
 void
@@ -234,6 +375,12 @@ adc_init ( void )
 
 	printf ( "ADC sr = %08x\n", ap->sr );
 	printf ( "ADC cr2 = %08x\n", ap->cr2 );
+
+	/* Vrefint wants 10 us after TSVREFE, we are well past that */
+	supply_16 = ADC_SUPPLY * 16;
+	adc_supply_measure ();
+	printf ( "ADC supply = %d mV, %d.%d C\n", adc_supply (),
+	    adc_temp_10 / 10, adc_temp_10 % 10 );
 }
 
 #define SAMP_1		0	/* 000: 1.5 cycles */
@@ -255,6 +402,10 @@ adc_set_chan ( int chan )
 {
 	struct adc *ap = ADC1_BASE;
 
+	/* The scan engine owns the sequence while it runs */
+	if ( adc_scan_running () || adc_dual_running () )
+	    return;
+
 	ap->sqr1 = 0;
 	ap->sqr2 = 0;
 	ap->sqr3 = chan;
@@ -291,4 +442,699 @@ adc_off ( void )
 	ap->cr2 &= ~CR_ON;
 }
 
+/* ---------------------------------------------------------- */
+
+/* The analog watchdog.
+ *
+ * The ADC compares every conversion on one channel
+ * against a low and high threshold, and interrupts the
+ * moment one falls outside.  This works no matter who
+ * is running the ADC (single, scan or dual mode) and
+ * costs nothing until it fires, so it is the thing
+ * to use to get the load off a cell right away.
+ *
+ * Thresholds are in millivolts at the ADC pin.
+ * func gets called from the interrupt, once.
+ */
+void
+adc_watchdog ( int chan, int low, int high, void (*func) ( void ) )
+{
+	struct adc *ap = ADC1_BASE;
+
+	awd_func = func;
+
+	ap->cr1 &= ~(CR_AWDEN | CR_AWDIE | CR_AWDSGL | AWDCH_MASK);
+	ap->ltr = adc_counts ( low );
+	ap->htr = high >= adc_supply () ? 0xfff : adc_counts ( high );
+	ap->sr = ~SR_AWD;
+
+	ap->cr1 |= CR_AWDSGL | chan | CR_AWDEN | CR_AWDIE;
+}
+
+void
+adc_watchdog_off ( void )
+{
+	struct adc *ap = ADC1_BASE;
+
+	ap->cr1 &= ~(CR_AWDEN | CR_AWDIE | CR_AWDSGL | AWDCH_MASK);
+	awd_func = 0;
+}
+
+/* ---------------------------------------------------------- */
+
+/* The scan engine.
+ *
+ * Instead of one conversion at a time, we give the ADC a
+ * list of up to 16 channels and let it convert them over
+ * and over (scan + continuous mode).  DMA 1 channel 1 moves
+ * the results into a circular buffer split into two halves.
+ * We get an interrupt when each half fills (and the DMA goes
+ * on with the other half), average each channel over that
+ * half and hand the half to a callback if there is one.
+ *
+ * With the sample times set in adc_init() (239.5 cycles)
+ * each conversion takes 21 microseconds, so a half of 256
+ * samples comes every 5.4 ms no matter how many channels.
+ *
+ * Each half holds a whole number of scans, so a channel
+ * is always at the same offset in it.
+ *
+ * Free running is fine for a quick look, but the rate
+ * depends on the sample times.  For logging we can instead
+ * have timer 3 start each scan (adc_scan_rate), which gives
+ * us an exact sample rate with nothing for the cpu to do
+ * per sample.  On top of that is a boxcar decimator: the
+ * interrupt sums N scans per channel and then posts one
+ * result, so we get quieter readings at the logging rate.
+ * Results are millivolts in 12.4 fixed point (mV * 16),
+ * averaging 16 or more samples makes the extra bits mean
+ * something.
+ */
+
+struct dma_chan {
+	volatile unsigned long ccr;
+	volatile unsigned long cndtr;
+	volatile unsigned long cpar;
+	volatile unsigned long cmar;
+	    long	_pad;
+};
+
+struct dma {
+	volatile unsigned long isr;
+	volatile unsigned long ifcr;
+	struct dma_chan chan[7];
+};
+
+#define DMA1_BASE	(struct dma *) 0x40020000
+
+/* ADC1 is hardwired to DMA 1 channel 1 */
+#define ADC_DMA_CHAN	0
+#define DMA1_CH1_IRQ	11
+
+/* Bits in ccr */
+#define CCR_EN		0x0001
+#define CCR_TCIE	0x0002
+#define CCR_HTIE	0x0004
+#define CCR_CIRC	0x0020
+#define CCR_MINC	0x0080
+#define CCR_PSIZE_16	0x0100
+#define CCR_PSIZE_32	0x0200
+#define CCR_MSIZE_16	0x0400
+#define CCR_MSIZE_32	0x0800
+#define CCR_PL_HIGH	0x2000
+
+/* Bits in isr and ifcr for channel 1 */
+#define DMA_GIF1	0x1
+#define DMA_TCIF1	0x2
+#define DMA_HTIF1	0x4
+
+#define SCAN_MAX	16
+#define SCAN_HALF	256
+
+static unsigned short scan_buf[2*SCAN_HALF];
+
+static int scan_chans[SCAN_MAX];
+static int scan_nchan;
+static int scan_user;		/* how many the caller asked for */
+static int scan_vref;		/* where Vrefint is in the list */
+static int scan_temp;		/* and the temperature sensor */
+static int scan_depth;		/* scans per half */
+static volatile int scan_on;
+
+/* Averages (raw counts) from the last half */
+static volatile int scan_avg[SCAN_MAX];
+static volatile int scan_halves;
+
+static void (*scan_callback) ( unsigned short *, int );
+
+/* 0 is free running */
+static int scan_rate;
+
+/* The decimator.
+ * The sum for 16384 samples of 4095 times 16 just fits
+ * in an int, so that is the limit.
+ */
+#define DEC_MAX		16384
+#define DEC_RING	4
+
+static int dec_n;
+static int dec_count;
+static int dec_sum[SCAN_MAX];
+
+static int dec_out[DEC_RING][SCAN_MAX];
+static volatile int dec_seq;
+static int dec_taken;
+static int dec_overrun;
+
+static void
+adc_decimate ( unsigned short *buf )
+{
+	int *out;
+	int i, j;
+
+	for ( j=0; j<scan_depth; j++ ) {
+	    for ( i=0; i<scan_nchan; i++ )
+		dec_sum[i] += *buf++;
+
+	    if ( ++dec_count < dec_n )
+		continue;
+
+	    out = dec_out[dec_seq % DEC_RING];
+	    for ( i=0; i<scan_nchan; i++ ) {
+		out[i] = adc_mv ( (dec_sum[i] * 16) / dec_n );
+		dec_sum[i] = 0;
+	    }
+	    dec_count = 0;
+	    dec_seq++;
+	}
+}
+
+static void adc_dual_half ( int );
+static volatile int dual_on;
+
+void
+dma1_ch1_handler ( void )
+{
+	struct dma *dp = DMA1_BASE;
+	unsigned short *buf;
+	int isr;
+	int sum;
+	int i, j;
+
+	isr = dp->isr;
+	dp->ifcr = DMA_GIF1;
+
+	if ( dual_on ) {
+	    adc_dual_half ( isr );
+	    return;
+	}
+
+	if ( isr & DMA_HTIF1 )
+	    buf = &scan_buf[0];
+	else if ( isr & DMA_TCIF1 )
+	    buf = &scan_buf[scan_depth * scan_nchan];
+	else
+	    return;
+
+	for ( i=0; i<scan_nchan; i++ ) {
+	    sum = 0;
+	    for ( j=0; j<scan_depth; j++ )
+		sum += buf[j*scan_nchan + i];
+	    scan_avg[i] = sum / scan_depth;
+	}
+
+	adc_supply_update ( scan_avg[scan_vref] );
+	if ( scan_temp >= 0 )
+	    adc_temp_update ( scan_avg[scan_temp] );
+
+	scan_halves++;
+
+	if ( dec_n )
+	    adc_decimate ( buf );
+
+	if ( scan_callback )
+	    ( *scan_callback ) ( buf, scan_depth );
+}
+
+/* Load the sequence registers from a list.
+ * 6 channels each in sqr3 and sqr2, 4 in sqr1
+ * along with the count (minus 1).
+ */
+static void
+adc_set_seq ( int *chans, int n )
+{
+	struct adc *ap = ADC1_BASE;
+	unsigned long sq[3];
+	int i;
+
+	sq[0] = sq[1] = sq[2] = 0;
+	for ( i=0; i<n; i++ )
+	    sq[i/6] |= chans[i] << (5 * (i%6));
+
+	ap->sqr3 = sq[0];
+	ap->sqr2 = sq[1];
+	ap->sqr1 = sq[2] | (n-1) << 20;
+}
+
+/* Have timer 3 start each scan at rate scans per second,
+ * and deliver one result for every decim scans.
+ * rate of 0 goes back to free running.
+ * decim of 0 turns off the decimator.
+ * Takes effect at the next adc_scan_start().
+ */
+void
+adc_scan_rate ( int rate, int decim )
+{
+	if ( decim > DEC_MAX )
+	    decim = DEC_MAX;
+
+	scan_rate = rate;
+	dec_n = decim;
+}
+
+/* Fetch the next decimated result into vals (one per
+ * channel in scan order, mV * 16).  Returns the result
+ * number, counting from 1, or 0 if there is nothing new.
+ * The result number times decim / rate is the time in
+ * seconds since the scan started.
+ * If we fall more than DEC_RING behind we skip ahead and
+ * count the loss.
+ */
+int
+adc_decim_get ( int *vals )
+{
+	int seq = dec_seq;
+	int *out;
+	int i;
+
+	if ( seq == dec_taken )
+	    return 0;
+
+	if ( seq - dec_taken > DEC_RING - 1 ) {
+	    dec_overrun += seq - dec_taken - 1;
+	    dec_taken = seq - 1;
+	}
+
+	out = dec_out[dec_taken % DEC_RING];
+	for ( i=0; i<scan_user; i++ )
+	    vals[i] = out[i];
+
+	return ++dec_taken;
+}
+
+/* The callback gets the half buffer and the number of scans
+ * in it.  Each scan is the channels given to adc_scan_start()
+ * followed by Vrefint and the temperature sensor if they
+ * were not in the list already (see adc_scan_start).
+ * It runs in the DMA interrupt, so keep it quick.
+ * Pass 0 to get rid of it.
+ */
+void
+adc_scan_callback ( void (*func) ( unsigned short *, int ) )
+{
+	scan_callback = func;
+}
+
+void
+adc_scan_start ( int *chans, int n )
+{
+	struct adc *ap = ADC1_BASE;
+	struct dma *dp = DMA1_BASE;
+	struct dma_chan *cp = &dp->chan[ADC_DMA_CHAN];
+	int i;
+
+	if ( n < 1 || n > SCAN_MAX )
+	    return;
+
+	adc_scan_stop ();
+	adc_dual_stop ();
+
+	scan_vref = -1;
+	scan_temp = -1;
+	for ( i=0; i<n; i++ ) {
+	    scan_chans[i] = chans[i];
+	    if ( chans[i] < 8 )
+		gpio_a_analog ( chans[i] );
+	    if ( chans[i] == CHAN_VREF )
+		scan_vref = i;
+	    if ( chans[i] == CHAN_TEMP )
+		scan_temp = i;
+	}
+	scan_user = n;
+
+	/* Tack Vrefint (and the temperature if there is room)
+	 * on the end, so the supply estimate stays current.
+	 */
+	if ( scan_vref < 0 ) {
+	    if ( n == SCAN_MAX )
+		return;
+	    scan_vref = n;
+	    scan_chans[n++] = CHAN_VREF;
+	}
+	if ( scan_temp < 0 && n < SCAN_MAX ) {
+	    scan_temp = n;
+	    scan_chans[n++] = CHAN_TEMP;
+	}
+
+	for ( i=0; i<n; i++ )
+	    scan_avg[i] = 0;
+
+	scan_nchan = n;
+	scan_depth = SCAN_HALF / n;
+	scan_halves = 0;
+
+	/* At slow rates a full half could take a long time,
+	 * so keep the halves no bigger than one result.
+	 */
+	if ( scan_rate && dec_n && dec_n < scan_depth )
+	    scan_depth = dec_n;
+
+	dec_count = 0;
+	dec_seq = 0;
+	dec_taken = 0;
+	dec_overrun = 0;
+	for ( i=0; i<n; i++ )
+	    dec_sum[i] = 0;
+
+	adc_set_seq ( scan_chans, n );
+
+	cp->cpar = (unsigned long) &ap->dr;
+	cp->cmar = (unsigned long) scan_buf;
+	cp->cndtr = 2 * scan_depth * n;
+	cp->ccr = CCR_MINC | CCR_CIRC | CCR_PSIZE_16 | CCR_MSIZE_16 |
+	    CCR_PL_HIGH | CCR_HTIE | CCR_TCIE;
+	cp->ccr |= CCR_EN;
+
+	nvic_enable ( DMA1_CH1_IRQ );
+
+	/* No more EOC interrupts, the DMA reads the data register */
+	ap->cr1 &= ~CR_EOCIE;
+	ap->cr1 |= CR_SCAN;
+	scan_on = 1;
+
+	if ( scan_rate ) {
+	    ap->cr2 &= ~(7 << EXTSEL_SHIFT);
+	    ap->cr2 |= CR_DMA | (EV_T3_TRG0 << EXTSEL_SHIFT);
+	    timer3_trgo ( scan_rate );
+	} else {
+	    ap->cr2 |= CR_DMA | CR_CONT;
+	    ap->cr2 |= CR_SWSTART;
+	}
+}
+
+/* Back to one conversion at a time */
+void
+adc_scan_stop ( void )
+{
+	struct adc *ap = ADC1_BASE;
+	struct dma *dp = DMA1_BASE;
+
+	if ( ! scan_on )
+	    return;
+
+	timer3_stop ();
+
+	ap->cr2 &= ~(CR_DMA | CR_CONT | (7 << EXTSEL_SHIFT));
+	ap->cr2 |= EV_SW << EXTSEL_SHIFT;
+	ap->cr1 &= ~CR_SCAN;
+
+	/* let the last conversion finish (21 us) */
+	delay_ms ( 1 );
+	(void) ap->dr;
+	ap->sr &= ~SR_START;
+
+	dp->chan[ADC_DMA_CHAN].ccr = 0;
+	dp->ifcr = DMA_GIF1;
+
+	scan_on = 0;
+
+	ap->cr1 |= CR_EOCIE;
+	adc_set_chan ( scan_chans[0] );
+}
+
+int
+adc_scan_running ( void )
+{
+	return scan_on;
+}
+
+/* Average for a channel over the last half buffer,
+ * in millivolts like adc_read(), or -1 if the channel
+ * is not being scanned.
+ */
+int
+adc_scan_value ( int chan )
+{
+	int i;
+
+	if ( ! scan_on || scan_halves == 0 )
+	    return -1;
+
+	for ( i=0; i<scan_nchan; i++ )
+	    if ( scan_chans[i] == chan )
+		return adc_mv ( scan_avg[i] );
+
+	return -1;
+}
+
+void
+adc_scan_show ( void )
+{
+	int i;
+
+	if ( ! scan_on ) {
+	    printf ( "Scan not running\n" );
+	    return;
+	}
+
+	printf ( "Scan: %d channels, %d per half, %d halves\n",
+	    scan_nchan, scan_depth, scan_halves );
+	if ( scan_rate )
+	    printf ( " %d scans/s, decimate by %d, %d results, %d lost\n",
+		scan_rate, dec_n, dec_seq, dec_overrun );
+	for ( i=0; i<scan_nchan; i++ )
+	    printf ( " chan %2d: %4d (%d mV)\n", scan_chans[i], scan_avg[i],
+		adc_mv ( scan_avg[i] ) );
+	printf ( " supply %d mV, temp %d.%d C\n", adc_supply (),
+	    adc_temp_10 / 10, adc_temp_10 % 10 );
+}
+
+/* ---------------------------------------------------------- */
+
+/* Dual mode.
+ *
+ * ADC1 and ADC2 can run as master and slave.  In regular
+ * simultaneous mode a trigger on ADC1 starts a conversion
+ * on both at the same instant, each on its own channel.
+ * ADC1 has the result from ADC2 in the top half of its
+ * data register, so one 32 bit DMA transfer moves a pair.
+ * This is how we get voltage and current at the same
+ * moment, which matters when the load is switching.
+ *
+ * The two ADC must not convert the same channel at
+ * the same time, and the internal channels (16, 17)
+ * are only on ADC1.
+ *
+ * To keep the supply estimate going, each trigger runs a
+ * scan of two: ADC1 does chan1 then Vrefint, while ADC2
+ * does chan2 twice.  So the buffer alternates, the even
+ * words are the real pairs and the odd words have Vrefint
+ * in the low half.
+ *
+ * This shares DMA 1 channel 1 (and timer 3 for pacing)
+ * with the scan engine, so only one runs at a time.
+ */
+
+/* DUALMOD in CR1 */
+#define DUALMOD_SHIFT	16
+#define DUAL_INDEP	0
+#define DUAL_REG_SIM	6
+
+#define DUAL_HALF	128		/* words, DUAL_SEQ per scan */
+#define DUAL_SEQ	2
+
+static unsigned long dual_buf[2*DUAL_HALF];
+
+/* Averages (raw counts) over the last half */
+static volatile int dual_avg1;
+static volatile int dual_avg2;
+static volatile int dual_halves;
+
+static void (*dual_callback) ( unsigned long *, int );
+
+static void
+adc_dual_half ( int isr )
+{
+	unsigned long *buf;
+	int sum1, sum2;
+	int vref;
+	int i;
+
+	if ( isr & DMA_HTIF1 )
+	    buf = &dual_buf[0];
+	else if ( isr & DMA_TCIF1 )
+	    buf = &dual_buf[DUAL_HALF];
+	else
+	    return;
+
+	sum1 = sum2 = vref = 0;
+	for ( i=0; i<DUAL_HALF; i += DUAL_SEQ ) {
+	    sum1 += buf[i] & 0xffff;
+	    sum2 += buf[i] >> 16;
+	    vref += buf[i+1] & 0xffff;
+	}
+	dual_avg1 = sum1 / (DUAL_HALF / DUAL_SEQ);
+	dual_avg2 = sum2 / (DUAL_HALF / DUAL_SEQ);
+	adc_supply_update ( vref / (DUAL_HALF / DUAL_SEQ) );
+	dual_halves++;
+
+	if ( dual_callback )
+	    ( *dual_callback ) ( buf, DUAL_HALF / DUAL_SEQ );
+}
+
+/* ADC2 only gets powered up for dual mode.
+ * It must not have its own trigger, so we
+ * leave it on SWSTART and never set it.
+ */
+static void
+adc2_init ( int chan )
+{
+	struct adc *ap = ADC2_BASE;
+
+	ap->cr2 = CR_ON | CR_EXTTRIG | (EV_SW << EXTSEL_SHIFT);
+	delay_ms ( 1 );
+
+	ap->cr2 |= CR_RSTCAL;
+	while ( ap->cr2 & CR_RSTCAL )
+	    ;
+	ap->cr2 |= CR_CAL;
+	while ( ap->cr2 & CR_CAL )
+	    ;
+
+	/* same sample times as ADC1 */
+	ap->smpr1 = 0x00ffffff;
+	ap->smpr2 = 0x3fffffff;
+
+	ap->sqr1 = (DUAL_SEQ-1) << 20;
+	ap->sqr2 = 0;
+	ap->sqr3 = chan | chan << 5;
+	ap->cr1 |= CR_SCAN;
+}
+
+/* The callback gets the half buffer and the number of scans.
+ * Each word has the ADC1 result in the low 16 bits and
+ * the ADC2 result in the high 16 bits, and each scan is
+ * DUAL_SEQ words with the chan1/chan2 pair first.
+ */
+void
+adc_dual_callback ( void (*func) ( unsigned long *, int ) )
+{
+	dual_callback = func;
+}
+
+/* chan1 is converted by ADC1, chan2 by ADC2.
+ * If adc_scan_rate() has set a rate, timer 3 paces
+ * the pairs, otherwise they run free (one pair per
+ * 42 us with our sample times, Vrefint takes the other 21).
+ */
+void
+adc_dual_start ( int chan1, int chan2 )
+{
+	struct adc *ap = ADC1_BASE;
+	struct adc *ap2 = ADC2_BASE;
+	struct dma *dp = DMA1_BASE;
+	struct dma_chan *cp = &dp->chan[ADC_DMA_CHAN];
+
+	adc_scan_stop ();
+	adc_dual_stop ();
+
+	gpio_a_analog ( chan1 );
+	gpio_a_analog ( chan2 );
+
+	adc2_init ( chan2 );
+
+	ap->sqr1 = (DUAL_SEQ-1) << 20;
+	ap->sqr2 = 0;
+	ap->sqr3 = chan1 | CHAN_VREF << 5;
+
+	dual_avg1 = 0;
+	dual_avg2 = 0;
+	dual_halves = 0;
+
+	cp->cpar = (unsigned long) &ap->dr;
+	cp->cmar = (unsigned long) dual_buf;
+	cp->cndtr = 2 * DUAL_HALF;
+	cp->ccr = CCR_MINC | CCR_CIRC | CCR_PSIZE_32 | CCR_MSIZE_32 |
+	    CCR_PL_HIGH | CCR_HTIE | CCR_TCIE;
+	cp->ccr |= CCR_EN;
+
+	nvic_enable ( DMA1_CH1_IRQ );
+
+	ap->cr1 &= ~CR_EOCIE;
+	ap->cr1 |= CR_SCAN | DUAL_REG_SIM << DUALMOD_SHIFT;
+	dual_on = 1;
+
+	if ( scan_rate ) {
+	    ap->cr2 &= ~(7 << EXTSEL_SHIFT);
+	    ap->cr2 |= CR_DMA | (EV_T3_TRG0 << EXTSEL_SHIFT);
+	    timer3_trgo ( scan_rate );
+	} else {
+	    ap2->cr2 |= CR_CONT;
+	    ap->cr2 |= CR_DMA | CR_CONT;
+	    ap->cr2 |= CR_SWSTART;
+	}
+}
+
+void
+adc_dual_stop ( void )
+{
+	struct adc *ap = ADC1_BASE;
+	struct adc *ap2 = ADC2_BASE;
+	struct dma *dp = DMA1_BASE;
+
+	if ( ! dual_on )
+	    return;
+
+	timer3_stop ();
+
+	ap->cr2 &= ~(CR_DMA | CR_CONT | (7 << EXTSEL_SHIFT));
+	ap->cr2 |= EV_SW << EXTSEL_SHIFT;
+	ap2->cr2 &= ~CR_CONT;
+
+	delay_ms ( 1 );
+	(void) ap->dr;
+	ap->sr &= ~SR_START;
+
+	ap->cr1 &= ~(CR_SCAN | 0xf << DUALMOD_SHIFT);
+	ap2->cr1 = 0;
+	ap2->cr2 = 0;
+
+	dp->chan[ADC_DMA_CHAN].ccr = 0;
+	dp->ifcr = DMA_GIF1;
+
+	dual_on = 0;
+
+	ap->cr1 |= CR_EOCIE;
+	adc_set_chan ( ap->sqr3 & 0x1f );
+}
+
+int
+adc_dual_running ( void )
+{
+	return dual_on;
+}
+
+/* How many scans have landed in the half being filled.
+ * Along with a count of finished halves this says
+ * which sample is being converted right now.
+ */
+int
+adc_dual_position ( void )
+{
+	struct dma *dp = DMA1_BASE;
+
+	return ((2 * DUAL_HALF - dp->chan[ADC_DMA_CHAN].cndtr) % DUAL_HALF) / DUAL_SEQ;
+}
+
+/* Wait for the next half buffer and return both
+ * averages over it in millivolts.
+ * Returns 0 if dual mode is not running.
+ */
+int
+adc_dual_get ( int *mv1, int *mv2 )
+{
+	int seq;
+
+	if ( ! dual_on )
+	    return 0;
+
+	seq = dual_halves;
+	while ( dual_halves == seq )
+	    cpu_idle ();
+
+	*mv1 = adc_mv ( dual_avg1 );
+	*mv2 = adc_mv ( dual_avg2 );
+	return 1;
+}
+
 /* THE END */
@@ -0,0 +1,315 @@
+/* cells.c
+ * (c) Tom Trebisky  12-17-2023
+ *
+ * Test several cells at once.
+ *
+ * Each cell gets its own relay and load resistor and its
+ * own divider into an ADC channel, wired just like the
+ * single cell setup in lithium.c (which is cell 0 here).
+ * One scan sequence (see adc.c) samples all of them,
+ * paced by timer 3 and decimated down to one result every
+ * CELL_TICK_MS.  Each result steps a little state machine
+ * per cell, so nothing ever waits on any one cell:
+ *
+ *  IDLE -> RINT_OPEN -> RINT_LOAD -> DISCHARGE -> RECOVER -> DONE
+ *
+ * There is no shunt per cell, so the current comes from
+ * the nominal load resistance, as it used to for one cell.
+ *
+ * Records go out as lines that start with "C" and the
+ * cell number, so they can be pulled apart on the host:
+ *   C cell time mV state uAh
+ * and when a cell finishes:
+ *   C cell done uAh rint
+ *
+ * The analog watchdog can only watch one channel, so the
+ * cutoff here is in software, at worst CELL_TICK_MS late.
+ */
+
+#include "eeprom.h"
+
+/* Settings, see eeprom.c */
+#define SCALE		eeprom_get ( KEY_SCALE )
+#define RLOAD		eeprom_get ( KEY_RLOAD )	/* milliohms */
+#define CAL_TERM	eeprom_get ( KEY_TERM )
+
+#ifndef NCELLS
+#define NCELLS		4
+#endif
+
+#define MAX_CELLS	8
+
+#define CELL_RATE	1000		/* scans per second */
+#define CELL_TICK_MS	100		/* one result this often */
+#define CELL_DECIM	(CELL_RATE * CELL_TICK_MS / 1000)
+
+#define TICKS_PER_S	(1000 / CELL_TICK_MS)
+
+#define RINT_SETTLE	(TICKS_PER_S / 2)
+#define REPORT_TICKS	(60 * TICKS_PER_S)	/* once a minute */
+#define RECOVER_TICKS	(10 * TICKS_PER_S)
+#define RECOVER_REPORT	(2 * TICKS_PER_S)
+
+enum cell_state { IDLE, RINT_OPEN, RINT_LOAD, DISCHARGE, RECOVER, DONE };
+
+static char *state_names[] = {
+    "idle", "rint_open", "rint_load", "discharge", "recover", "done"
+};
+
+#define PORT_A	0
+#define PORT_B	1
+
+struct cell {
+	int chan;		/* ADC channel */
+	int port;		/* relay gpio */
+	int bit;
+	enum cell_state state;
+	int ticks;		/* in this state */
+	int time;		/* ticks since start */
+	int mv;			/* latest reading */
+	int v_open;
+	int rint;		/* milliohms */
+	int charge;		/* mA * ticks */
+};
+
+/* Cell 0 is the original hardware: A0 and the relay on A2.
+ * A3 is the shunt, so the rest skip it.
+ */
+static struct cell cells[MAX_CELLS] = {
+    { 0, PORT_A, 2 },
+    { 1, PORT_B, 12 },
+    { 4, PORT_B, 13 },
+    { 5, PORT_B, 14 },
+    { 6, PORT_B, 15 },
+    { 7, PORT_B, 5 },
+    { 8, PORT_B, 6 },
+    { 9, PORT_B, 7 },
+};
+
+static int ncells;
+
+static void
+cell_relay ( struct cell *cp, int closed )
+{
+	if ( cp->port == PORT_A )
+	    gpio_a_set ( cp->bit, closed );
+	else
+	    gpio_b_set ( cp->bit, closed );
+}
+
+static int
+cell_uah ( struct cell *cp )
+{
+	return cp->charge / (3600 / CELL_TICK_MS);
+}
+
+static void
+cell_record ( int n, struct cell *cp )
+{
+	telem_cell ( n, cp->time / TICKS_PER_S, cp->mv,
+	    cp->state, cell_uah ( cp ) );
+	if ( ! telem_enabled () )
+	    printf ( "C %d %d %d %d %d\n", n, cp->time / TICKS_PER_S, cp->mv,
+		cp->state, cell_uah ( cp ) );
+}
+
+static void
+cell_enter ( struct cell *cp, enum cell_state state )
+{
+	cp->state = state;
+	cp->ticks = 0;
+}
+
+/* One step for one cell with a fresh reading */
+static void
+cell_step ( int n, struct cell *cp )
+{
+	cp->ticks++;
+	cp->time++;
+
+	switch ( cp->state ) {
+	case RINT_OPEN:
+	    if ( cp->ticks < RINT_SETTLE )
+		break;
+	    cp->v_open = cp->mv;
+	    /* nothing there, or already flat */
+	    if ( cp->v_open < CAL_TERM ) {
+		printf ( "C %d empty %d\n", n, cp->v_open );
+		cell_enter ( cp, DONE );
+		break;
+	    }
+	    cell_relay ( cp, 1 );
+	    cell_enter ( cp, RINT_LOAD );
+	    break;
+
+	case RINT_LOAD:
+	    cp->charge += cp->mv * 1000 / RLOAD;
+	    if ( cp->ticks < RINT_SETTLE )
+		break;
+	    cp->rint = (cp->v_open - cp->mv) * RLOAD / cp->mv;
+	    printf ( "C %d rint %d\n", n, cp->rint );
+	    cell_enter ( cp, DISCHARGE );
+	    cell_record ( n, cp );
+	    break;
+
+	case DISCHARGE:
+	    cp->charge += cp->mv * 1000 / RLOAD;
+	    if ( cp->mv < CAL_TERM ) {
+		cell_relay ( cp, 0 );
+		cell_record ( n, cp );
+		cell_enter ( cp, RECOVER );
+		break;
+	    }
+	    if ( (cp->ticks % REPORT_TICKS) == 0 )
+		cell_record ( n, cp );
+	    break;
+
+	case RECOVER:
+	    if ( (cp->ticks % RECOVER_REPORT) == 0 )
+		cell_record ( n, cp );
+	    if ( cp->ticks < RECOVER_TICKS )
+		break;
+	    cell_enter ( cp, DONE );
+	    telem_cell_done ( n, cell_uah ( cp ), cp->rint );
+	    if ( ! telem_enabled () )
+		printf ( "C %d done %d %d\n", n, cell_uah ( cp ), cp->rint );
+	    break;
+
+	case IDLE:
+	case DONE:
+	    break;
+	}
+}
+
+void
+cells_init ( void )
+{
+	struct cell *cp;
+	int i;
+
+	ncells = NCELLS;
+	if ( ncells > MAX_CELLS )
+	    ncells = MAX_CELLS;
+
+	for ( i=0; i<ncells; i++ ) {
+	    cp = &cells[i];
+	    cell_relay ( cp, 0 );
+	    if ( cp->port == PORT_A )
+		gpio_a_output ( cp->bit );
+	    else
+		gpio_b_output ( cp->bit );
+	    if ( cp->chan >= 8 )
+		gpio_b_analog ( cp->chan - 8 );
+	    cell_enter ( cp, IDLE );
+	}
+}
+
+static void
+cells_status ( void )
+{
+	struct cell *cp;
+	int i;
+
+	for ( i=0; i<ncells; i++ ) {
+	    cp = &cells[i];
+	    printf ( "Cell %d: chan %d, %s, %d mV, %d uAh, rint %d\n",
+		i, cp->chan, state_names[cp->state], cp->mv,
+		cell_uah ( cp ), cp->rint );
+	}
+}
+
+static void
+cells_stop ( void )
+{
+	int i;
+
+	for ( i=0; i<ncells; i++ )
+	    cell_relay ( &cells[i], 0 );
+	adc_scan_stop ();
+	adc_scan_rate ( 0, 0 );
+}
+
+/* Gather a command line without blocking.
+ * Returns 1 when a whole line is in buf.
+ */
+static int
+cells_getl ( char *buf, int *len )
+{
+	int c;
+
+	while ( serial_check () ) {
+	    c = serial_getc ();
+	    if ( c == '\r' || c == '\n' ) {
+		buf[*len] = '\0';
+		*len = 0;
+		return 1;
+	    }
+	    if ( *len < 79 )
+		buf[(*len)++] = c;
+	}
+	return 0;
+}
+
+/* Run all the cells until they are done.
+ * While this runs "status" shows where everyone is
+ * and "stop" opens every relay and gives up.
+ */
+void
+cells_run ( void )
+{
+	int chans[MAX_CELLS];
+	int vals[MAX_CELLS];
+	char buf[80];
+	int len = 0;
+	int busy;
+	int i;
+
+	for ( i=0; i<ncells; i++ ) {
+	    chans[i] = cells[i].chan;
+	    cells[i].time = 0;
+	    cells[i].charge = 0;
+	    cells[i].rint = 0;
+	    cell_enter ( &cells[i], RINT_OPEN );
+	}
+
+	adc_scan_rate ( CELL_RATE, CELL_DECIM );
+	adc_scan_start ( chans, ncells );
+
+	printf ( "Testing %d cells\n", ncells );
+
+	for ( ;; ) {
+	    if ( cells_getl ( buf, &len ) ) {
+		if ( my_cmp ( buf, "status" ) )
+		    cells_status ();
+		else if ( my_cmp ( buf, "stop" ) ) {
+		    printf ( "Stopped\n" );
+		    break;
+		}
+	    }
+
+	    /* Sleep until something happens, the ADC interrupts
+	     * every half buffer, and typed characters wait in the
+	     * uart Rx ring, so nothing is lost while we do.
+	     */
+	    if ( ! adc_decim_get ( vals ) ) {
+		flog_poll ();
+		cpu_idle ();
+		continue;
+	    }
+
+	    busy = 0;
+	    for ( i=0; i<ncells; i++ ) {
+		cells[i].mv = (vals[i] * 1000) / (SCALE * 16);
+		cell_step ( i, &cells[i] );
+		if ( cells[i].state != DONE )
+		    busy++;
+	    }
+	    if ( ! busy )
+		break;
+	}
+
+	cells_stop ();
+	cells_status ();
+}
+
+/* THE END */
@@ -0,0 +1,192 @@
+/* coulomb.c
+ * (c) Tom Trebisky  12-16-2023
+ *
+ * Coulomb counting for the lithium tester.
+ *
+ * Both ADC run in simultaneous mode (see adc.c), ADC1
+ * on the divided down cell voltage and ADC2 on the shunt
+ * in the ground return of the load.  Timer 3 paces them
+ * at COUL_RATE pairs per second, and every pair gets
+ * added in from the DMA interrupt.  We used to send one
+ * reading every 2 seconds and let the host add them up
+ * assuming a nominal load resistance.
+ *
+ * Each half buffer is summed in raw counts and then turned
+ * into millivolts with the supply estimate from adc.c as it
+ * stands right then, so a drifting supply does not skew
+ * the totals.  The sums are 64 bit, with 4 fraction bits:
+ *  q_sum is the sum of shunt mV * 16 (charge)
+ *  e_sum is the sum of cell mV times shunt mV * 16 (energy)
+ * 10 hours at 1000 Hz is 3.6e7 samples, which gives
+ * at most about 2e12 in q_sum and 1.1e16 in e_sum, and
+ * the conversions below stay inside 64 bits with that.
+ *
+ * We link without libgcc, so there is no 64 bit divide.
+ * udiv64() below is a plain shift and subtract divide
+ * that is only called when we print something.
+ */
+
+#include "eeprom.h"
+
+/* Settings, see eeprom.c */
+#define SCALE		eeprom_get ( KEY_SCALE )	/* divider on the cell, times 1000 */
+#define RSHUNT		eeprom_get ( KEY_RSHUNT )	/* milliohms */
+
+#define CHAN_BATTERY	0
+#define CHAN_SHUNT	3
+
+#define COUL_RATE	1000	/* pairs per second */
+
+typedef unsigned long long u64;
+
+/* Reading a 64 bit sum takes two loads, so
+ * keep the interrupt out while we do it.
+ */
+static inline void enable_irq() { __asm volatile("cpsie i"); }
+static inline void disable_irq() { __asm volatile("cpsid i"); }
+
+static volatile u64 q_sum;
+static volatile u64 e_sum;
+static volatile unsigned long coul_samples;
+
+/* Cell and shunt counts averaged over the last half */
+static volatile int coul_cell;
+static volatile int coul_shunt;
+
+static u64
+udiv64 ( u64 n, unsigned long d )
+{
+	u64 q = 0;
+	u64 r = 0;
+	int i;
+
+	for ( i=63; i>=0; i-- ) {
+	    r = (r << 1) | ((n >> i) & 1);
+	    if ( r >= d ) {
+		r -= d;
+		q |= (u64) 1 << i;
+	    }
+	}
+	return q;
+}
+
+/* Runs in the DMA interrupt for each half buffer.
+ * The shunt drop is in series with the cell,
+ * so the cell voltage is the divider reading
+ * scaled up plus the shunt reading.
+ * Each scan is 2 words, the V/I pair and then
+ * Vrefint, which adc.c has already dealt with.
+ */
+static void
+coulomb_half ( unsigned long *buf, int n )
+{
+	unsigned long q = 0;
+	u64 e = 0;
+	unsigned long v, s;
+	unsigned long vsum = 0;
+	unsigned long supply = adc_supply ();
+	unsigned long scale = SCALE;
+	int i;
+
+	for ( i=0; i<n; i++ ) {
+	    v = buf[2*i] & 0xffff;
+	    s = buf[2*i] >> 16;
+	    v = v * 1000 / scale + s;
+	    vsum += v;
+	    q += s;
+	    e += (u64) v * s;
+	}
+
+	/* counts * supply >> 12 is mV, keep 4 more bits */
+	q_sum += ((u64) q * supply) >> 8;
+	e = (e * supply) >> 12;
+	e_sum += (e * supply) >> 8;
+
+	coul_samples += n;
+	coul_cell = vsum / n;
+	coul_shunt = q / n;
+}
+
+void
+coulomb_start ( void )
+{
+	q_sum = 0;
+	e_sum = 0;
+	coul_samples = 0;
+
+	adc_scan_rate ( COUL_RATE, 0 );
+	adc_dual_callback ( coulomb_half );
+	adc_dual_start ( CHAN_BATTERY, CHAN_SHUNT );
+}
+
+void
+coulomb_stop ( void )
+{
+	adc_dual_stop ();
+	adc_dual_callback ( 0 );
+	adc_scan_rate ( 0, 0 );
+}
+
+/* Seconds since coulomb_start */
+int
+coulomb_time ( void )
+{
+	return coul_samples / COUL_RATE;
+}
+
+/* Milliseconds since coulomb_start, to the sample.
+ * Meant to be called from an interrupt (the analog
+ * watchdog) to say exactly when something happened.
+ */
+int
+coulomb_stamp ( void )
+{
+	unsigned long n = coul_samples + adc_dual_position ();
+
+	return (n / COUL_RATE) * 1000 + (n % COUL_RATE) * 1000 / COUL_RATE;
+}
+
+/* Charge so far in microamp hours.
+ * mV * 1000 / RSHUNT is milliamps,
+ * and mA * 1000 / (COUL_RATE * 3600) sums to uAh.
+ * q_sum is mV * 16, so 1000000 / 16 is 62500.
+ * The divisor is done unsigned, it fits 32 bits up to
+ * 1193 milliohms, and eeprom.c holds rshunt to 1000.
+ */
+int
+coulomb_uah ( void )
+{
+	u64 x;
+
+	disable_irq ();
+	x = q_sum;
+	enable_irq ();
+
+	return udiv64 ( x * 62500, (unsigned long) RSHUNT * (COUL_RATE * 3600) );
+}
+
+/* Energy so far in microwatt hours.
+ * mV (cell) times mA (shunt) is uW.
+ */
+int
+coulomb_uwh ( void )
+{
+	u64 x;
+
+	disable_irq ();
+	x = e_sum;
+	enable_irq ();
+
+	/* times 1000 / 16 */
+	return udiv64 ( (x * 125) >> 1, (unsigned long) RSHUNT * (COUL_RATE * 3600) );
+}
+
+/* Cell voltage (mV) and current (mA) from the latest half */
+void
+coulomb_now ( int *mv, int *ma )
+{
+	*mv = adc_mv ( coul_cell );
+	*ma = adc_mv ( coul_shunt ) * 1000 / RSHUNT;
+}
+
+/* THE END */
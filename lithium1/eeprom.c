@@ -0,0 +1,426 @@
+/* eeprom.c
+ * (c) Tom Trebisky  12-20-2023
+ *
+ * A small key/value store in flash, for the calibration
+ * numbers that used to be #defines scattered about
+ * (and copied between files with "these must match").
+ * Now each board can be trimmed from the console with
+ * "set rload 4950" and the change survives a reset.
+ *
+ * This is the usual EEPROM emulation (see ST AN2594).
+ * Two 1K pages just below the flash log (flog.c), only
+ * one of them in use at any time.  Each page starts with
+ * a header, then entries back to back:
+ *
+ *   header:  status  pad  gen (32 bits)
+ *   entry:   key  value (32 bits)  check
+ *
+ * all in 16 bit half words, since that is what we program.
+ * A new value is appended as a new entry, we never write
+ * over anything, so one page takes 127 changes before it
+ * has to be erased.  The last entry for a key wins.
+ * check is the other three xored and inverted, so an entry
+ * that was cut short by a reset does not pass.
+ *
+ * When a page fills we compact: the latest value of each key
+ * goes into the other page, that page is marked valid, and
+ * only then is the old one erased.  The status half word goes
+ * from 0xffff (erased) to RECEIVING to VALID (zero, which the
+ * flash lets us write over anything) and gen counts up each
+ * time, so if we get reset part way through, eeprom_init()
+ * can tell which page to believe.
+ *
+ * eeprom_init() reads the page once at boot and keeps every
+ * value in ram, after which eeprom_get() is an array lookup
+ * (it gets called from the ADC interrupt).  The boot scan is
+ * bounded by the page size, and is timed with the cycle counter.
+ */
+
+#include "eeprom.h"
+
+#define EE_BASE		0x0800b800	/* just below the flash log */
+#define PAGE_SIZE	1024
+
+#define EE_ERASED	0xffff
+#define EE_RECEIVING	0xeeee
+#define EE_VALID	0x0000
+
+#define HDR_SIZE	8
+#define ENT_SIZE	8
+
+/* Keys are small integers (eeprom.h), indexing this table.
+ * lo and hi bound what "set" will take, a zero in scale,
+ * rload or rshunt would be a divide by zero, and it would
+ * still be there after a reset.
+ */
+struct ee_key {
+	char *name;
+	int def;
+	int lo;
+	int hi;
+	char *desc;
+};
+
+static struct ee_key ee_keys[EE_NKEYS] = {
+	{ 0 },
+	{ "supply",	3310,	2000,	3600,	"Vcc (mV) until Vrefint says otherwise" },
+	{ "vref",	1200,	1100,	1300,	"Vrefint (mV), 1160 to 1260 by the datasheet" },
+	{ "scale",	681,	1,	1000,	"divider on the cell, times 1000" },
+	{ "rload",	5000,	100,	100000,	"load resistor (milliohms)" },
+	{ "rshunt",	100,	1,	1000,	"shunt resistor (milliohms)" },
+	{ "term",	3000,	2000,	4500,	"end of discharge (mV)" },
+	{ "safe",	2950,	2000,	4500,	"hard cutoff (mV)" },
+};
+
+static int ee_val[EE_NKEYS];
+static int ee_set[EE_NKEYS];		/* stored in flash */
+
+static int ee_page;			/* 0 or 1, in use */
+static int ee_next;			/* offset of next free entry */
+static unsigned long ee_gen;
+static int ee_entries;
+static unsigned long ee_load_cycles;
+static int ee_errors;
+
+static int
+ee_ok ( int key, int val )
+{
+	return val >= ee_keys[key].lo && val <= ee_keys[key].hi;
+}
+
+static unsigned long
+page_addr ( int page )
+{
+	return EE_BASE + page * PAGE_SIZE;
+}
+
+static int
+page_half ( int page, int off )
+{
+	return * (volatile unsigned short *) (page_addr ( page ) + off);
+}
+
+static unsigned long
+page_gen ( int page )
+{
+	return page_half ( page, 4 ) | page_half ( page, 6 ) << 16;
+}
+
+static void
+ee_prog ( int page, int off, int val )
+{
+	if ( flash_program ( page_addr ( page ) + off, val ) )
+	    ee_errors++;
+}
+
+static int
+ee_check ( int key, int lo, int hi )
+{
+	return ~(key ^ lo ^ hi) & 0xffff;
+}
+
+static void
+ee_append ( int page, int off, int key, int val )
+{
+	int lo = val & 0xffff;
+	int hi = (val >> 16) & 0xffff;
+
+	ee_prog ( page, off, key );
+	ee_prog ( page, off+2, lo );
+	ee_prog ( page, off+4, hi );
+	ee_prog ( page, off+6, ee_check ( key, lo, hi ) );
+}
+
+static void
+ee_erase ( int page )
+{
+	int off;
+
+	for ( off=0; off<PAGE_SIZE; off += 2 )
+	    if ( page_half ( page, off ) != 0xffff )
+		break;
+	if ( off == PAGE_SIZE )
+	    return;
+
+	if ( flash_erase ( page_addr ( page ) ) )
+	    ee_errors++;
+}
+
+/* Start a fresh page holding everything we have set.
+ * Called with the flash unlocked.
+ */
+static void
+ee_compact ( void )
+{
+	int new = ee_page ^ 1;
+	int key;
+	int off;
+
+	ee_erase ( new );
+
+	ee_gen++;
+	ee_prog ( new, 4, ee_gen & 0xffff );
+	ee_prog ( new, 6, ee_gen >> 16 );
+	ee_prog ( new, 0, EE_RECEIVING );
+
+	off = HDR_SIZE;
+	for ( key=1; key<EE_NKEYS; key++ ) {
+	    if ( ! ee_set[key] )
+		continue;
+	    ee_append ( new, off, key, ee_val[key] );
+	    off += ENT_SIZE;
+	}
+
+	ee_prog ( new, 0, EE_VALID );
+	ee_erase ( ee_page );
+
+	ee_page = new;
+	ee_next = off;
+	ee_entries = (off - HDR_SIZE) / ENT_SIZE;
+}
+
+/* Read the entries in a valid page into ram */
+static void
+ee_load ( int page )
+{
+	int off;
+	int key, lo, hi;
+
+	ee_entries = 0;
+	for ( off=HDR_SIZE; off<PAGE_SIZE; off += ENT_SIZE ) {
+	    key = page_half ( page, off );
+	    if ( key == 0xffff )
+		break;
+	    ee_entries++;
+	    lo = page_half ( page, off+2 );
+	    hi = page_half ( page, off+4 );
+	    if ( page_half ( page, off+6 ) != ee_check ( key, lo, hi ) )
+		continue;
+	    if ( key <= 0 || key >= EE_NKEYS )
+		continue;
+	    /* Left there before the range checks, keep the default */
+	    if ( ! ee_ok ( key, lo | hi << 16 ) )
+		continue;
+	    ee_val[key] = lo | hi << 16;
+	    ee_set[key] = 1;
+	}
+
+	ee_page = page;
+	ee_next = off;
+	ee_gen = page_gen ( page );
+}
+
+void
+eeprom_init ( void )
+{
+	unsigned long t;
+	int valid[2];
+	int page;
+	int i;
+
+	t = dwt_read ();
+
+	for ( i=0; i<EE_NKEYS; i++ ) {
+	    ee_val[i] = ee_keys[i].def;
+	    ee_set[i] = 0;
+	}
+
+	for ( i=0; i<2; i++ )
+	    valid[i] = page_half ( i, 0 ) == EE_VALID;
+
+	if ( valid[0] && valid[1] )
+	    page = page_gen ( 1 ) > page_gen ( 0 ) ? 1 : 0;
+	else if ( valid[0] || valid[1] )
+	    page = valid[1] ? 1 : 0;
+	else
+	    page = -1;
+
+	if ( page >= 0 ) {
+	    ee_load ( page );
+	    t = dwt_read () - t;
+
+	    /* Clean up after a compaction that got cut short */
+	    if ( page_half ( page ^ 1, 0 ) != EE_ERASED ) {
+		flash_unlock ();
+		ee_erase ( page ^ 1 );
+		flash_lock ();
+	    }
+	} else {
+	    /* Nothing there, or nothing we believe */
+	    flash_unlock ();
+	    ee_erase ( 0 );
+	    ee_erase ( 1 );
+	    ee_prog ( 0, 4, 1 );
+	    ee_prog ( 0, 6, 0 );
+	    ee_prog ( 0, 0, EE_VALID );
+	    flash_lock ();
+
+	    ee_page = 0;
+	    ee_next = HDR_SIZE;
+	    ee_gen = 1;
+	    ee_entries = 0;
+	    t = dwt_read () - t;
+	}
+
+	ee_load_cycles = t;
+	printf ( "EEPROM: page %d, gen %d, %d entries, loaded in %d us\n",
+	    ee_page, ee_gen, ee_entries, ee_load_cycles / 72 );
+}
+
+/* The value for a key, or its default if never set */
+int
+eeprom_get ( int key )
+{
+	if ( key <= 0 || key >= EE_NKEYS )
+	    return 0;
+	return ee_val[key];
+}
+
+/* Each change costs 4 half words, about 200 us, and every
+ * 127th one a compaction (two page erases, 40 ms).
+ * The cpu stalls while the flash is busy, so don't
+ * do this in the middle of a run.
+ */
+int
+eeprom_set ( int key, int val )
+{
+	if ( key <= 0 || key >= EE_NKEYS )
+	    return -1;
+	if ( ! ee_ok ( key, val ) )
+	    return -1;
+	if ( ee_set[key] && ee_val[key] == val )
+	    return 0;
+
+	ee_val[key] = val;
+	ee_set[key] = 1;
+
+	flash_unlock ();
+	if ( ee_next + ENT_SIZE > PAGE_SIZE )
+	    ee_compact ();
+	else {
+	    ee_append ( ee_page, ee_next, key, val );
+	    ee_next += ENT_SIZE;
+	    ee_entries++;
+	}
+	flash_lock ();
+
+	return 0;
+}
+
+/* ---------------------------------------------------------- */
+
+/* Console commands:
+ *   get		all keys
+ *   get name
+ *   set name value
+ */
+
+static char *
+skip_space ( char *s )
+{
+	while ( *s == ' ' )
+	    s++;
+	return s;
+}
+
+/* Match a name up to a space or the end */
+static int
+ee_lookup ( char **sp )
+{
+	char *s, *n;
+	int key;
+
+	for ( key=1; key<EE_NKEYS; key++ ) {
+	    s = *sp;
+	    n = ee_keys[key].name;
+	    while ( *n && *s == *n ) {
+		s++;
+		n++;
+	    }
+	    if ( ! *n && (*s == ' ' || ! *s) ) {
+		*sp = s;
+		return key;
+	    }
+	}
+	return 0;
+}
+
+static void
+ee_show_key ( int key )
+{
+	printf ( "%s = %d%s  (%s)\n", ee_keys[key].name, ee_val[key],
+	    ee_set[key] ? "" : " default", ee_keys[key].desc );
+}
+
+void
+eeprom_show ( void )
+{
+	int key;
+
+	for ( key=1; key<EE_NKEYS; key++ )
+	    ee_show_key ( key );
+
+	printf ( "EEPROM: page %d, gen %d, %d of %d entries used, %d errors\n",
+	    ee_page, ee_gen, ee_entries, (PAGE_SIZE - HDR_SIZE) / ENT_SIZE, ee_errors );
+	printf ( "Loaded in %d cycles (%d us)\n", ee_load_cycles, ee_load_cycles / 72 );
+}
+
+void
+eeprom_cmd_get ( char *args )
+{
+	int key;
+
+	args = skip_space ( args );
+	if ( ! *args ) {
+	    eeprom_show ();
+	    return;
+	}
+
+	key = ee_lookup ( &args );
+	if ( ! key ) {
+	    printf ( "No such key: %s\n", args );
+	    return;
+	}
+	ee_show_key ( key );
+}
+
+void
+eeprom_cmd_set ( char *args )
+{
+	int key;
+	int val = 0;
+	int neg = 0;
+
+	args = skip_space ( args );
+	key = ee_lookup ( &args );
+	if ( ! key ) {
+	    printf ( "No such key: %s\n", args );
+	    return;
+	}
+
+	args = skip_space ( args );
+	if ( *args == '-' ) {
+	    neg = 1;
+	    args++;
+	}
+	if ( *args < '0' || *args > '9' ) {
+	    printf ( "set %s what?\n", ee_keys[key].name );
+	    return;
+	}
+	/* stop short of overflow, anything that big is out of range */
+	while ( *args >= '0' && *args <= '9' && val < 1000000 )
+	    val = val * 10 + *args++ - '0';
+	if ( neg )
+	    val = -val;
+
+	if ( ! ee_ok ( key, val ) ) {
+	    printf ( "%s must be %d to %d\n", ee_keys[key].name,
+		ee_keys[key].lo, ee_keys[key].hi );
+	    return;
+	}
+
+	eeprom_set ( key, val );
+	ee_show_key ( key );
+}
+
+/* THE END */
@@ -0,0 +1,23 @@
+/* eeprom.h
+ * (c) Tom Trebisky  12-20-2023
+ *
+ * Keys for the settings kept in flash by eeprom.c,
+ * the one place they are defined.
+ * They index the table in eeprom.c, so add new ones
+ * there too.  Key 0 and 0xffff are never used.
+ */
+
+#define KEY_SUPPLY	1
+#define KEY_VREF	2
+#define KEY_SCALE	3
+#define KEY_RLOAD	4
+#define KEY_RSHUNT	5
+#define KEY_TERM	6
+#define KEY_SAFE	7
+
+#define EE_NKEYS	8
+
+int eeprom_get ( int );
+int eeprom_set ( int, int );
+
+/* THE END */
@@ -0,0 +1,126 @@
+/* flash.c
+ * (c) Tom Trebisky  12-19-2023
+ *
+ * Driver to erase and program our own flash.
+ *
+ * Described in the STM32F10xxx Flash programming manual (PM0075).
+ * The flash interface registers start at 0x40022000,
+ * rcc.c touches the first one (ACR) to set wait states.
+ *
+ * Our flash is 1K pages.  Erasing sets a page to all 1 bits,
+ * and after that we can write each 16 bit half word once.
+ * Programming a half word takes about 50 us and erasing
+ * a page about 20 ms.
+ *
+ * The catch is that while the flash is busy, any read from
+ * it stalls the cpu, and we run from flash.  That includes
+ * fetching interrupt vectors.  DMA does not care (it goes
+ * between peripherals and sram) so the ADC keeps sampling.
+ */
+
+struct flash {
+	volatile unsigned long acr;	/* 00 */
+	volatile unsigned long keyr;	/* 04 */
+	volatile unsigned long optkeyr;	/* 08 */
+	volatile unsigned long sr;	/* 0c */
+	volatile unsigned long cr;	/* 10 */
+	volatile unsigned long ar;	/* 14 */
+	    long	_pad;
+	volatile unsigned long obr;	/* 1c */
+	volatile unsigned long wrpr;	/* 20 */
+};
+
+#define FLASH_BASE	(struct flash *) 0x40022000
+
+#define FLASH_KEY1	0x45670123
+#define FLASH_KEY2	0xcdef89ab
+
+/* Bits in SR */
+#define SR_BSY		0x01
+#define SR_PGERR	0x04	/* tried to program a non-erased location */
+#define SR_WRPRTERR	0x10	/* write protected */
+#define SR_EOP		0x20
+
+/* Bits in CR */
+#define CR_PG		0x01	/* program */
+#define CR_PER		0x02	/* page erase */
+#define CR_STRT		0x40
+#define CR_LOCK		0x80
+
+void
+flash_unlock ( void )
+{
+	struct flash *fp = FLASH_BASE;
+
+	if ( fp->cr & CR_LOCK ) {
+	    fp->keyr = FLASH_KEY1;
+	    fp->keyr = FLASH_KEY2;
+	}
+}
+
+void
+flash_lock ( void )
+{
+	struct flash *fp = FLASH_BASE;
+
+	fp->cr |= CR_LOCK;
+}
+
+/* Wait for the last operation and report how it went */
+static int
+flash_wait ( void )
+{
+	struct flash *fp = FLASH_BASE;
+	int stat;
+
+	while ( fp->sr & SR_BSY )
+	    ;
+
+	stat = fp->sr;
+	fp->sr = SR_EOP | SR_PGERR | SR_WRPRTERR;
+
+	if ( stat & (SR_PGERR | SR_WRPRTERR) )
+	    return -1;
+	return 0;
+}
+
+/* Erase the page holding addr */
+int
+flash_erase ( unsigned long addr )
+{
+	struct flash *fp = FLASH_BASE;
+	int rv;
+
+	flash_wait ();
+
+	fp->cr |= CR_PER;
+	fp->ar = addr;
+	fp->cr |= CR_STRT;
+
+	rv = flash_wait ();
+	fp->cr &= ~CR_PER;
+
+	return rv;
+}
+
+/* Write one half word, addr must be even and erased */
+int
+flash_program ( unsigned long addr, int val )
+{
+	struct flash *fp = FLASH_BASE;
+	int rv;
+
+	flash_wait ();
+
+	fp->cr |= CR_PG;
+	* (volatile unsigned short *) addr = val;
+
+	rv = flash_wait ();
+	fp->cr &= ~CR_PG;
+
+	if ( rv == 0 && * (volatile unsigned short *) addr != (val & 0xffff) )
+	    rv = -1;
+	return rv;
+}
+
+/* THE END */
@@ -0,0 +1,278 @@
+/* flog.c
+ * (c) Tom Trebisky  12-19-2023
+ *
+ * A circular log of telemetry records in flash.
+ *
+ * A discharge run takes most of a day and if the host
+ * goes away (or the serial cable gets bumped) we used to
+ * lose the data.  Now every record telem.c builds also
+ * goes in here, and "dump" sends it all back afterwards.
+ *
+ * The log is the top 16K of a 64K part (the lds file keeps
+ * the code out of it), 16 pages of 1K.  Each page starts
+ * with a magic number and a sequence number, then records
+ * back to back, each a length byte followed by the record
+ * (type and payload, as in telem.c).  A length of 0xff
+ * (erased flash) ends the page.  When we run out of pages
+ * we erase the oldest and keep going, so the log always
+ * holds the most recent 15K or so.
+ *
+ * Records collect in a page sized buffer in ram.  When it
+ * fills, it gets handed off and the other buffer starts
+ * filling.  flog_poll() then programs the full one a few
+ * half words at a time, so no one call stalls the cpu
+ * for long (see flash.c).  The erase is the exception,
+ * that is 20 ms in one go.
+ */
+
+#define FLOG_BASE	0x0800c000
+#define FLOG_PAGES	16
+#define PAGE_SIZE	1024
+
+#define FLOG_MAGIC	0x474f4c46	/* "FLOG" */
+#define HDR_SIZE	8
+
+#define FLOG_CHUNK	16		/* half words per poll */
+
+#define REC_LOG_PAGE	6		/* see telem.c */
+
+/* data comes after the ints so it is word aligned */
+struct flog_buf {
+	int len;
+	int page;
+	unsigned char data[PAGE_SIZE];
+};
+
+static struct flog_buf flog_bufs[2];
+static struct flog_buf *fill;		/* taking records */
+static struct flog_buf *prog;		/* being programmed */
+static int prog_pos;
+
+static int flog_on;
+static int next_page;
+static unsigned long next_seq;
+static int flog_errors;
+
+static unsigned long
+page_addr ( int page )
+{
+	return FLOG_BASE + page * PAGE_SIZE;
+}
+
+static unsigned long
+page_word ( int page, int off )
+{
+	return * (unsigned long *) (page_addr ( page ) + off);
+}
+
+static void
+buf_start ( struct flog_buf *bp )
+{
+	unsigned long *hdr = (unsigned long *) bp->data;
+	int i;
+
+	for ( i=0; i<PAGE_SIZE; i++ )
+	    bp->data[i] = 0xff;
+
+	hdr[0] = FLOG_MAGIC;
+	hdr[1] = next_seq++;
+	bp->page = next_page;
+	bp->len = HDR_SIZE;
+
+	next_page = (next_page + 1) % FLOG_PAGES;
+}
+
+/* Program some of the page being committed.
+ * Call this from any loop that has time on its hands.
+ */
+void
+flog_poll ( void )
+{
+	unsigned long addr;
+	int end;
+	int n;
+
+	if ( ! prog )
+	    return;
+
+	addr = page_addr ( prog->page );
+	end = (prog->len + 1) & ~1;
+
+	flash_unlock ();
+	for ( n=0; n<FLOG_CHUNK && prog_pos < end; n++ ) {
+	    if ( flash_program ( addr + prog_pos,
+		    prog->data[prog_pos] | prog->data[prog_pos+1] << 8 ) )
+		flog_errors++;
+	    prog_pos += 2;
+	}
+	flash_lock ();
+
+	if ( prog_pos >= end )
+	    prog = 0;
+}
+
+/* Hand the filling buffer off to be programmed */
+static void
+flog_commit ( void )
+{
+	while ( prog )
+	    flog_poll ();
+
+	if ( fill->len <= HDR_SIZE )
+	    return;
+
+	flash_unlock ();
+	if ( flash_erase ( page_addr ( fill->page ) ) )
+	    flog_errors++;
+	flash_lock ();
+
+	prog = fill;
+	prog_pos = 0;
+
+	fill = (fill == &flog_bufs[0]) ? &flog_bufs[1] : &flog_bufs[0];
+	buf_start ( fill );
+}
+
+/* rec is the record type followed by the payload */
+void
+flog_add ( unsigned char *rec, int len )
+{
+	int i;
+
+	if ( ! flog_on )
+	    return;
+
+	if ( fill->len + 1 + len > PAGE_SIZE )
+	    flog_commit ();
+
+	fill->data[fill->len++] = len;
+	for ( i=0; i<len; i++ )
+	    fill->data[fill->len++] = rec[i];
+}
+
+/* Find where we left off, so a reset doesn't
+ * lose what is already in flash.
+ */
+void
+flog_init ( void )
+{
+	unsigned long seq;
+	unsigned long best = 0;
+	int found = 0;
+	int i;
+
+	next_page = 0;
+	for ( i=0; i<FLOG_PAGES; i++ ) {
+	    if ( page_word ( i, 0 ) != FLOG_MAGIC )
+		continue;
+	    seq = page_word ( i, 4 );
+	    if ( ! found || seq > best ) {
+		best = seq;
+		next_page = (i + 1) % FLOG_PAGES;
+		found = 1;
+	    }
+	}
+	next_seq = found ? best + 1 : 1;
+
+	prog = 0;
+	fill = &flog_bufs[0];
+	buf_start ( fill );
+}
+
+void
+flog_enable ( int on )
+{
+	flog_on = on;
+
+	/* Get everything out to flash */
+	if ( ! on ) {
+	    flog_commit ();
+	    while ( prog )
+		flog_poll ();
+	}
+}
+
+void
+flog_erase ( void )
+{
+	int i;
+
+	flog_enable ( 0 );
+
+	flash_unlock ();
+	for ( i=0; i<FLOG_PAGES; i++ )
+	    if ( page_word ( i, 0 ) != 0xffffffff )
+		flash_erase ( page_addr ( i ) );
+	flash_lock ();
+
+	flog_init ();
+}
+
+static void
+dump_page ( unsigned char *p, unsigned long seq )
+{
+	unsigned char hdr[5];
+	int off;
+	int len;
+
+	hdr[0] = REC_LOG_PAGE;
+	hdr[1] = seq;
+	hdr[2] = seq >> 8;
+	hdr[3] = seq >> 16;
+	hdr[4] = seq >> 24;
+	telem_raw ( hdr, 5 );
+
+	off = HDR_SIZE;
+	while ( off < PAGE_SIZE ) {
+	    len = p[off];
+	    if ( len == 0xff || off + 1 + len > PAGE_SIZE )
+		break;
+	    telem_raw ( &p[off+1], len );
+	    off += 1 + len;
+	}
+}
+
+/* Send the whole log, oldest first, as binary telemetry
+ * frames (whatever mode telem.c is in).  Each page starts
+ * with a REC_LOG_PAGE record giving its sequence number.
+ * The records in ram that have not made it to flash
+ * go out last.
+ */
+void
+flog_dump ( void )
+{
+	int page;
+	int i;
+
+	while ( prog )
+	    flog_poll ();
+
+	for ( i=0; i<FLOG_PAGES; i++ ) {
+	    page = (next_page + i) % FLOG_PAGES;
+	    if ( page == fill->page )
+		continue;
+	    if ( page_word ( page, 0 ) != FLOG_MAGIC )
+		continue;
+	    dump_page ( (unsigned char *) page_addr ( page ), page_word ( page, 4 ) );
+	}
+
+	if ( fill->len > HDR_SIZE )
+	    dump_page ( fill->data, ((unsigned long *) fill->data)[1] );
+
+	serial_flush ();
+}
+
+void
+flog_show ( void )
+{
+	int i, n = 0;
+
+	for ( i=0; i<FLOG_PAGES; i++ )
+	    if ( page_word ( i, 0 ) == FLOG_MAGIC )
+		n++;
+
+	printf ( "Flash log: %s, %d pages used, next seq %d, %d in ram, %d errors\n",
+	    flog_on ? "on" : "off", n, next_seq, fill->len - HDR_SIZE, flog_errors );
+}
+
+/* THE END */
@@ -139,6 +139,12 @@ gpio_a_analog ( int bit )
 	gpio_mode ( GPIOA_BASE, bit, INPUT_ANALOG );
 }
 
+void
+gpio_b_analog ( int bit )
+{
+	gpio_mode ( GPIOB_BASE, bit, INPUT_ANALOG );
+}
+
 
 void
 led_init ( int bit )
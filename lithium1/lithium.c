@@ -32,6 +32,8 @@
  *  Uart 3 could be on pins B10 and B11
  */
 
+#include "eeprom.h"
+
 void rcc_init ( void );
 void adc_init ( void );
 void led_init ( int );
@@ -79,26 +81,43 @@ extern volatile unsigned long systick_count;
  *    This should scale by 0.680
  * With a 3.78 volt battery, I measure 2.576 volts
  *    This is a scale of 0.6815
+ * which is 681, but set it for each board with "set scale".
+ * These and the rest of the calibration are kept in flash,
+ * see eeprom.c
  */
-#define SCALE	681
+#define SCALE	eeprom_get ( KEY_SCALE )
+
+/* Switch the relay without waiting for it */
+static void
+relay_set ( int closed )
+{
+	gpio_a_set ( ENABLE, closed );
+	if ( closed )
+	    led_on ();
+	else
+	    led_off ();
+}
 
 void
 relay_closed ( void )
 {
-	gpio_a_set ( ENABLE, 1 );
-	led_on ();
+	relay_set ( 1 );
 	delay_ms ( 500 );
 }
 
 void
 relay_open ( void )
 {
-	gpio_a_set ( ENABLE, 0 );
-	led_off ();
+	relay_set ( 0 );
 	delay_ms ( 500 );
 }
 
-/* Do a battery reading with averaging */
+#define CHAN_BATTERY	0
+
+/* Do a battery reading with averaging.
+ * If the scan engine is running it has already
+ * averaged a whole half buffer for us.
+ */
 int
 read_bat ( int n )
 {
@@ -106,6 +125,10 @@ read_bat ( int n )
 	int val;
 	int sum;
 
+	val = adc_scan_value ( CHAN_BATTERY );
+	if ( val >= 0 )
+	    return (val * 1000) / SCALE;
+
 	sum = 0;
 	for ( i=0; i<n; i++ ) {
 	    val = (adc_read() * 1000) / SCALE;
@@ -150,43 +173,96 @@ read_avg ( int n )
  * Rint = Vdrop * 16.67 / Vbat
  * Scaling Rload by 1000 yields milliohms,
  *  so this reads out directly in milliohms.
+ *
+ * That trusts the nominal load resistance, so now there is
+ * a shunt in the ground return of the load on A3 and we
+ * use the two ADC in simultaneous mode to get voltage and
+ * current at the same instant.  Rint is then dV / dI
+ * from the open and loaded pairs, and RLOAD is only
+ * used if we see no current (no shunt fitted).
+ *
+ * The shunt sits between the cell and our ground, so
+ * the cell voltage is what we see on A0 plus the shunt drop.
  */
 
 /*
 #define RLOAD	16667
 #define RLOAD	10000
- */
 #define RLOAD	 5000
+ */
+#define RLOAD		eeprom_get ( KEY_RLOAD )
+
+#define CHAN_SHUNT	3
+#define RSHUNT		eeprom_get ( KEY_RSHUNT )	/* milliohms */
 
-#define NAVG	20
+#define RINT_RATE	10000	/* pairs per second */
+#define RINT_HALF	64	/* pairs per half (DUAL_HALF / DUAL_SEQ in adc.c) */
+#define RINT_SETTLE	8	/* halves to let the relay settle */
+#define RINT_AVG	16	/* halves to average */
+
+/* Charge (microcoulombs) seen while reading */
+static int rint_charge;
+
+/* Average n halves worth of V/I pairs,
+ * giving cell millivolts and load milliamps.
+ */
+static void
+read_vi ( int n, int *mv, int *ma )
+{
+	int v, s;
+	int vsum, ssum;
+	int i;
+
+	vsum = ssum = 0;
+	for ( i=0; i<n; i++ ) {
+	    adc_dual_get ( &v, &s );
+	    vsum += v;
+	    ssum += s;
+	    /* each half lasts RINT_HALF / RINT_RATE seconds */
+	    rint_charge += (s * 1000 / RSHUNT) * RINT_HALF * 1000 / RINT_RATE;
+	}
+
+	s = ssum / n;
+	*ma = s * 1000 / RSHUNT;
+	*mv = (vsum / n) * 1000 / SCALE + s;
+}
 
 void
 measure_rint ( void )
 {
-	int v_open;
-	int v_load;
-	int dv;
+	int v_open, i_open;
+	int v_load, i_load;
+	int ms;
 	int rint;
 
-	/* Make A0 an analog input */
-	gpio_a_analog ( 0 );
-	adc_set_chan ( 0 );
+	adc_scan_rate ( RINT_RATE, 0 );
+	adc_dual_start ( CHAN_BATTERY, CHAN_SHUNT );
 
-	relay_open ();
+	relay_set ( 0 );
+	read_vi ( RINT_SETTLE, &v_open, &i_open );
+	read_vi ( RINT_AVG, &v_open, &i_open );
+	printf ( "V open = %d, I = %d mA\n", v_open, i_open );
 
-	v_open = read_bat ( NAVG );
-	printf ( "V open = %d\n", v_open );
+	relay_set ( 1 );
+	rint_charge = 0;
+	read_vi ( RINT_SETTLE, &v_load, &i_load );
+	read_vi ( RINT_AVG, &v_load, &i_load );
+	relay_set ( 0 );
 
-	relay_closed ();
+	printf ( "V loaded = %d, I = %d mA\n", v_load, i_load );
 
-	v_load = read_bat ( NAVG );
-	printf ( "V loaded = %d\n", v_load );
+	adc_dual_stop ();
+	adc_scan_rate ( 0, 0 );
 
-	relay_open ();
+	ms = (RINT_SETTLE + RINT_AVG) * RINT_HALF * 1000 / RINT_RATE;
+	printf ( "Charge = %d uC in %d ms\n", rint_charge, ms );
 
-	dv = v_open - v_load;
-	rint = dv * RLOAD / v_load;
-	// rint /= 100;
+	if ( i_load - i_open > 0 )
+	    rint = (v_open - v_load) * 1000 / (i_load - i_open);
+	else {
+	    printf ( "No load current, using RLOAD\n" );
+	    rint = (v_open - v_load) * RLOAD / v_load;
+	}
 	printf ( "R int = %d (milliohms)\n", rint );
 }
 
@@ -427,61 +503,191 @@ my_cmp ( char *s1, char *s2 )
 	return 1;
 }
 
-#define CHAN_BATTERY	0
+/* Like my_cmp, but for a command that takes arguments.
+ * The word must be followed by a space or the end.
+ */
+static int
+my_word ( char *s1, char *s2 )
+{
+	while ( *s2 ) {
+	    if ( *s1++ != *s2++ )
+		return 0;
+	}
+	if ( *s1 && *s1 != ' ' )
+	    return 0;
+	return 1;
+}
+
+#define CAL_TICK_S	2	/* 2 seconds between readings at rest */
+#define CAL_SAFE	eeprom_get ( KEY_SAFE )
+
+#define CAL_TERM	eeprom_get ( KEY_TERM )
+
+#define ADC_MAX		3600	/* above anything the ADC can see */
+
+/* Summary records go out this often during a run,
+ * and every so often we open the relay for a moment
+ * to see how Rint changes as the cell runs down.
+ */
+#define COUL_SUMMARY	60	/* seconds */
+#define COUL_PULSE	600	/* seconds */
+#define PULSE_SETTLE	4	/* halves (64 ms each) */
+
+/* The analog watchdog in the ADC watches every sample
+ * of the cell while the load is on and opens the relay
+ * itself, so we don't depend on the loop below noticing.
+ * The reading it sees is short by the shunt drop, so it
+ * errs on the safe side.
+ */
+static volatile int cal_tripped;
+static volatile int cal_trip_ms;
+
+static void
+cal_cutoff ( void )
+{
+	relay_set ( 0 );
+	cal_trip_ms = coulomb_stamp ();
+	cal_tripped = 1;
+}
+
+/* Wait for the next half buffer from the coulomb counter */
+static void
+cal_half ( void )
+{
+	int v, s;
 
-#define CAL_TICK	2000	/* 2 seconds */
-#define CAL_TICK_S	2	/* 2 seconds */
-#define CAL_SAFE	2950
+	adc_dual_get ( &v, &s );
+	flog_poll ();
+}
 
-#define CAL_TERM	3000
+/* Wait until the run clock reaches time */
+static void
+cal_wait ( int time )
+{
+	while ( coulomb_time () < time )
+	    cal_half ();
+}
+
+/* The record format is the old "time voltage stat" line
+ * that lithium.rb and plotit know, with the current and
+ * the on-chip totals on the end.
+ */
+static void
+cal_record ( int stat )
+{
+	int mv, ma;
+
+	coulomb_now ( &mv, &ma );
+	telem_sample ( coulomb_time (), mv, stat, ma,
+	    coulomb_uah (), coulomb_uwh () );
+	if ( ! telem_enabled () )
+	    printf ( "%d %d %d %d %d %d\n", coulomb_time (), mv, stat, ma,
+		coulomb_uah (), coulomb_uwh () );
+}
+
+/* With the load on, drop it briefly and use the pair of
+ * readings to get Rint at this state of charge.
+ */
+static void
+rint_pulse ( void )
+{
+	int v_load, i_load;
+	int v_open, i_open;
+	int rint;
+	int i;
+
+	coulomb_now ( &v_load, &i_load );
+
+	relay_set ( 0 );
+	for ( i=0; i<PULSE_SETTLE; i++ )
+	    cal_half ();
+	cal_half ();
+	coulomb_now ( &v_open, &i_open );
+	if ( cal_tripped )
+	    return;
+	relay_set ( 1 );
+
+	if ( i_load - i_open <= 0 )
+	    return;
+
+	rint = (v_open - v_load) * 1000 / (i_load - i_open);
+	telem_rint ( coulomb_time (), coulomb_uah (), rint );
+	if ( ! telem_enabled () )
+	    printf ( "Rint %d %d %d\n", coulomb_time (), coulomb_uah (), rint );
+}
 
 void
 calibrate ( void )
 {
-	int val;
-	int stat;
-	int i;
+	int next_summary;
+	int next_pulse;
 	int time;
+	int mv, ma;
+	int i;
 
 	measure_rint ();
 
-	adc_set_chan ( CHAN_BATTERY );
-
-	time = 0;
+	coulomb_start ();
 
 	/* Some readings before loading battery */
-	stat = 0;
-	for ( i=0; i<5; i++ ) {
-	    val = read_bat ( 10 );
-	    printf ( "%d %d %d\n", time, val, stat );
-	    delay_ms (CAL_TICK);
+	for ( i=1; i<=5; i++ ) {
+	    cal_wait ( i * CAL_TICK_S );
+	    cal_record ( 0 );
 	}
 
-	relay_closed ();
-	stat = 1;
+	cal_tripped = 0;
+	adc_watchdog ( CHAN_BATTERY, CAL_TERM * SCALE / 1000, ADC_MAX, cal_cutoff );
+
+	relay_set ( 1 );
+	next_summary = coulomb_time ();
+	next_pulse = next_summary + COUL_PULSE;
 
 	for ( ;; ) {
-	    val = read_bat ( 10 );
-	    printf ( "%d %d %d\n", time, val, stat );
-	    if ( val < CAL_TERM )
+	    cal_half ();
+	    if ( cal_tripped )
+		break;
+	    time = coulomb_time ();
+	    coulomb_now ( &mv, &ma );
+	    /* these should never happen now */
+	    if ( mv < CAL_TERM )
 		break;
-	    if ( val < CAL_SAFE )
+	    if ( mv < CAL_SAFE )
 		break;
-	    delay_ms (CAL_TICK);
-	    time += CAL_TICK_S;
+	    if ( time >= next_summary ) {
+		cal_record ( 1 );
+		next_summary += COUL_SUMMARY;
+	    }
+	    if ( time >= next_pulse ) {
+		rint_pulse ();
+		next_pulse += COUL_PULSE;
+	    }
 	}
 
-	relay_open ();
-	stat = 0;
+	relay_set ( 0 );
+	adc_watchdog_off ();
+	cal_record ( 1 );
 
-	for ( i=0; i<5; i++ ) {
-	    val = read_bat ( 10 );
-	    printf ( "%d %d %d\n", time, val, stat );
-	    delay_ms (CAL_TICK);
-	    time += CAL_TICK_S;
+	if ( cal_tripped ) {
+	    telem_cutoff ( cal_trip_ms );
+	    if ( ! telem_enabled () )
+		printf ( "Cutoff at %d ms\n", cal_trip_ms );
+	}
+
+	printf ( "Capacity: %d uAh, %d uWh\n", coulomb_uah (), coulomb_uwh () );
+
+	time = coulomb_time ();
+	for ( i=1; i<=5; i++ ) {
+	    cal_wait ( time + i * CAL_TICK_S );
+	    cal_record ( 0 );
 	}
+
+	coulomb_stop ();
 }
 
+/* What the "scan" command converts */
+static int scan_list[] = { CHAN_BATTERY, CHAN_TEMP, CHAN_VREF };
+#define SCAN_NUM	(sizeof(scan_list) / sizeof(int))
+
 void
 serial_cmd ( void )
 {
@@ -513,6 +719,46 @@ serial_cmd ( void )
 	    else if ( my_cmp ( buf, "cal" ) ) {
 		calibrate ();
 	    }
+	    else if ( my_cmp ( buf, "scan" ) ) {
+		adc_scan_start ( scan_list, SCAN_NUM );
+	    }
+	    else if ( my_cmp ( buf, "stop" ) ) {
+		adc_scan_stop ();
+	    }
+	    else if ( my_cmp ( buf, "multi" ) ) {
+		cells_init ();
+		cells_run ();
+	    }
+	    else if ( my_cmp ( buf, "adc" ) ) {
+		adc_scan_show ();
+	    }
+	    else if ( my_cmp ( buf, "bin" ) ) {
+		telem_mode ( 1 );
+	    }
+	    else if ( my_cmp ( buf, "text" ) ) {
+		telem_mode ( 0 );
+	    }
+	    else if ( my_cmp ( buf, "log" ) ) {
+		flog_enable ( 1 );
+	    }
+	    else if ( my_cmp ( buf, "nolog" ) ) {
+		flog_enable ( 0 );
+	    }
+	    else if ( my_cmp ( buf, "dump" ) ) {
+		flog_dump ();
+	    }
+	    else if ( my_cmp ( buf, "logerase" ) ) {
+		flog_erase ();
+	    }
+	    else if ( my_cmp ( buf, "logstat" ) ) {
+		flog_show ();
+	    }
+	    else if ( my_word ( buf, "get" ) ) {
+		eeprom_cmd_get ( buf + 3 );
+	    }
+	    else if ( my_word ( buf, "set" ) ) {
+		eeprom_cmd_set ( buf + 3 );
+	    }
 	    else if ( my_cmp ( buf, "check" ) ) {
 		printf ( "OK\n" );
 	    }
@@ -533,13 +779,20 @@ startup ( void )
 	int t;
 	unsigned long systick_next;
 
+	mem_init ();
+
 	rcc_init ();
 
 	serial_init ();
 	printf ( " -- Booting ------------------------------\n" );
 
+	dwt_init ();
+	eeprom_init ();
+
 	adc_init ();
 
+	flog_init ();
+
 	led_init ( PC13 );
 
 	gpio_a_output ( ENABLE );
@@ -34,15 +34,15 @@ class Lithium
 	print "Connecting on port #{@usb} at #{@baud} baud\n"
 	@ser = SerialPort.new @usb, @baud, 8, 1, @parity
     end
-    # We shouldn't need the delay, but for now it is a
-    # workaround for some kind of bug in the firmware.
+    # The firmware used to drop characters that came in
+    # while it was busy, so we sent them one at a time with
+    # a sleep in between.  It has an Rx ring now.
     def sout ( x )
 	@ser.write x
-	sleep 0.001
 	@ser.flush
     end
     def puts ( msg )
-	msg.split(//).each { |b| sout b }
+	sout msg
     end
     def sin
 	@ser.read(1)
@@ -188,6 +188,7 @@ logfile.puts "# starting calibration"
 time = 0
 sum = 0.0;
 save_rint = nil
+dev_mah = nil
 loop {
     line = l.gets
     if line =~ /^# R int =/
@@ -207,6 +208,13 @@ loop {
 
     logfile.puts line
 
+    # Newer firmware does the sums itself and sends
+    # a summary record once a minute with uAh in it.
+    if w.size >= 6
+	dev_mah = w[4].to_f / 1000.0
+	next
+    end
+
     volts = w[1].to_f / 1000.0
     cur = volts / resist
     sum += cur
@@ -216,7 +224,7 @@ loop {
 }
 
 factor = 2.0 * 1000.0 / 60.0 / 60.0
-mah = sum * factor
+mah = dev_mah || sum * factor
 puts "# %.1f mAh" % mah
 logfile.puts "# %.1f mAh" % mah
 if save_rint
@@ -170,4 +170,42 @@ systick_wait ( void )
 	    ;
 }
 
+/* The DWT cycle counter, 72 counts per microsecond */
+struct dwt {
+	volatile unsigned long ctrl;	/* 00 */
+	volatile unsigned long cyccnt;	/* 04 */
+};
+#define DWT_BASE	((struct dwt *) 0xe0001000)
+#define DEMCR		((volatile unsigned long *) 0xe000edfc)
+
+#define DEMCR_TRCENA	0x01000000
+#define DWT_CYCCNTENA	0x1
+
+void
+dwt_init ( void )
+{
+	struct dwt *dp = DWT_BASE;
+
+	*DEMCR |= DEMCR_TRCENA;
+	dp->cyccnt = 0;
+	dp->ctrl |= DWT_CYCCNTENA;
+}
+
+unsigned long
+dwt_read ( void )
+{
+	struct dwt *dp = DWT_BASE;
+
+	return dp->cyccnt;
+}
+
+/* Sleep until an interrupt shows up.
+ * Good for waiting on anything an interrupt sets.
+ */
+void
+cpu_idle ( void )
+{
+	__asm volatile ( "wfi" );
+}
+
 /* THE END */
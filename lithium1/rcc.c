@@ -28,6 +28,10 @@ struct rcc {
 #define FLASH_WAIT2	0x0002	/* for 48 < sysclk <= 72 Mhz */
 
 
+/* These are in the ape3 register (AHB) */
+#define DMA1_ENABLE	0x01
+#define DMA2_ENABLE	0x02
+
 /* These are in the ape2 register */
 #define GPIOA_ENABLE	0x04
 #define GPIOB_ENABLE	0x08
@@ -170,7 +174,11 @@ rcc_init ( void )
 	rp->ape2 |= ADC1_ENABLE;
 	rp->ape2 |= ADC2_ENABLE;
 
+	/* DMA for the ADC scan engine */
+	rp->ape3 |= DMA1_ENABLE;
+
 	rp->ape1 |= TIMER2_ENABLE;
+	rp->ape1 |= TIMER3_ENABLE;
 
 	rp->ape1 |= USB_ENABLE;
 
@@ -49,6 +49,52 @@ struct uart {
 
 void serial_putc ( int );
 
+#define UART1_IRQ	37
+
+/* Both directions go through a ring buffer and the uart
+ * interrupt.  Before this, a character that showed up
+ * while we were busy (printing, say) got lost, which is
+ * why lithium.rb had to dribble commands out with a
+ * sleep between each byte.
+ * Sizes must be powers of 2.  The indices only ever
+ * count up, one side writes head and the other tail,
+ * so there is no locking.
+ */
+#define TX_SIZE		1024
+#define RX_SIZE		128
+
+static char tx_buf[TX_SIZE];
+static volatile unsigned int tx_head;
+static volatile unsigned int tx_tail;
+
+static char rx_buf[RX_SIZE];
+static volatile unsigned int rx_head;
+static volatile unsigned int rx_tail;
+static volatile int rx_overrun;
+
+void
+uart1_handler ( void )
+{
+	struct uart *up = UART1_BASE;
+	int c;
+
+	if ( up->status & ST_RXNE ) {
+	    c = up->data;
+	    if ( rx_head - rx_tail < RX_SIZE )
+		rx_buf[rx_head++ & (RX_SIZE-1)] = c;
+	    else
+		rx_overrun++;
+	}
+
+	if ( (up->cr1 & CR_TXEIE) && (up->status & ST_TXE) ) {
+	    if ( tx_tail == tx_head ) {
+		up->cr1 &= ~CR_TXEIE;
+		return;
+	    }
+	    up->data = tx_buf[tx_tail++ & (TX_SIZE-1)];
+	}
+}
+
 static void
 uart_init ( struct uart *up, int baud )
 {
@@ -69,12 +115,19 @@ uart_init ( struct uart *up, int baud )
 void
 serial_init ( void )
 {
+	struct uart *up = UART1_BASE;
+
 	gpio_uart1 ();
 	// uart_init ( UART1_BASE, 9600 );
 	// uart_init ( UART1_BASE, 38400 );
 	// uart_init ( UART1_BASE, 57600 ); ??
 	uart_init ( UART1_BASE, 115200 );
 
+	tx_head = tx_tail = 0;
+	rx_head = rx_tail = 0;
+	up->cr1 |= CR_RXNEIE;
+	nvic_enable ( UART1_IRQ );
+
 #ifdef notdef
 	gpio_uart2 ();
 	uart_init ( UART2_BASE, 9600 );
@@ -88,23 +141,18 @@ serial_init ( void )
 int
 serial_check ( void )
 {
-	struct uart *up = UART1_BASE;
-
-	if ( up->status & ST_RXNE )
-	    return 1;
-	return 0;
+	return rx_head != rx_tail;
 }
 
 int
 serial_getc ( void )
 {
-	struct uart *up = UART1_BASE;
 	int c;
 
-	while ( ! (up->status & ST_RXNE) )
+	while ( rx_head == rx_tail )
 	    ;
 
-	c = up->data & 0x7f;
+	c = rx_buf[rx_tail++ & (RX_SIZE-1)] & 0x7f;
 	if ( c == '\r' )
 	    serial_putc ( '\n' );
 	else
@@ -131,17 +179,33 @@ serial_getl ( char *buf )
 	*buf++ = '\0';
 }
 
+/* Queue a byte as is, spin if the ring is full */
 void
-serial_putc ( int c )
+serial_putb ( int c )
 {
 	struct uart *up = UART1_BASE;
 
+	while ( tx_head - tx_tail >= TX_SIZE )
+	    ;
+	tx_buf[tx_head++ & (TX_SIZE-1)] = c;
+
+	up->cr1 |= CR_TXEIE;
+}
+
+void
+serial_putc ( int c )
+{
 	if ( c == '\n' )
-	    serial_putc ( '\r' );
+	    serial_putb ( '\r' );
+	serial_putb ( c );
+}
 
-	while ( ! (up->status & ST_TXE) )
+/* Wait for everything queued to go out */
+void
+serial_flush ( void )
+{
+	while ( tx_head != tx_tail )
 	    ;
-	up->data = c;
 }
 
 void
@@ -0,0 +1,223 @@
+/* telem.c
+ * (c) Tom Trebisky  12-18-2023
+ *
+ * Binary telemetry records for the lithium tester.
+ *
+ * The text lines we have always sent are easy to read
+ * but slow to send and fussy to parse.  With "bin" on the
+ * console, records go out in binary frames instead:
+ *
+ *   seq  type  payload ...  crc16
+ *
+ * seq counts up (mod 256) so the host can see lost frames.
+ * crc16 is CRC-CCITT (poly 0x1021, start 0xffff) over seq,
+ * type and payload, low byte first.  Multi-byte fields
+ * in the payload are little endian.
+ *
+ * Each frame is COBS encoded with a zero byte on each side,
+ * so a zero always marks the end of a frame and the host
+ * can find its footing after any garbage.  Prompts and
+ * other text still go out as text, the host decoder
+ * drops anything that does not pass the crc.
+ *
+ * Records also go to the flash log (flog.c) whatever mode
+ * we are in, so call these even when sending text.
+ *
+ * The record types and layouts are in telem.rb as well,
+ * keep the two in step.
+ */
+
+#define TELEM_MAX	64	/* payload + header + crc */
+
+/* Record types */
+#define REC_SAMPLE	1	/* u32 time, u16 mV, u8 stat, u16 mA, u32 uAh, u32 uWh */
+#define REC_RINT	2	/* u32 time, u32 uAh, u16 rint */
+#define REC_CUTOFF	3	/* u32 ms */
+#define REC_CELL	4	/* u8 cell, u32 time, u16 mV, u8 state, u32 uAh */
+#define REC_CELL_DONE	5	/* u8 cell, u32 uAh, u16 rint */
+#define REC_LOG_PAGE	6	/* u32 seq, from flog.c */
+
+static int telem_on;
+
+static unsigned char tbuf[TELEM_MAX];
+static int tlen;
+static int tseq;
+
+void
+telem_mode ( int on )
+{
+	telem_on = on;
+}
+
+int
+telem_enabled ( void )
+{
+	return telem_on;
+}
+
+static int
+crc16 ( unsigned char *p, int n )
+{
+	int crc = 0xffff;
+	int i;
+
+	while ( n-- ) {
+	    crc ^= *p++ << 8;
+	    for ( i=0; i<8; i++ ) {
+		if ( crc & 0x8000 )
+		    crc = (crc << 1) ^ 0x1021;
+		else
+		    crc <<= 1;
+	    }
+	}
+	return crc & 0xffff;
+}
+
+void
+telem_start ( int type )
+{
+	tbuf[0] = tseq++;
+	tbuf[1] = type;
+	tlen = 2;
+}
+
+void
+telem_u8 ( int val )
+{
+	if ( tlen < TELEM_MAX - 2 )
+	    tbuf[tlen++] = val;
+}
+
+void
+telem_u16 ( int val )
+{
+	telem_u8 ( val );
+	telem_u8 ( val >> 8 );
+}
+
+void
+telem_u32 ( int val )
+{
+	telem_u16 ( val );
+	telem_u16 ( val >> 16 );
+}
+
+/* Add the crc and COBS encode straight into the serial ring.
+ * COBS replaces each zero with the distance to the next one,
+ * and the first byte is the distance to the first zero.
+ * Our frames are never 254 bytes long, so there is no
+ * need to deal with long runs.
+ */
+static void
+telem_frame ( void )
+{
+	int crc;
+	int i, j;
+
+	crc = crc16 ( tbuf, tlen );
+	tbuf[tlen++] = crc;
+	tbuf[tlen++] = crc >> 8;
+
+	/* A zero in front too, so any text before us is cut off */
+	serial_putb ( 0 );
+
+	i = 0;
+	while ( i <= tlen ) {
+	    for ( j=i; j<tlen && tbuf[j]; j++ )
+		;
+	    serial_putb ( j - i + 1 );
+	    while ( i < j )
+		serial_putb ( tbuf[i++] );
+	    i++;	/* skip the zero */
+	}
+
+	serial_putb ( 0 );
+}
+
+/* Every record goes to the flash log (if that is on)
+ * and out the serial port in binary mode.
+ */
+void
+telem_end ( void )
+{
+	flog_add ( &tbuf[1], tlen-1 );
+
+	if ( telem_on )
+	    telem_frame ();
+}
+
+/* Send a record that is already put together
+ * (type and payload), whatever mode we are in.
+ * This is how flog.c plays back the log.
+ */
+void
+telem_raw ( unsigned char *rec, int len )
+{
+	int i;
+
+	tbuf[0] = tseq++;
+	tlen = 1;
+	for ( i=0; i<len && tlen < TELEM_MAX - 2; i++ )
+	    tbuf[tlen++] = rec[i];
+
+	telem_frame ();
+}
+
+/* ---------------------------------------------------------- */
+
+/* One of these for each kind of record */
+
+void
+telem_sample ( int time, int mv, int stat, int ma, int uah, int uwh )
+{
+	telem_start ( REC_SAMPLE );
+	telem_u32 ( time );
+	telem_u16 ( mv );
+	telem_u8 ( stat );
+	telem_u16 ( ma );
+	telem_u32 ( uah );
+	telem_u32 ( uwh );
+	telem_end ();
+}
+
+void
+telem_rint ( int time, int uah, int rint )
+{
+	telem_start ( REC_RINT );
+	telem_u32 ( time );
+	telem_u32 ( uah );
+	telem_u16 ( rint );
+	telem_end ();
+}
+
+void
+telem_cutoff ( int ms )
+{
+	telem_start ( REC_CUTOFF );
+	telem_u32 ( ms );
+	telem_end ();
+}
+
+void
+telem_cell ( int cell, int time, int mv, int state, int uah )
+{
+	telem_start ( REC_CELL );
+	telem_u8 ( cell );
+	telem_u32 ( time );
+	telem_u16 ( mv );
+	telem_u8 ( state );
+	telem_u32 ( uah );
+	telem_end ();
+}
+
+void
+telem_cell_done ( int cell, int uah, int rint )
+{
+	telem_start ( REC_CELL_DONE );
+	telem_u8 ( cell );
+	telem_u32 ( uah );
+	telem_u16 ( rint );
+	telem_end ();
+}
+
+/* THE END */
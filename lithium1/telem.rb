@@ -0,0 +1,152 @@
+#!/bin/ruby
+
+# telem.rb
+# Tom Trebisky  12-18-2023
+#
+# Host side of the binary records from telem.c
+#
+# As a library:
+#   require_relative 'telem'
+#   t = Telem.new
+#   t.feed( bytes ) { |rec| p rec }
+#
+# Each record comes back as a hash with :type and the
+# fields named below.  Anything between frames that is
+# not a good frame (prompts, echo, text) is collected
+# and handed back as a :text record a line at a time,
+# so nothing gets lost.
+#
+# Standalone, this reads a capture file (or the serial
+# port with -p) and prints the records:
+#   ./telem.rb capture.bin
+#   ./telem.rb -p /dev/ttyUSB0
+#
+# The layouts must match telem.c
+
+RECORDS = {
+    1 => [ :sample,    "VvCvVV", [ :time, :mv, :stat, :ma, :uah, :uwh ] ],
+    2 => [ :rint,      "VVv",    [ :time, :uah, :rint ] ],
+    3 => [ :cutoff,    "V",      [ :ms ] ],
+    4 => [ :cell,      "CVvCV",  [ :cell, :time, :mv, :state, :uah ] ],
+    5 => [ :cell_done, "CVv",    [ :cell, :uah, :rint ] ],
+    6 => [ :log_page,  "V",      [ :seq ] ],
+}
+
+class Telem
+    attr_reader :frames, :bad, :lost
+
+    def initialize
+	@buf = "".b
+	@text = "".b
+	@frames = 0
+	@bad = 0
+	@lost = 0
+	@seq = nil
+    end
+
+    def self.crc16 ( s )
+	crc = 0xffff
+	s.each_byte { |b|
+	    crc ^= b << 8
+	    8.times {
+		crc = (crc & 0x8000) != 0 ? ((crc << 1) ^ 0x1021) : (crc << 1)
+	    }
+	    crc &= 0xffff
+	}
+	crc
+    end
+
+    def self.cobs_decode ( s )
+	out = "".b
+	i = 0
+	while i < s.size
+	    code = s.getbyte i
+	    return nil if code == 0 || i + code > s.size + 1
+	    out << s[i+1, code-1]
+	    i += code
+	    out << "\0" if code < 0xff && i < s.size
+	end
+	out
+    end
+
+    # Returns a record hash, or nil if this is not a good frame
+    def decode ( frame )
+	d = Telem.cobs_decode frame
+	return nil if ! d || d.size < 4
+	body = d[0..-3]
+	return nil if d[-2,2].unpack("v")[0] != Telem.crc16( body )
+
+	seq, type = body.unpack "CC"
+	@lost += (seq - @seq - 1) & 0xff if @seq
+	@seq = seq
+	@frames += 1
+
+	name, fmt, fields = RECORDS[type]
+	return { type: :unknown, code: type, data: body[2..-1] } if ! name
+	rec = { type: name, seq: seq }
+	fields.zip( body[2..-1].unpack fmt ) { |f, v| rec[f] = v }
+	rec
+    end
+
+    def text_out ( s )
+	@text << s
+	while i = @text.index( "\n" )
+	    line = @text[0, i].delete "\r"
+	    @text = @text[i+1..-1]
+	    yield( { type: :text, text: line } ) if line.size > 0
+	end
+    end
+
+    # Hand this whatever comes in, it yields records
+    def feed ( bytes )
+	@buf << bytes.b
+	while i = @buf.index( "\0" )
+	    frame = @buf[0, i]
+	    @buf = @buf[i+1..-1]
+	    rec = frame.size > 0 ? decode( frame ) : nil
+	    if rec
+		yield rec
+	    elsif frame.b =~ /[^\x20-\x7e\r\n\t]/n
+		@bad += 1
+	    else
+		text_out( frame ) { |r| yield r }
+	    end
+	end
+    end
+
+    # Text only shows up when the next zero does,
+    # so call this at the end to get the rest.
+    def flush
+	text_out( @buf + "\n" ) { |r| yield r }
+	@buf = "".b
+    end
+end
+
+if __FILE__ == $0
+    if ARGV.size < 1
+	puts "usage: telem [-p port] file"
+	exit
+    end
+
+    if ARGV[0] == "-p"
+	require 'serialport'
+	io = SerialPort.new ARGV[1], 115200, 8, 1, SerialPort::NONE
+    else
+	io = File.open ARGV[0], "rb"
+    end
+
+    t = Telem.new
+    while data = io.read( 1 ) and data.size > 0
+	t.feed( data ) { |r|
+	    if r[:type] == :text
+		puts r[:text]
+	    else
+		puts r.map { |k, v| "#{k}=#{v}" }.join " "
+	    end
+	}
+    end
+    t.flush { |r| puts r[:text] }
+    print "%d frames, %d bad, %d lost\n" % [ t.frames, t.bad, t.lost ]
+end
+
+# THE END
@@ -46,6 +46,8 @@ struct timer {
 
 #define	UPDATE_IE	1	/* enable update interrupts */
 
+#define EGR_UG		1	/* force an update */
+
 #define	EGR_CC1		2
 #define	EGR_CC2		4
 #define	EGR_CC3		8
@@ -58,6 +60,10 @@ struct timer {
 
 #define TOGGLE		0x30	/* for ccmr register */
 
+/* Master mode, what goes out on TRGO (in cr2) */
+#define MMS_RESET	(0<<4)
+#define MMS_UPDATE	(2<<4)
+
 /* --------- */
 
 #define	TIMER2_IRQ	28
@@ -179,6 +185,45 @@ test2 ( void )
 	tp->cr1 = CR1_ENABLE;
 }
 
+/* All the timers get 72 Mhz (see above) */
+#define TIMER_CLOCK	72000000
+
+/* Set up timer 3 to generate TRGO at some rate.
+ * This paces the ADC scan, see adc.c
+ * No interrupts, the ADC takes it from here.
+ * 72 Mhz / 65536 is 1099 Hz, so slower rates than
+ * that need the prescaler.
+ * Rates that divide 72 Mhz evenly come out exact.
+ */
+void
+timer3_trgo ( int rate )
+{
+	struct timer *tp = TIMER3_BASE;
+	int div;
+	int psc;
+
+	div = TIMER_CLOCK / rate;
+	psc = div / 65536;
+
+	tp->cr1 = 0;
+	tp->psc = psc;
+	tp->arr = div / (psc+1) - 1;
+	tp->cr2 = MMS_UPDATE;
+
+	/* load psc right now */
+	tp->egr = EGR_UG;
+
+	tp->cr1 = CR1_ENABLE;
+}
+
+void
+timer3_stop ( void )
+{
+	struct timer *tp = TIMER3_BASE;
+
+	tp->cr1 = 0;
+}
+
 void
 timer_init ( void )
 {
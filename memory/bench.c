@@ -0,0 +1,342 @@
+/* bench.c
+ * (c) Tom Trebisky  12-31-2023
+ *
+ * What do flash wait states, the prefetch buffer and the
+ * clock rate really cost us, and when is code or data worth
+ * moving into SRAM?  This measures, with the DWT cycle counter:
+ *
+ *   fseq   sequential word reads from flash
+ *   frnd   word reads from random places in 16K of flash
+ *   sseq   sequential word reads from SRAM
+ *   srnd   random word reads in 4K of SRAM
+ *   fline  straight line code running from flash
+ *   fbrch  code that does nothing but take branches, from flash
+ *   sline  and sbrch, the same two copied to SRAM
+ *
+ * all in cycles (tenths) per word or per instruction, for every
+ * wait state and prefetch setting (see rcc.c) that is legal at
+ * each clock, plus half cycle access at 8 Mhz, which is not.
+ * The reads go 8 to a loop, so the loop itself is in there,
+ * but it is the same everywhere.  The random reads get their
+ * index from a table in SRAM, so srnd is also what the table
+ * costs.  Each test runs NTRY times and the best one counts.
+ *
+ * The uart baud rate is only right at 72 Mhz, so everything
+ * gets measured first and printed at the end.
+ * Divide cycles by Mhz to get microseconds, the two ns
+ * columns do that for fseq and fline.
+ */
+
+typedef unsigned int u32;
+typedef unsigned short u16;
+
+#define FLASH_PREFETCH	0x0010	/* see rcc.c */
+#define FLASH_HCYCLE	0x0008
+#define FLASH_WAIT0	0x0000
+#define FLASH_WAIT1	0x0001
+#define FLASH_WAIT2	0x0002
+
+#define FLASH_START	((volatile u32 *) 0x08000000)
+#define FLASH_WORDS	4096		/* 16K */
+
+#define SRAM_WORDS	1024		/* 4K */
+#define SEQ_WORDS	1024
+
+#define NRAND		1024
+#define NTRY		3
+#define CODE_REPS	8
+
+#define NTEST		8
+#define NROWS		24
+
+/* The DWT has a cycle counter, TRCENA must be on for it to count */
+struct dwt {
+	volatile unsigned long ctrl;	/* 00 */
+	volatile unsigned long cyccnt;	/* 04 */
+};
+
+#define DWT_BASE	((struct dwt *) 0xe0001000)
+#define DEMCR		((volatile unsigned long *) 0xe000edfc)
+
+#define DEMCR_TRCENA	0x01000000
+#define DWT_CYCCNTENA	0x1
+
+typedef void (*vfptr) ( void );
+
+/* In locore.s */
+void straight_line ( void );
+void straight_line_end ( void );
+void branchy ( void );
+void branchy_end ( void );
+
+#define LINE_INSNS	256
+#define BRANCH_INSNS	128
+
+static u32 sram_buf[SRAM_WORDS];
+static u16 rand_idx[NRAND];
+static u32 code_ram[2][LINE_INSNS/2 + 8];
+
+volatile u32 bench_sink;
+
+struct clock {
+	int mhz;
+	int min_wait;
+};
+
+/* The wait states the clock needs, by the reference manual */
+static struct clock clocks[] = {
+	{ 8,	FLASH_WAIT0 },
+	{ 24,	FLASH_WAIT0 },
+	{ 48,	FLASH_WAIT1 },
+	{ 72,	FLASH_WAIT2 },
+	{ 0 }
+};
+
+struct row {
+	int mhz;
+	int acr;
+	u32 val[NTEST];
+};
+
+static struct row rows[NROWS];
+static int nrows;
+
+static void
+dwt_init ( void )
+{
+	struct dwt *dp = DWT_BASE;
+
+	*DEMCR |= DEMCR_TRCENA;
+	dp->cyccnt = 0;
+	dp->ctrl |= DWT_CYCCNTENA;
+}
+
+static inline u32
+dwt_read ( void )
+{
+	return DWT_BASE->cyccnt;
+}
+
+/* ---------------------------------------------------------- */
+
+static u32
+time_seq ( volatile u32 *p, int words )
+{
+	u32 sum = 0;
+	u32 t;
+	int i;
+
+	t = dwt_read ();
+	for ( i=0; i<words; i += 8 ) {
+	    sum += p[0];
+	    sum += p[1];
+	    sum += p[2];
+	    sum += p[3];
+	    sum += p[4];
+	    sum += p[5];
+	    sum += p[6];
+	    sum += p[7];
+	    p += 8;
+	}
+	t = dwt_read () - t;
+
+	bench_sink = sum;
+	return t * 10 / words;
+}
+
+static u32
+time_random ( volatile u32 *p, int mask )
+{
+	u16 *ip = rand_idx;
+	u32 sum = 0;
+	u32 t;
+	int i;
+
+	t = dwt_read ();
+	for ( i=0; i<NRAND; i += 8 ) {
+	    sum += p[ip[0] & mask];
+	    sum += p[ip[1] & mask];
+	    sum += p[ip[2] & mask];
+	    sum += p[ip[3] & mask];
+	    sum += p[ip[4] & mask];
+	    sum += p[ip[5] & mask];
+	    sum += p[ip[6] & mask];
+	    sum += p[ip[7] & mask];
+	    ip += 8;
+	}
+	t = dwt_read () - t;
+
+	bench_sink = sum;
+	return t * 10 / NRAND;
+}
+
+static u32
+time_code ( vfptr fn, int insns )
+{
+	u32 t;
+	int i;
+
+	t = dwt_read ();
+	for ( i=0; i<CODE_REPS; i++ )
+	    (*fn) ();
+	t = dwt_read () - t;
+
+	return t * 10 / (insns * CODE_REPS);
+}
+
+/* Copy one of the locore.s routines into SRAM,
+ * the pointer we hand back has the thumb bit.
+ */
+static vfptr
+code_copy ( u32 *dst, vfptr start, vfptr end )
+{
+	u32 *src = (u32 *) ((u32) start & ~1);
+	u32 *lim = (u32 *) ((u32) end & ~1);
+	u32 *base = dst;
+
+	while ( src < lim )
+	    *dst++ = *src++;
+	/* end is only 2 aligned, get the last half word too */
+	*dst = *src;
+
+	return (vfptr) ((u32) base | 1);
+}
+
+/* Run one test NTRY times, keep the best */
+#define BEST(v, expr)					\
+	do {						\
+	    u32 _x;					\
+	    int _n;					\
+	    v = ~0;					\
+	    for ( _n=0; _n<NTRY; _n++ ) {		\
+		_x = expr;				\
+		if ( _x < v )				\
+		    v = _x;				\
+	    }						\
+	} while ( 0 )
+
+static void
+bench_one ( int mhz, int acr, vfptr line_ram, vfptr brch_ram )
+{
+	struct row *rp;
+
+	if ( nrows >= NROWS )
+	    return;
+	rp = &rows[nrows++];
+	rp->mhz = mhz;
+	rp->acr = acr;
+
+	rcc_set_clock ( mhz, acr );
+
+	BEST ( rp->val[0], time_seq ( FLASH_START, SEQ_WORDS ) );
+	BEST ( rp->val[1], time_random ( FLASH_START, FLASH_WORDS-1 ) );
+	BEST ( rp->val[2], time_seq ( sram_buf, SEQ_WORDS ) );
+	BEST ( rp->val[3], time_random ( sram_buf, SRAM_WORDS-1 ) );
+	BEST ( rp->val[4], time_code ( straight_line, LINE_INSNS ) );
+	BEST ( rp->val[5], time_code ( branchy, BRANCH_INSNS ) );
+	BEST ( rp->val[6], time_code ( line_ram, LINE_INSNS ) );
+	BEST ( rp->val[7], time_code ( brch_ram, BRANCH_INSNS ) );
+}
+
+/* ---------------------------------------------------------- */
+
+/* Right justified in width, 0 prints as 0 */
+static void
+put_dec ( u32 val, int width )
+{
+	char buf[12];
+	int n = 0;
+
+	do {
+	    buf[n++] = '0' + val % 10;
+	    val /= 10;
+	} while ( val );
+
+	while ( width-- > n )
+	    serial_putc ( ' ' );
+	while ( n )
+	    serial_putc ( buf[--n] );
+}
+
+/* Tenths, as 12.3 */
+static void
+put_tenths ( u32 val, int width )
+{
+	put_dec ( val / 10, width - 2 );
+	serial_putc ( '.' );
+	serial_putc ( '0' + val % 10 );
+}
+
+static void
+bench_show ( void )
+{
+	struct row *rp;
+	int i;
+
+	serial_puts ( "\nCycles per word read or per instruction\n" );
+	serial_puts ( "MHz ws pf hc   fseq  frnd  sseq  srnd   fline fbrch sline sbrch   fseq ns fline ns\n" );
+
+	for ( rp = rows; rp < &rows[nrows]; rp++ ) {
+	    put_dec ( rp->mhz, 3 );
+	    put_dec ( rp->acr & 3, 3 );
+	    put_dec ( (rp->acr & FLASH_PREFETCH) ? 1 : 0, 3 );
+	    put_dec ( (rp->acr & FLASH_HCYCLE) ? 1 : 0, 3 );
+	    serial_puts ( " " );
+	    for ( i=0; i<4; i++ )
+		put_tenths ( rp->val[i], 6 );
+	    serial_puts ( "  " );
+	    for ( i=4; i<8; i++ )
+		put_tenths ( rp->val[i], 6 );
+	    serial_puts ( "  " );
+	    put_dec ( rp->val[0] * 100 / rp->mhz, 8 );
+	    put_dec ( rp->val[4] * 100 / rp->mhz, 9 );
+	    serial_putc ( '\n' );
+	}
+}
+
+void
+bench ( void )
+{
+	struct clock *cp;
+	vfptr line_ram, brch_ram;
+	u32 seed = 12345;
+	int ws;
+	int i;
+
+	dwt_init ();
+
+	for ( i=0; i<NRAND; i++ ) {
+	    seed = seed * 1103515245 + 12345;
+	    rand_idx[i] = seed >> 16;
+	}
+	for ( i=0; i<SRAM_WORDS; i++ )
+	    sram_buf[i] = i;
+
+	line_ram = code_copy ( code_ram[0], straight_line, straight_line_end );
+	brch_ram = code_copy ( code_ram[1], branchy, branchy_end );
+
+	serial_puts ( "Memory benchmark running ...\n" );
+	serial_flush ();
+
+	for ( cp = clocks; cp->mhz; cp++ ) {
+	    for ( ws = cp->min_wait; ws <= FLASH_WAIT2; ws++ ) {
+		bench_one ( cp->mhz, ws, line_ram, brch_ram );
+		bench_one ( cp->mhz, ws | FLASH_PREFETCH, line_ram, brch_ram );
+	    }
+	    /* The manual says half cycle is for below 8 Mhz,
+	     * HSI is right at 8, we try it anyway, but only here.
+	     * These rows are out of spec (hc is 1 in the table).
+	     */
+	    if ( cp->mhz == 8 ) {
+		bench_one ( cp->mhz, FLASH_HCYCLE, line_ram, brch_ram );
+		bench_one ( cp->mhz, FLASH_HCYCLE | FLASH_PREFETCH, line_ram, brch_ram );
+	    }
+	}
+
+	/* Back to how rcc_init left things */
+	rcc_set_clock ( 72, FLASH_PREFETCH | FLASH_WAIT2 );
+
+	bench_show ();
+}
+
+/* THE END */
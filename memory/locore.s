@@ -6,6 +6,7 @@
 # The Cortex M3 is a thumb only processor
 .cpu cortex-m3
 .thumb
+.syntax unified
 
 .word   0x20005000  /* stack top address */
 .word   _reset      /* 1 Reset */
@@ -36,4 +37,36 @@ _reset:
     bl startup
     b .
 
+@ Code for the instruction fetch tests in bench.c.
+@ Neither one touches memory or has a literal, so bench.c
+@ can copy them to SRAM (from here to the _end label) and
+@ run them there too.  It copies whole words, so both
+@ start on a word boundary.
+
+@ 256 instructions, 16 bits each, one after the other
+.globl straight_line
+.globl straight_line_end
+.align 2
+.thumb_func
+straight_line:
+.rept 256
+    adds    r0, #1
+.endr
+    bx      lr
+straight_line_end:
+
+@ 128 branches, every one taken, each to the next
+@ instruction, so the prefetch gets thrown away each time.
+.globl branchy
+.globl branchy_end
+.align 2
+.thumb_func
+branchy:
+.rept 128
+    b       1f
+1:
+.endr
+    bx      lr
+branchy_end:
+
 /* THE END */
@@ -133,6 +133,9 @@ main ( void )
 	show_n ( "xyz = ", xyz );
 	show_reg ( "xyz ... ", &xyz );
 
+	/* Flash, SRAM and clock settings, see bench.c */
+	bench ();
+
 	spin ();
 }
 
@@ -75,6 +75,7 @@ struct rcc {
 #define PLL_HSE2	0x30000	/* HSE/2 feeds PLL */
 
 #define PLL_2		0
+#define PLL_3		(1<<18)
 #define PLL_4		(2<<18)
 #define PLL_5		(3<<18)
 #define PLL_6		(4<<18)
@@ -144,6 +145,47 @@ rcc_clocks ( void )
 	// rp->cfg = PLL_HSE | PLL_10 | SYS_PLL | APB1_DIV2;
 }
 
+/* For the benchmark (bench.c), run at mhz with acr in the
+ * flash access control register.  8 Mhz is HSI by itself,
+ * anything else is the PLL on the 8 Mhz crystal (16 to 72
+ * in steps of 8).  We go back to HSI while the PLL gets
+ * changed, which is also where the reference manual wants
+ * us to be to turn the prefetch buffer on or off (below 24).
+ * The caller must not ask for fewer wait states than the
+ * clock needs, and the uart is only right at 72.
+ */
+void
+rcc_set_clock ( int mhz, int acr )
+{
+	struct rcc *rp = RCC_BASE;
+	int pll;
+
+	/* The PLL bits can't change while it runs */
+	rp->cfg &= ~3;
+	while ( (rp->cfg >> 2) & 3 )
+	    ;
+
+	rp->ccr = CCR_NORM;
+	while ( rp->ccr & PLL_LOCK )
+	    ;
+
+	* FLASH_ACR = acr;
+
+	if ( mhz <= 8 )
+	    return;
+
+	pll = (mhz / 8 - 2) << 18;
+
+	rp->cfg = PLL_HSE | pll | SYS_HSI | APB1_DIV2;
+	rp->ccr = CCR_NORM | PLL_ENABLE;
+	while ( ! (rp->ccr & PLL_LOCK ) )
+	   ;
+
+	rp->cfg = PLL_HSE | pll | SYS_PLL | APB1_DIV2;
+	while ( ((rp->cfg >> 2) & 3) != SYS_PLL )
+	    ;
+}
+
 void
 rcc_init ( void )
 {
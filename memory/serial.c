@@ -171,6 +171,18 @@ serial_puts ( char *s )
 	    serial_putc ( *s++ );
 }
 
+/* Wait for the last bit to leave, before
+ * anybody changes the clock out from under us.
+ */
+void
+serial_flush ( void )
+{
+	struct uart *up = UART1_BASE;
+
+	while ( ! (up->status & ST_TC) )
+	    ;
+}
+
 /* Quick and dirty */
 int
 serial2_getc ( void )
@@ -0,0 +1,229 @@
+/* adc.c
+ * (c) Tom Trebisky  12-10-2023
+ *
+ * Continuous ADC capture for the isochronous endpoint.
+ *
+ * The single conversion driver is in lithium1/adc.c,
+ * see the comments there for more about the ADC itself.
+ *
+ * Here, timer 3 generates TRGO at the sample rate and
+ * that starts each conversion.  DMA 1 channel 1 moves
+ * each result into a circular buffer that is split into
+ * two halves.  We get an interrupt as each half fills,
+ * and the USB code grabs the finished half while the
+ * DMA is busy with the other one.
+ *
+ * There is nothing for the processor to do per sample.
+ * We get 2 interrupts per millisecond at 32 kS/s
+ * and the sample timing comes straight from the timer.
+ *
+ * The ADC runs at 12 Mhz (see rcc.c).
+ * With a 28.5 cycle sample time a conversion takes
+ * 41 cycles or 3.4 microseconds, so we could go as
+ * fast as 290 kS/s if the USB side could keep up.
+ */
+
+#include "protos.h"
+
+struct adc {
+	vu32	sr;	/* status */
+	vu32	cr1;	/* control 1 */
+	vu32	cr2;	/* control 2 */
+	vu32	smpr1;	/* sample times ch 10 .. 17 */
+	vu32	smpr2;	/* sample times ch 0 .. 9 */
+	vu32	jof[4];	/* injected channel offsets */
+	vu32	htr;	/* watchdog high */
+	vu32	ltr;	/* watchdog low */
+	vu32	sqr1;	/* sequence reg ch 13 .. 16 and Len-1 */
+	vu32	sqr2;	/* sequence reg ch 7 .. 12 */
+	vu32	sqr3;	/* sequence reg ch 1 .. 6 */
+	vu32	jsqr;
+	vu32	jdr[4];	/* injected data registers */
+	vu32	dr;	/* data register */
+};
+
+#define ADC1_BASE	(struct adc *) 0x40012400
+
+/* Bits in CR2 */
+#define CR_ON		0x1		/* turn on the ADC */
+#define CR_CAL		0x4
+#define CR_RSTCAL	0x8
+#define CR_DMA		0x100		/* DMA requests on EOC */
+#define CR_EXTTRIG	0x100000	/* enable ext trigger */
+
+#define EV_T3_TRGO	4
+#define EXTSEL_SHIFT	17
+
+#define SAMP_28		3	/* 011: 28.5 cycles */
+
+/* Each channel has 5 registers (and a reserved word)
+ * so they are 20 bytes apart.
+ */
+struct dma_chan {
+	vu32	ccr;
+	vu32	cndtr;
+	vu32	cpar;
+	vu32	cmar;
+	u32	_pad;
+};
+
+struct dma {
+	vu32	isr;
+	vu32	ifcr;
+	struct dma_chan chan[7];
+};
+
+#define DMA1_BASE	(struct dma *) 0x40020000
+
+/* The ADC can only use channel 1 */
+#define ADC_DMA_CHAN	0
+#define DMA1_CH1_IRQ	11
+
+/* Bits in ccr */
+#define CCR_EN		0x0001
+#define CCR_TCIE	0x0002
+#define CCR_HTIE	0x0004
+#define CCR_CIRC	0x0020
+#define CCR_MINC	0x0080
+#define CCR_PSIZE_16	0x0100
+#define CCR_MSIZE_16	0x0400
+#define CCR_PL_HIGH	0x2000
+
+/* Bits in isr and ifcr for channel 1 */
+#define DMA_GIF1	0x1
+#define DMA_TCIF1	0x2
+#define DMA_HTIF1	0x4
+
+static u16 adc_buf[2*ADC_HALF];
+
+static u16 * volatile adc_ready;
+static volatile int adc_seq;
+static int adc_taken;
+static int adc_overrun;
+
+void
+dma1_ch1_handler ( void )
+{
+	struct dma *dp = DMA1_BASE;
+	int isr;
+
+	isr = dp->isr;
+	dp->ifcr = DMA_GIF1;
+
+	if ( isr & DMA_HTIF1 )
+	    adc_ready = &adc_buf[0];
+	if ( isr & DMA_TCIF1 )
+	    adc_ready = &adc_buf[ADC_HALF];
+
+	adc_seq++;
+}
+
+/* Returns the most recently filled half buffer
+ * (ADC_HALF samples), or 0 if nothing new has
+ * arrived since the last call.
+ * We count it when the consumer has fallen behind
+ * and a half got overwritten without being seen.
+ */
+u16 *
+adc_stream_get ( void )
+{
+	int seq = adc_seq;
+
+	if ( seq == adc_taken )
+	    return (u16 *) 0;
+
+	if ( seq - adc_taken > 1 )
+	    adc_overrun += seq - adc_taken - 1;
+	adc_taken = seq;
+
+	return adc_ready;
+}
+
+/* Power up and calibrate, once at boot.
+ * This takes a millisecond or more of waiting, which
+ * must not happen in adc_stream_start(), that gets called
+ * from the USB interrupt when the host picks the streaming
+ * alternate setting.  The host takes far longer than this
+ * to enumerate us, so we are done long before then.
+ */
+void
+adc_init ( void )
+{
+	struct adc *ap = ADC1_BASE;
+
+	ap->cr2 = CR_ON;
+	delay_ms ( 1 );
+
+	ap->cr2 |= CR_RSTCAL;
+	while ( ap->cr2 & CR_RSTCAL )
+	    ;
+	ap->cr2 |= CR_CAL;
+	while ( ap->cr2 & CR_CAL )
+	    ;
+}
+
+/* This leaves the ADC on, so it stays calibrated.
+ * Changing other bits along with CR_ON does not start
+ * a conversion.
+ */
+void
+adc_stream_stop ( void )
+{
+	struct adc *ap = ADC1_BASE;
+	struct dma *dp = DMA1_BASE;
+
+	timer3_stop ();
+
+	ap->cr2 &= ~(CR_DMA | CR_EXTTRIG | (7 << EXTSEL_SHIFT));
+	dp->chan[ADC_DMA_CHAN].ccr = 0;
+	dp->ifcr = DMA_GIF1;
+}
+
+/* chan is the ADC input (0-7 are A0-A7) */
+void
+adc_stream_start ( int chan, int rate )
+{
+	struct adc *ap = ADC1_BASE;
+	struct dma *dp = DMA1_BASE;
+	struct dma_chan *cp = &dp->chan[ADC_DMA_CHAN];
+
+	adc_stream_stop ();
+
+	gpio_a_analog ( chan );
+
+	/* adc_init() has it on and calibrated */
+	ap->smpr1 = 0;
+	ap->smpr2 = SAMP_28 << (3*chan);
+	ap->sqr1 = 0;
+	ap->sqr2 = 0;
+	ap->sqr3 = chan;
+
+	adc_ready = (u16 *) 0;
+	adc_seq = 0;
+	adc_taken = 0;
+
+	cp->cpar = (u32) &ap->dr;
+	cp->cmar = (u32) adc_buf;
+	cp->cndtr = 2*ADC_HALF;
+	cp->ccr = CCR_MINC | CCR_CIRC | CCR_PSIZE_16 | CCR_MSIZE_16 |
+	    CCR_PL_HIGH | CCR_HTIE | CCR_TCIE;
+	cp->ccr |= CCR_EN;
+
+	nvic_priority ( DMA1_CH1_IRQ, PRI_DMA );
+	nvic_enable ( DMA1_CH1_IRQ );
+
+	/* Writing this without changing CR_ON does not start
+	 * a conversion, we wait for the timer.
+	 */
+	ap->cr2 = CR_ON | CR_DMA | CR_EXTTRIG | (EV_T3_TRGO << EXTSEL_SHIFT);
+
+	timer3_trgo ( rate );
+}
+
+void
+adc_stream_show ( void )
+{
+	printf ( "ADC stream: %d halves, %d overrun\n", adc_seq, adc_overrun );
+}
+
+/* THE END */
@@ -0,0 +1,64 @@
+/* boot.c
+ * (c) Tom Trebisky  12-30-2023
+ *
+ * How long from reset until we are any use?
+ * These boards get power cycled a lot, and the host
+ * does not wait forever for us to show up on the bus.
+ *
+ * _reset in locore.s starts the cycle counter before
+ * anything else, so it counts from (all but) the reset.
+ * boot_stamp() records it at each milestone, the first
+ * time only, and boot_show() prints the lot.
+ *
+ * Until rcc_init() switches to the PLL we run on HSI at 8 Mhz,
+ * and the counter counts those slower clocks, so everything
+ * up to B_CLOCK gets turned into time at 8 Mhz.
+ */
+
+#include "protos.h"
+
+#define HSI_MHZ		8
+
+static char *boot_names[B_NUM] = {
+	"data and bss",
+	"clock (PLL)",
+	"first log line",
+	"USB ready",
+	"all started",
+	"USB configured"
+};
+
+static u32 boot_cyc[B_NUM];
+
+void
+boot_stamp ( int which )
+{
+	if ( which < 0 || which >= B_NUM )
+	    return;
+	if ( ! boot_cyc[which] )
+	    boot_cyc[which] = dwt_read ();
+}
+
+void
+boot_show ( void )
+{
+	int mhz = get_hclk () / 1000000;
+	u32 last = 0;
+	u32 us = 0;
+	u32 cyc;
+	int i;
+
+	printf ( "Boot times from reset:\n" );
+	for ( i=0; i<B_NUM; i++ ) {
+	    if ( ! boot_cyc[i] ) {
+		printf ( "  %s: not yet\n", boot_names[i] );
+		continue;
+	    }
+	    cyc = boot_cyc[i] - last;
+	    last = boot_cyc[i];
+	    us += cyc / (i <= B_CLOCK ? HSI_MHZ : mhz);
+	    printf ( "  %s: %d us (+%d cycles)\n", boot_names[i], us, cyc );
+	}
+}
+
+/* THE END */
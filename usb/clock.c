@@ -0,0 +1,123 @@
+/* clock.c
+ * (c) Tom Trebisky  12-22-2023
+ *
+ * A time base that only goes forward, and delays we can trust.
+ *
+ *   clock_cycles ()	processor clocks since boot, 64 bits
+ *   clock_us ()	microseconds since boot, 64 bits
+ *   delay_cycles ( n )
+ *   delay_us ( n )
+ *
+ * The old delay_ms() counted a volatile int down and was
+ * calibrated by looking at what the compiler made of it,
+ * which changed when we went to -O2 (see main.c).
+ * Here everything comes from the DWT cycle counter (nvic.c),
+ * which counts processor clocks no matter what code is running.
+ *
+ * CYCCNT is only 32 bits and wraps every 59 seconds at 72 Mhz.
+ * The systick interrupt calls clock_tick() every millisecond,
+ * which counts the wraps.  A reader takes the wrap count, the
+ * last value the interrupt saw, and the counter, and tries
+ * again if the interrupt got in the middle of that, so no
+ * interrupts get turned off.  If the counter is behind what
+ * the interrupt last saw, it has wrapped since.
+ *
+ * Cycles per microsecond come from the clock tree as rcc.c
+ * actually set it up (get_hclk), not from a #define.
+ */
+
+#include "protos.h"
+
+static u32 cyc_per_us;
+
+static volatile u32 cyc_hi;
+static volatile u32 cyc_last;
+
+/* From systick_handler */
+void
+clock_tick ( void )
+{
+	u32 now = dwt_read ();
+
+	if ( now < cyc_last )
+	    cyc_hi++;
+	cyc_last = now;
+}
+
+u64
+clock_cycles ( void )
+{
+	u32 hi, last, now;
+
+	do {
+	    hi = cyc_hi;
+	    last = cyc_last;
+	    now = dwt_read ();
+	} while ( hi != cyc_hi || last != cyc_last );
+
+	if ( now < last )
+	    hi++;
+
+	return (u64) hi << 32 | now;
+}
+
+/* We link without libgcc, so there is no 64 bit divide.
+ * The divisor is small (72) so this can go 16 bits at a time
+ * with ordinary 32 bit divides.
+ */
+static u64
+div_small ( u64 n, u32 d )
+{
+	u32 r = 0;
+	u64 q = 0;
+	u32 x;
+	int i;
+
+	for ( i=48; i>=0; i -= 16 ) {
+	    x = r << 16 | ((n >> i) & 0xffff);
+	    q = q << 16 | (x / d);
+	    r = x % d;
+	}
+	return q;
+}
+
+u64
+clock_us ( void )
+{
+	return div_small ( clock_cycles (), cyc_per_us );
+}
+
+/* Exact to a few cycles, whatever the optimizer does.
+ * Unsigned subtraction takes care of the counter wrapping,
+ * n can be anything up to 59 seconds worth.
+ */
+void
+delay_cycles ( u32 n )
+{
+	u32 start = dwt_read ();
+
+	while ( dwt_read () - start < n )
+	    ;
+}
+
+void
+delay_us ( u32 us )
+{
+	/* one second at a time keeps n in 32 bits */
+	while ( us > 1000000 ) {
+	    delay_cycles ( 1000000 * cyc_per_us );
+	    us -= 1000000;
+	}
+	delay_cycles ( us * cyc_per_us );
+}
+
+/* Call after rcc_init and dwt_init */
+void
+clock_init ( void )
+{
+	cyc_per_us = get_hclk () / 1000000;
+	cyc_hi = 0;
+	cyc_last = dwt_read ();
+}
+
+/* THE END */
@@ -0,0 +1,126 @@
+#!/bin/ruby
+
+# enum2pcap.rb
+# Tom Trebisky  12-13-2023
+#
+# Turn the enumeration log dump from usb_watch.c into
+# a pcap file that wireshark can read.
+#
+# Type '!' on the console, save the output (picocom --logfile
+# or whatever), then:
+#
+#  ./enum2pcap.rb console.log enum.pcap
+#
+# We write LINKTYPE_USB_LINUX_MMAPPED (220), which is what
+# usbmon captures on the host side use, so the two can be
+# looked at side by side.  Our timestamps start at the time
+# this script runs, only the differences mean anything.
+#
+# We see things from the device side, so the mapping is:
+#  Rx with setup  -- submit ('S') of a control transfer
+#  Rx without     -- submit ('S') of control OUT data
+#  Tx             -- completion ('C') with the IN data
+# Each setup packet starts a new URB id, so wireshark pairs
+# the completion with the setup that started it.
+
+LINKTYPE_USB_LINUX_MMAPPED = 220
+
+XFER_CONTROL = 2
+
+if ARGV.size != 2
+    puts "usage: enum2pcap log_file pcap_file"
+    exit
+end
+
+clock = 72_000_000
+recs = []
+
+File.open( ARGV[0] ).each_line { |l|
+    clock = $1.to_i if l =~ /^Enum log: .* clock (\d+)/
+    next unless l =~ /^E ([0-9a-f]+)/
+    b = [ $1 ].pack "H*"
+    stamp, frame, what, setup, istr, epr, count = b.unpack "VvCCvvC"
+    recs << { stamp: stamp, frame: frame, what: what, setup: setup,
+	      data: b[13, count] || "" }
+}
+
+if recs.empty?
+    puts "No enum log records in #{ARGV[0]}"
+    exit
+end
+
+# The cycle counter wraps after 59 seconds at 72 Mhz
+wrap = 0
+last = 0
+recs.each { |r|
+    wrap += 1 << 32 if r[:stamp] < last
+    last = r[:stamp]
+    r[:time] = (r[:stamp] + wrap).to_f / clock
+}
+
+base = Time.now.to_f
+
+# The 64 byte usbmon header in front of each packet
+def mon_header ( id, event, ep, addr, setup, data, len, time, frame )
+    sec = time.floor
+    usec = ((time - sec) * 1_000_000).round
+    setup_flag = setup ? 0 : '-'.ord
+    data_flag = data.size > 0 ? 0 : '<'.ord
+    [ id, event.ord, XFER_CONTROL, ep, addr, 1, setup_flag, data_flag,
+      sec, usec, 0, len, data.size, setup || "\0" * 8,
+      0, frame, 0, 0 ].pack "Q<CCCCvccq<l<l<VVa8l<l<VV"
+end
+
+out = File.open( ARGV[1], "wb" )
+out.write [ 0xa1b2c3d4, 2, 4, 0, 0, 65535, LINKTYPE_USB_LINUX_MMAPPED ].pack "VvvlVVV"
+
+id = 0
+addr = 0
+new_addr = nil
+dir_in = false
+resets = 0
+
+recs.each { |r|
+    t = base + r[:time]
+    sec = t.floor
+    usec = ((t - sec) * 1_000_000).round
+    d = r[:data]
+
+    case r[:what]
+    when 2
+	resets += 1
+	addr = 0
+	next
+    when 0
+	if r[:setup] == 1
+	    id += 1
+	    dir_in = (d.getbyte(0) || 0) & 0x80 != 0
+	    new_addr = d.getbyte(2) if d[0,2] == "\x00\x05".b
+	    len = d[6,2] ? d[6,2].unpack("v")[0] : 0
+	    ep = dir_in ? 0x80 : 0x00
+	    pkt = mon_header( id, 'S', ep, addr, d[0,8], "", len, t, r[:frame] )
+	else
+	    pkt = mon_header( id, 'S', 0x00, addr, nil, d, d.size, t, r[:frame] )
+	end
+    when 1
+	ep = dir_in ? 0x80 : 0x00
+	pkt = mon_header( id, 'C', ep, addr, nil, d, d.size, t, r[:frame] )
+	# set address takes effect after the status stage
+	if new_addr
+	    addr = new_addr
+	    new_addr = nil
+	end
+    else
+	next
+    end
+
+    pkt += d if r[:what] != 0 || r[:setup] != 1
+    out.write [ sec, usec, pkt.size, pkt.size ].pack "VVVV"
+    out.write pkt
+}
+
+out.close
+print "%d records, %d resets, %.3f ms total\n" % [ recs.size, resets,
+	1000.0 * recs.last[:time] ]
+
+# THE END
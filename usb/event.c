@@ -0,0 +1,200 @@
+/* event.c
+ * (c) Tom Trebisky  12-23-2023
+ *
+ * A small run to completion event scheduler.
+ *
+ * Interrupt handlers used to do everything right there,
+ * printing included, and main() just spun.  Now a handler
+ * can do the part that can't wait and hand the rest off:
+ *
+ *   event_post ( EV_LOW, func, arg );
+ *
+ * func(arg) then gets called from the PendSV exception,
+ * which we set to the lowest priority there is.  So it runs
+ * as soon as no interrupt is active, and any interrupt can
+ * cut in on it.  Events never cut in on each other, each
+ * one runs to the end before the next starts, higher EV_
+ * priorities (smaller numbers) first, in order within one.
+ *
+ * This matters for printing in particular.  serial_putc()
+ * waits for room in the queue, which the uart interrupt
+ * makes, so it must not be called from anything at the
+ * uart priority or above.  From an event it is fine.
+ *
+ * Each priority has its own ring.  Posting is lock free,
+ * a slot is claimed with ldrex/strex on the head index and
+ * marked ready once it is filled in.  Any exception entry
+ * or return clears the exclusive monitor, so if another
+ * poster gets in between, our strex fails and we go around
+ * again.  Interrupts always finish before PendSV runs, but
+ * code in thread mode (main) can be caught between claiming
+ * a slot and marking it ready, so the dispatcher stops at a
+ * slot that is not ready, and the poster raises PendSV
+ * again when it is done.
+ *
+ * With nothing left to do, main() sleeps in WFI.
+ */
+
+#include "protos.h"
+
+#define EV_QSIZE	16		/* a power of 2 */
+#define EV_MASK		(EV_QSIZE-1)
+
+#define PENDSV_EXC	14
+#define PRI_LOWEST	15
+
+struct event {
+	evfptr func;
+	void *arg;
+	u32 stamp;		/* DWT when posted */
+	volatile int ready;
+};
+
+struct evq {
+	struct event ev[EV_QSIZE];
+	volatile u32 head;	/* posters claim here */
+	u32 tail;		/* only the dispatcher moves this */
+};
+
+static struct evq evq[EV_NPRI];
+
+static int ev_posted;
+static int ev_run;
+static int ev_dropped;
+static u32 ev_wait_max;		/* cycles from post to run */
+static u32 ev_run_max;		/* cycles in one handler */
+
+static inline u32
+ldrex ( volatile u32 *p )
+{
+	u32 val;
+
+	__asm volatile ( "ldrex %0, [%1]" : "=r" (val) : "r" (p) );
+	return val;
+}
+
+/* Returns 0 on success */
+static inline int
+strex ( u32 val, volatile u32 *p )
+{
+	int rv;
+
+	__asm volatile ( "strex %0, %1, [%2]" : "=&r" (rv) : "r" (val), "r" (p) : "memory" );
+	return rv;
+}
+
+static inline void
+clrex ( void )
+{
+	__asm volatile ( "clrex" ::: "memory" );
+}
+
+/* Safe from anywhere, returns -1 if the ring is full */
+int
+event_post ( int pri, evfptr func, void *arg )
+{
+	struct evq *qp;
+	struct event *ep;
+	u32 head;
+
+	if ( pri < 0 || pri >= EV_NPRI )
+	    return -1;
+	qp = &evq[pri];
+
+	do {
+	    head = ldrex ( &qp->head );
+	    if ( head - qp->tail >= EV_QSIZE ) {
+		clrex ();
+		ev_dropped++;
+		return -1;
+	    }
+	} while ( strex ( head + 1, &qp->head ) );
+
+	ep = &qp->ev[head & EV_MASK];
+	ep->func = func;
+	ep->arg = arg;
+	ep->stamp = dwt_read ();
+	__asm volatile ( "dmb" ::: "memory" );
+	ep->ready = 1;
+
+	ev_posted++;
+	pendsv_raise ();
+	return 0;
+}
+
+/* The next event that is ready, highest priority first */
+static struct event *
+event_next ( struct evq **qpp )
+{
+	struct evq *qp;
+	struct event *ep;
+	int pri;
+
+	for ( pri=0; pri<EV_NPRI; pri++ ) {
+	    qp = &evq[pri];
+	    if ( qp->tail == qp->head )
+		continue;
+	    ep = &qp->ev[qp->tail & EV_MASK];
+	    if ( ! ep->ready )
+		continue;
+	    *qpp = qp;
+	    return ep;
+	}
+	return 0;
+}
+
+/* The dispatcher, pendsv_handler in locore.s calls this
+ * and then switches threads if the kernel wants to.
+ */
+void
+event_dispatch ( void )
+{
+	struct evq *qp;
+	struct event *ep;
+	evfptr func;
+	void *arg;
+	u32 start;
+
+	while ( ep = event_next ( &qp ) ) {
+	    func = ep->func;
+	    arg = ep->arg;
+	    start = dwt_read ();
+	    if ( start - ep->stamp > ev_wait_max )
+		ev_wait_max = start - ep->stamp;
+
+	    /* give the slot back before we run it */
+	    ep->ready = 0;
+	    qp->tail++;
+
+	    (*func) ( arg );
+
+	    ev_run++;
+	    start = dwt_read () - start;
+	    if ( start > ev_run_max )
+		ev_run_max = start;
+	}
+}
+
+void
+event_show ( void )
+{
+	printf ( "Events: %d posted, %d run, %d dropped\n",
+	    ev_posted, ev_run, ev_dropped );
+	printf ( "Longest wait %d cycles, longest run %d cycles\n",
+	    ev_wait_max, ev_run_max );
+}
+
+void
+event_init ( void )
+{
+	int i;
+
+	for ( i=0; i<EV_NPRI; i++ ) {
+	    evq[i].head = 0;
+	    evq[i].tail = 0;
+	}
+
+	nvic_sys_priority ( PENDSV_EXC, PRI_LOWEST );
+}
+
+/* THE END */
@@ -134,6 +134,12 @@ gpio_c_input ( int bit )
 	gpio_mode ( GPIOC_BASE, bit, INPUT_FLOAT );
 }
 
+void
+gpio_a_analog ( int bit )
+{
+	gpio_mode ( GPIOA_BASE, bit, INPUT_ANALOG );
+}
+
 /* On a blue pill, the LED is on PC13 */
 /* On the maple, it is on PA5 */
 /* USB disconnect on the Maple is PC12 */
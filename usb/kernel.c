@@ -0,0 +1,578 @@
+/* kernel.c
+ * (c) Tom Trebisky  12-26-2023
+ *
+ * A minimal preemptive kernel for the Cortex-M3.
+ *
+ * The USB console, ADC logging and anything else we want
+ * to run at the same time each get a thread, and a thread
+ * that waits now sleeps instead of spinning.
+ *
+ *   thread_create ( name, func, arg, pri, stack, words )
+ *   thread_sleep ( ms )
+ *   thread_yield ()
+ *   sem_wait / sem_post
+ *   mq_send / mq_recv / mq_post
+ *
+ * Everything is static, NUM_THREADS thread control blocks
+ * and a stack (an array of words in SRAM) for each thread,
+ * handed to us by whoever makes the thread.
+ *
+ * Priority 0 is the most important, NUM_PRI-1 is the idle
+ * thread.  Each priority has a list of ready threads, the
+ * one at the head runs, and ready_map has a bit for each
+ * non-empty list (bit 31 for priority 0) so a clz finds
+ * the one to run.  The systick interrupt (1 ms) rotates
+ * the running list every SLICE_MS, so threads at the same
+ * priority share, and wakes up sleepers.
+ *
+ * The switch itself is in locore.s, in the PendSV handler.
+ * It runs after any events (event.c), and if kern_next is
+ * not kern_cur it saves r4-r11 on the thread stack (the
+ * hardware has already pushed the rest there), saves the
+ * stack pointer in the thread block, and does the reverse
+ * for kern_next.  Threads run on PSP and all interrupts
+ * and exceptions on MSP, the stack main() started on.
+ *
+ * sem_post and mq_post are fine from interrupts at PRI_KERNEL
+ * or below (protos.h).  Our critical sections only mask that
+ * far (BASEPRI), so anything more urgent never waits on us.
+ * The rest block and can only be called from a thread,
+ * and not from inside an irq_mask().
+ */
+
+#include "protos.h"
+
+#define NUM_THREADS	8
+#define NUM_PRI		8
+#define IDLE_PRI	(NUM_PRI-1)
+
+#define SLICE_MS	10
+
+#define STACK_MAGIC	0xdeadbeef
+
+#define XPSR_THUMB	0x01000000
+
+/* Thread states */
+#define T_FREE		0
+#define T_READY		1
+#define T_BLOCKED	2
+#define T_SLEEP		3
+#define T_DEAD		4
+
+static char *state_names[] = { "free", "ready", "blocked", "sleep", "dead" };
+
+/* sp must come first, locore.s knows where it is */
+struct thread {
+	u32 *sp;
+	struct thread *next;	/* ready or wait list */
+	char *name;
+	int pri;
+	int state;
+	int sleep;		/* ms to go */
+	int runs;		/* times switched in */
+	u32 *stack;
+	int words;
+};
+
+static struct thread threads[NUM_THREADS];
+static struct thread boot_thread;
+
+static struct thread *ready[NUM_PRI];
+static u32 ready_map;
+
+/* locore.s uses these */
+struct thread *kern_cur;
+struct thread *kern_next;
+
+static int kern_running;
+static int kern_slice;
+static int kern_switches;
+
+/* Somewhere for main() to be for the one PendSV that gets it
+ * off the MSP stack and into the first thread.
+ */
+static u32 boot_stack[32] __attribute__ ((aligned(8)));
+
+#define IDLE_STACK	64
+static u32 idle_stack[IDLE_STACK] __attribute__ ((aligned(8)));
+
+static inline int
+clz ( u32 val )
+{
+	int rv;
+
+	__asm volatile ( "clz %0, %1" : "=r" (rv) : "r" (val) );
+	return rv;
+}
+
+/* Nonzero in an interrupt or exception */
+static inline int
+in_handler ( void )
+{
+	u32 ipsr;
+
+	__asm volatile ( "mrs %0, ipsr" : "=r" (ipsr) );
+	return ipsr & 0x1ff;
+}
+
+/* True when the caller is a thread and may block */
+int
+kern_can_block ( void )
+{
+	return kern_running && ! in_handler ();
+}
+
+/* ---------------------------------------------------------- */
+
+/* All of these are called inside irq_mask ( PRI_KERNEL ) */
+
+static void
+ready_add ( struct thread *tp )
+{
+	struct thread **pp;
+
+	pp = &ready[tp->pri];
+	while ( *pp )
+	    pp = &(*pp)->next;
+	*pp = tp;
+	tp->next = 0;
+
+	tp->state = T_READY;
+	ready_map |= 0x80000000 >> tp->pri;
+}
+
+static void
+ready_remove ( struct thread *tp )
+{
+	struct thread **pp;
+
+	pp = &ready[tp->pri];
+	while ( *pp && *pp != tp )
+	    pp = &(*pp)->next;
+	if ( *pp )
+	    *pp = tp->next;
+	tp->next = 0;
+
+	if ( ! ready[tp->pri] )
+	    ready_map &= ~(0x80000000 >> tp->pri);
+}
+
+/* Pick the thread to run, PendSV does the rest */
+static void
+kern_schedule ( void )
+{
+	if ( ! kern_running )
+	    return;
+
+	kern_next = ready[clz(ready_map)];
+	if ( kern_next != kern_cur ) {
+	    kern_next->runs++;
+	    kern_switches++;
+	    pendsv_raise ();
+	}
+}
+
+/* Take the current thread off the ready list.
+ * The switch happens when the caller turns
+ * interrupts back on.
+ */
+static void
+kern_block ( int state )
+{
+	ready_remove ( kern_cur );
+	kern_cur->state = state;
+	kern_schedule ();
+}
+
+/* ---------------------------------------------------------- */
+
+/* Where a thread goes if its function returns */
+static void
+thread_exit ( void )
+{
+	u32 old;
+
+	old = irq_mask ( PRI_KERNEL );
+	kern_block ( T_DEAD );
+	irq_unmask ( old );
+
+	for ( ;; )
+	    ;
+}
+
+/* The stack gets the frame the hardware would have pushed
+ * on an exception, plus r4-r11 the way PendSV saves them,
+ * so the first switch to us "returns" to func(arg).
+ * The M3 wants 8 byte aligned stacks.
+ */
+int
+thread_create ( char *name, tfptr func, void *arg, int pri, u32 *stack, int words )
+{
+	struct thread *tp;
+	u32 *sp;
+	int i;
+	u32 old;
+
+	if ( pri < 0 || pri >= NUM_PRI )
+	    return -1;
+
+	for ( i=0; i<NUM_THREADS; i++ )
+	    if ( threads[i].state == T_FREE || threads[i].state == T_DEAD )
+		break;
+	if ( i == NUM_THREADS )
+	    return -1;
+	tp = &threads[i];
+
+	for ( i=0; i<words; i++ )
+	    stack[i] = STACK_MAGIC;
+
+	sp = (u32 *) ((u32) (stack + words) & ~7);
+	*--sp = XPSR_THUMB;
+	*--sp = (u32) func;		/* pc */
+	*--sp = (u32) thread_exit;	/* lr */
+	*--sp = 0;			/* r12 */
+	*--sp = 0;			/* r3 */
+	*--sp = 0;			/* r2 */
+	*--sp = 0;			/* r1 */
+	*--sp = (u32) arg;		/* r0 */
+	for ( i=0; i<8; i++ )
+	    *--sp = 0;			/* r11 .. r4 */
+
+	tp->sp = sp;
+	tp->name = name;
+	tp->pri = pri;
+	tp->sleep = 0;
+	tp->runs = 0;
+	tp->stack = stack;
+	tp->words = words;
+
+	old = irq_mask ( PRI_KERNEL );
+	ready_add ( tp );
+	kern_schedule ();
+	irq_unmask ( old );
+
+	return tp - threads;
+}
+
+void
+thread_sleep ( int ms )
+{
+	u32 old;
+
+	old = irq_mask ( PRI_KERNEL );
+	kern_cur->sleep = ms;
+	kern_block ( T_SLEEP );
+	irq_unmask ( old );
+}
+
+/* Let the others at our priority have a turn */
+void
+thread_yield ( void )
+{
+	u32 old;
+
+	old = irq_mask ( PRI_KERNEL );
+	ready_remove ( kern_cur );
+	ready_add ( kern_cur );
+	kern_schedule ();
+	irq_unmask ( old );
+}
+
+/* From systick_handler, every millisecond */
+void
+kern_tick ( void )
+{
+	struct thread *tp;
+	int i;
+	u32 old;
+
+	if ( ! kern_running )
+	    return;
+
+	old = irq_mask ( PRI_KERNEL );
+	for ( i=0; i<NUM_THREADS; i++ ) {
+	    tp = &threads[i];
+	    if ( tp->state == T_SLEEP && --tp->sleep <= 0 )
+		ready_add ( tp );
+	}
+
+	if ( ++kern_slice >= SLICE_MS ) {
+	    kern_slice = 0;
+	    tp = kern_cur;
+	    if ( tp->state == T_READY && ready[tp->pri] == tp && tp->next ) {
+		ready_remove ( tp );
+		ready_add ( tp );
+	    }
+	}
+
+	kern_schedule ();
+	irq_unmask ( old );
+}
+
+/* ---------------------------------------------------------- */
+
+/* Counting semaphores, waiters are woken in order */
+
+void
+sem_init ( struct sem *sp, int count )
+{
+	sp->count = count;
+	sp->wait = 0;
+}
+
+void
+sem_wait ( struct sem *sp )
+{
+	struct thread **pp;
+	u32 old;
+
+	old = irq_mask ( PRI_KERNEL );
+	if ( sp->count > 0 ) {
+	    sp->count--;
+	    irq_unmask ( old );
+	    return;
+	}
+
+	pp = &sp->wait;
+	while ( *pp )
+	    pp = &(*pp)->next;
+
+	kern_block ( T_BLOCKED );
+	*pp = kern_cur;
+	kern_cur->next = 0;
+	irq_unmask ( old );
+
+	/* By the time we get here, sem_post gave us the count */
+}
+
+/* Returns 1 if we got it, 0 if we would have to wait */
+int
+sem_try ( struct sem *sp )
+{
+	int rv = 0;
+	u32 old;
+
+	old = irq_mask ( PRI_KERNEL );
+	if ( sp->count > 0 ) {
+	    sp->count--;
+	    rv = 1;
+	}
+	irq_unmask ( old );
+
+	return rv;
+}
+
+void
+sem_post ( struct sem *sp )
+{
+	struct thread *tp;
+	u32 old;
+
+	old = irq_mask ( PRI_KERNEL );
+	tp = sp->wait;
+	if ( tp ) {
+	    sp->wait = tp->next;
+	    ready_add ( tp );
+	    kern_schedule ();
+	} else
+	    sp->count++;
+	irq_unmask ( old );
+}
+
+/* ---------------------------------------------------------- */
+
+/* Message queues of one word messages, a ring and two
+ * semaphores, one counting messages and one counting room.
+ */
+
+void
+mq_init ( struct mq *mp, u32 *buf, int size )
+{
+	mp->buf = buf;
+	mp->size = size;
+	mp->head = 0;
+	mp->tail = 0;
+	sem_init ( &mp->items, 0 );
+	sem_init ( &mp->room, size );
+}
+
+static void
+mq_put ( struct mq *mp, u32 msg )
+{
+	u32 old;
+
+	old = irq_mask ( PRI_KERNEL );
+	mp->buf[mp->head] = msg;
+	mp->head = (mp->head + 1) % mp->size;
+	irq_unmask ( old );
+
+	sem_post ( &mp->items );
+}
+
+/* Waits for room */
+void
+mq_send ( struct mq *mp, u32 msg )
+{
+	sem_wait ( &mp->room );
+	mq_put ( mp, msg );
+}
+
+/* For interrupts, -1 if the queue is full */
+int
+mq_post ( struct mq *mp, u32 msg )
+{
+	if ( ! sem_try ( &mp->room ) )
+	    return -1;
+	mq_put ( mp, msg );
+	return 0;
+}
+
+u32
+mq_recv ( struct mq *mp )
+{
+	u32 msg;
+	u32 old;
+
+	sem_wait ( &mp->items );
+
+	old = irq_mask ( PRI_KERNEL );
+	msg = mp->buf[mp->tail];
+	mp->tail = (mp->tail + 1) % mp->size;
+	irq_unmask ( old );
+
+	sem_post ( &mp->room );
+	return msg;
+}
+
+/* ---------------------------------------------------------- */
+
+static void
+idle_thread ( void *arg )
+{
+	for ( ;; )
+	    cpu_idle ();
+}
+
+/* How much of the stack has never been touched */
+static int
+stack_free ( struct thread *tp )
+{
+	int i;
+
+	for ( i=0; i<tp->words; i++ )
+	    if ( tp->stack[i] != STACK_MAGIC )
+		break;
+	return i;
+}
+
+void
+kern_show ( void )
+{
+	struct thread *tp;
+	int i;
+
+	printf ( "Kernel: %d switches\n", kern_switches );
+	for ( i=0; i<NUM_THREADS; i++ ) {
+	    tp = &threads[i];
+	    if ( tp->state == T_FREE )
+		continue;
+	    printf ( " %-8s pri %d %-7s %d runs, %d of %d stack words free\n",
+		tp->name, tp->pri, state_names[tp->state], tp->runs,
+		stack_free ( tp ), tp->words );
+	}
+}
+
+void
+kern_init ( void )
+{
+	int i;
+
+	for ( i=0; i<NUM_THREADS; i++ )
+	    threads[i].state = T_FREE;
+	for ( i=0; i<NUM_PRI; i++ )
+	    ready[i] = 0;
+	ready_map = 0;
+	kern_running = 0;
+
+	thread_create ( "idle", idle_thread, 0, IDLE_PRI, idle_stack, IDLE_STACK );
+}
+
+/* Never returns, main() becomes boot_thread
+ * which nobody will ever run again.
+ * kern_launch (locore.s) moves us onto boot_stack
+ * and PSP, so PendSV has somewhere to save us,
+ * and then turns interrupts on to let it happen.
+ */
+void
+kern_start ( void )
+{
+	boot_thread.name = "boot";
+	boot_thread.state = T_DEAD;
+	kern_cur = &boot_thread;
+
+	disable_irq ();
+	kern_running = 1;
+	kern_next = ready[clz(ready_map)];
+
+	kern_launch ( &boot_stack[32] );
+}
+
+/* ---------------------------------------------------------- */
+
+/* Context switch benchmark.
+ * Two threads hand a semaphore back and forth, so every
+ * post is a switch.  The time per switch includes the
+ * sem_post and sem_wait that cause it, which is what
+ * anyone using this is going to pay.
+ */
+
+#define BENCH_COUNT	1000
+#define BENCH_STACK	128
+
+static struct sem bench_a;
+static struct sem bench_b;
+static u32 bench_stack[BENCH_STACK] __attribute__ ((aligned(8)));
+
+static void
+bench_partner ( void *arg )
+{
+	int i;
+
+	for ( i=0; i<BENCH_COUNT; i++ ) {
+	    sem_wait ( &bench_b );
+	    sem_post ( &bench_a );
+	}
+}
+
+/* Call from a thread at priority pri,
+ * the partner runs one higher.
+ */
+void
+kern_bench ( int pri )
+{
+	u32 start, cycles;
+	int i;
+
+	sem_init ( &bench_a, 0 );
+	sem_init ( &bench_b, 0 );
+	thread_create ( "bench", bench_partner, 0, pri-1, bench_stack, BENCH_STACK );
+
+	start = dwt_read ();
+	for ( i=0; i<BENCH_COUNT; i++ ) {
+	    sem_post ( &bench_b );
+	    sem_wait ( &bench_a );
+	}
+	cycles = dwt_read () - start;
+
+	printf ( "Context switch: %d cycles (%d switches in %d cycles)\n",
+	    cycles / (2*BENCH_COUNT), 2*BENCH_COUNT, cycles );
+
+	/* and the bare yield, to ourself */
+	start = dwt_read ();
+	for ( i=0; i<BENCH_COUNT; i++ )
+	    thread_yield ();
+	cycles = dwt_read () - start;
+	printf ( "Yield with nobody to yield to: %d cycles\n", cycles / BENCH_COUNT );
+}
+
+/* THE END */
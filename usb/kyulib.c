@@ -24,6 +24,7 @@
  */
 
 #include "kyulib.h"
+#include "protos.h"
 
 /* This is a different API than in Kyu.
  * The caller should static allocate the structure.
@@ -87,7 +88,7 @@ cq_space ( struct cqueue *qp )
  * (This will usually be called in an interrupt routine,
  *  where locking will be implicit.)
  */
-void
+void RAMFUNC
 cq_add ( struct cqueue *qp, int ch )
 {
 	if ( qp->count < qp->size ) {
@@ -110,7 +111,7 @@ cq_toss ( struct cqueue *qp )
  * but now the onus is on the caller to do
  * any locking external to this facility.
  */
-int
+int RAMFUNC
 cq_remove ( struct cqueue *qp )
 {
 	int ch;
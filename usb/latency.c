@@ -0,0 +1,117 @@
+/* latency.c
+ * (c) Tom Trebisky  12-27-2023
+ *
+ * How long does an interrupt wait before its handler runs?
+ *
+ *   latency_test ( pri, count )
+ *
+ * We take the cycle counter, make IRQ 6 pending by writing the
+ * NVIC pending register, and the handler takes the counter again
+ * first thing.  Nothing else uses IRQ 6 (EXTI line 0), so it is
+ * ours, and it can be given any priority we want to try out.
+ * The handler gets plugged in with irq_attach(), so this needs
+ * the vector table in SRAM (RAM_VECTORS in main.c).
+ *
+ * With nothing in the way this is the hardware entry time
+ * (12 cycles on the M3) plus a few to get the counter.
+ * Anything more is time spent behind a handler at the same or
+ * a more urgent priority, or inside an irq_mask() that covers
+ * it.  The samples are spread out over a second or so, to catch
+ * whatever else is going on (USB, uart, timers) at the time.
+ *
+ * Call it from a thread (or main), not from an interrupt.
+ */
+
+#include "protos.h"
+
+#define LAT_IRQ		6
+
+#define LAT_BUCKETS	8
+
+static volatile u32 lat_start;
+static volatile u32 lat_cycles;
+static volatile int lat_done;
+
+static void
+latency_handler ( void )
+{
+	lat_cycles = dwt_read () - lat_start;
+	lat_done = 1;
+}
+
+/* Buckets are powers of 2, starting under 16 cycles */
+static int
+lat_bucket ( u32 cycles )
+{
+	int b = 0;
+
+	cycles >>= 4;
+	while ( cycles && b < LAT_BUCKETS-1 ) {
+	    cycles >>= 1;
+	    b++;
+	}
+	return b;
+}
+
+void
+latency_test ( int pri, int count )
+{
+	int hist[LAT_BUCKETS];
+	u32 min = ~0;
+	u32 max = 0;
+	u32 sum = 0;
+	u32 t;
+	int i;
+
+	if ( count <= 0 )
+	    return;
+
+	if ( irq_attach ( LAT_IRQ, latency_handler ) < 0 ) {
+	    printf ( "Latency test needs the vector table in SRAM\n" );
+	    return;
+	}
+
+	for ( i=0; i<LAT_BUCKETS; i++ )
+	    hist[i] = 0;
+
+	nvic_priority ( LAT_IRQ, pri );
+	nvic_enable ( LAT_IRQ );
+
+	for ( i=0; i<count; i++ ) {
+	    lat_done = 0;
+	    lat_start = dwt_read ();
+	    nvic_set_pending ( LAT_IRQ );
+	    while ( ! lat_done )
+		;
+
+	    t = lat_cycles;
+	    sum += t;
+	    if ( t < min )
+		min = t;
+	    if ( t > max )
+		max = t;
+	    hist[lat_bucket(t)]++;
+
+	    /* an odd step so we don't keep in time with anything */
+	    if ( kern_can_block () )
+		thread_sleep ( 1 );
+	    else
+		delay_us ( 997 );
+	}
+
+	nvic_disable ( LAT_IRQ );
+	irq_attach ( LAT_IRQ, 0 );
+
+	printf ( "IRQ latency at priority %d, %d tries: min %d, avg %d, max %d cycles\n",
+	    pri, count, min, sum / count, max );
+	for ( i=0; i<LAT_BUCKETS; i++ ) {
+	    if ( ! hist[i] )
+		continue;
+	    if ( i == LAT_BUCKETS-1 )
+		printf ( "  %5d and up: %d\n", 16 << (i-1), hist[i] );
+	    else
+		printf ( "  under %5d: %d\n", 16 << i, hist[i] );
+	}
+}
+
+/* THE END */
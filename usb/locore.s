@@ -6,6 +6,7 @@
 # The Cortex M3 is a thumb only processor
 .cpu cortex-m3
 .thumb
+.syntax unified
 
 @ First the "standard" 16 entries for a cortex-m3
 .word   0x20005000   /* stack top address */
@@ -22,7 +23,7 @@
 .word   bogus        /* 11 SV call */
 .word   bogus        /* 12   Debug reserved */
 .word   bogus        /* 13   RESERVED */
-.word   bogus        /* 14 PendSV */
+.word   pendsv_handler        /* 14 PendSV */
 .word   systick_handler        /* 15 SysTick */
 
 @ and now 68 IRQ vectors
@@ -37,7 +38,7 @@
 .word	bogus		/* IRQ  8 */
 .word	bogus		/* IRQ  9 */
 .word	bogus		/* IRQ 10 */
-.word	bogus		/* IRQ 11 */
+.word	dma1_ch1_handler	/* IRQ 11 -- DMA 1, channel 1 */
 .word	bogus		/* IRQ 12 */
 .word	bogus		/* IRQ 13 */
 .word	bogus		/* IRQ 14 */
@@ -56,7 +57,7 @@
 .word	bogus		/* IRQ 27 -- Timer 1 cc */
 .word	tim2_handler	/* IRQ 28 -- Timer 2 */
 .word	bogus		/* IRQ 29 -- Timer 3 */
-.word	bogus		/* IRQ 30 -- Timer 4 */
+.word	tim4_handler	/* IRQ 30 -- Timer 4 */
 .word	bogus		/* IRQ 31 */
 .word	bogus		/* IRQ 32 */
 .word	bogus		/* IRQ 33 */
@@ -104,9 +105,140 @@
 .thumb_func
 bogus:   b .
 
+@ Start the cycle counter before anything else, so
+@ boot.c can time the boot from (very nearly) reset.
+@ This is dwt_init() from nvic.c, we have no stack yet
+@ to speak of, but this is what happens first.
 .thumb_func
 _reset:
+    ldr     r0, =0xe000edfc     @ DEMCR
+    ldr     r1, [r0]
+    orr     r1, r1, #0x01000000 @ TRCENA
+    str     r1, [r0]
+    ldr     r0, =0xe0001000     @ DWT ctrl
+    movs    r1, #0
+    str     r1, [r0, #4]        @ cyccnt
+    ldr     r1, [r0]
+    orr     r1, r1, #1          @ CYCCNTENA
+    str     r1, [r0]
     bl startup
     b .
 
+@ For mem_init, 16 bytes at a time with ldm/stm,
+@ then what is left a word at a time.
+@ Both ends are word aligned (see dragoon.lds).
+@   mem_zero ( start, end )
+.globl mem_zero
+.thumb_func
+mem_zero:
+    push    {r4, r5}
+    movs    r2, #0
+    movs    r3, #0
+    movs    r4, #0
+    movs    r5, #0
+1:
+    sub     r12, r1, r0
+    cmp     r12, #16
+    blo     2f
+    stmia   r0!, {r2-r5}
+    b       1b
+2:
+    cmp     r0, r1
+    bhs     3f
+    str     r2, [r0], #4
+    b       2b
+3:
+    pop     {r4, r5}
+    bx      lr
+
+@   mem_copy ( dst, end, src )
+.globl mem_copy
+.thumb_func
+mem_copy:
+    push    {r4-r7}
+1:
+    sub     r12, r1, r0
+    cmp     r12, #16
+    blo     2f
+    ldmia   r2!, {r4-r7}
+    stmia   r0!, {r4-r7}
+    b       1b
+2:
+    cmp     r0, r1
+    bhs     3f
+    ldr     r3, [r2], #4
+    str     r3, [r0], #4
+    b       2b
+3:
+    pop     {r4-r7}
+    bx      lr
+
+@ PendSV runs any events (event.c) and then switches
+@ threads if kernel.c has picked a new one.
+@ The hardware has pushed r0-r3, r12, lr, pc and xpsr
+@ on the thread stack (PSP), we push r4-r11 below them.
+@ The stack pointer is the first thing in struct thread.
+@ Interrupts stay off from reading kern_next until the
+@ switch is done, or a sem_post from a handler could change
+@ it under us and the thread it woke would wait a tick.
+.globl pendsv_handler
+.thumb_func
+pendsv_handler:
+    push    {r4, lr}
+    bl      event_dispatch
+    pop     {r4, lr}
+
+    cpsid   i
+    ldr     r1, =kern_cur
+    ldr     r2, [r1]
+    ldr     r3, =kern_next
+    ldr     r3, [r3]
+    cmp     r2, r3
+    beq     1f
+
+    mrs     r0, psp
+    stmdb   r0!, {r4-r11}
+    str     r0, [r2]
+    str     r3, [r1]
+    ldr     r0, [r3]
+    ldmia   r0!, {r4-r11}
+    msr     psp, r0
+1:
+    cpsie   i
+    bx      lr
+
+@ Timer 4 is the profiler (prof.c), which wants the pc we
+@ interrupted.  Bit 2 of EXC_RETURN (in lr) says which stack
+@ the hardware pushed the frame on, pc is 6 words in.
+@ prof_sample returns straight from the exception.
+.globl tim4_handler
+.thumb_func
+tim4_handler:
+    mrs     r0, msp
+    tst     lr, #4
+    beq     1f
+    mrs     r0, psp
+1:
+    ldr     r0, [r0, #24]
+    b       prof_sample
+
+@ Called from kern_start with interrupts off and
+@ the top of a stack to use in r0.  Move thread mode
+@ onto PSP, raise PendSV and let it take over.
+.globl kern_launch
+.thumb_func
+kern_launch:
+    msr     psp, r0
+    movs    r0, #2
+    msr     control, r0
+    isb
+    ldr     r0, =0xe000ed04     @ ICSR
+    ldr     r1, =0x10000000     @ PENDSVSET
+    str     r1, [r0]
+    cpsie   i
+2:
+    b       2b
+
+.ltorg
+
 /* THE END */
@@ -75,6 +75,7 @@ delay_ms ( int ms )
 }
 #endif
 
+#ifdef notdef
 void
 delay_ms ( int ms )
 {
@@ -83,6 +84,20 @@ delay_ms ( int ms )
         while ( count-- )
             ;
 }
+#endif
+
+/* All of the above is history, clock.c counts processor
+ * cycles and does not care what the compiler does.
+ */
+void
+delay_ms ( int ms )
+{
+	/* A thread has better things to do than spin */
+	if ( kern_can_block () )
+	    thread_sleep ( ms );
+	else
+	    delay_us ( ms * 1000 );
+}
 
 void
 delay_sec ( int sec )
@@ -128,6 +143,7 @@ led_show ( void )
 	led_off ();
 }
 
+#ifdef notdef
 static void
 led_demo ( void )
 {
@@ -152,41 +168,155 @@ led_demo ( void )
 	    // big_delay ();
 	}
 }
+#endif
+
+/* The same pattern as led_demo, but from the software
+ * timers (wheel.c), so it keeps going whatever else
+ * we are busy with.  Each call sets up the next.
+ */
+static int led_step;
+
+static void
+led_tick ( void *arg )
+{
+	if ( led_step & 1 )
+	    led_off ();
+	else
+	    led_on ();
+
+	if ( ++led_step < NBLINKS * 2 )
+	    timer_after ( 50, led_tick, 0 );
+	else {
+	    led_step = 0;
+	    timer_after ( 1500, led_tick, 0 );
+	}
+}
 
 extern volatile unsigned long systick_count;
 
+/* Copy the vector table to SRAM so drivers can
+ * install handlers with irq_attach() (see nvic.c).
+ */
+#define RAM_VECTORS
+
+/* Sample the pc all the time, 'p' on the console
+ * dumps the profile (see prof.c and prof.rb).
+ */
+#define USE_PROF
+
+/* Run the USB tests in a thread under kernel.c
+ * rather than straight from main.
+ */
+#define USE_KERNEL
+
+#ifdef USE_KERNEL
+#define CONSOLE_STACK	512
+#define MONITOR_STACK	256
+
+static u32 console_stack[CONSOLE_STACK] __attribute__ ((aligned(8)));
+static u32 monitor_stack[MONITOR_STACK] __attribute__ ((aligned(8)));
+
+static void
+console_thread ( void *arg )
+{
+	usb_debug ();
+}
+
+/* Measure the kernel, interrupt latency (at the top, and
+ * below everything else) and what SRAM code buys us,
+ * then report now and then.
+ */
+static void
+monitor_thread ( void *arg )
+{
+	boot_show ();
+	kern_bench ( 4 );
+	ramfunc_bench ();
+	latency_test ( PRI_LATENCY, 1000 );
+	latency_test ( PRI_TIMER + 1, 1000 );
+
+	for ( ;; ) {
+	    kern_show ();
+	    thread_sleep ( 60 * 1000 );
+	}
+}
+#endif
+
 void
 startup ( void )
 {
 	int t;
 	unsigned long systick_next;
 
+	/* Get the crystal and PLL going, they can
+	 * start up while we set up ram.
+	 */
+	rcc_start ();
+
 	mem_init ();
+	boot_stamp ( B_MEM );
+#ifdef RAM_VECTORS
+	vectors_init ();
+#endif
 
 	rcc_init ();
+	boot_stamp ( B_CLOCK );
+
+	/* The cycle counter for interrupt statistics and delays
+	 * was started in locore.s (dwt_init is the same thing),
+	 * so it counts from reset.
+	 */
+	clock_init ();
 
 	serial_init ();
 	// serial_basic ();
 
 	printf ( " -- Booting ------------------------------\n" );
 	printf ( "STM32 usb_baboon demo starting\n" );
+	boot_stamp ( B_LOG );
 
-	led_init ();
+	/* This gives us a 1 us interrupt rate !  */
+	// systick_init_int ( 72 );
+	/* This gives a 1 ms rate */
+	systick_init_int ( 72 * 1000 );
+
+	event_init ();
 
+	/* USB first, the host takes a while to get around to us
+	 * and the rest can get done meanwhile.
+	 */
 	// Just USB stuff at this time
 	gpio_init ();
+	usb_init ();
+	boot_stamp ( B_USB );
+
+	/* The iso stream needs it before the host gets to
+	 * SET_INTERFACE, which is a long way off yet.
+	 */
+	adc_init ();
 
+	led_init ();
 	led_on ();
 	// led_off ();
 
-	/* This gives us a 1 us interrupt rate !  */
-	// systick_init_int ( 72 );
-	/* This gives a 1 ms rate */
-	systick_init_int ( 72 * 1000 );
+	wheel_init ();
+#ifdef USE_PROF
+	prof_init ();
+#endif
+	led_tick ( 0 );
 
 	printf ( "STM32 usb_baboon demo\n" );
 
-	usb_init ();
+#ifdef USE_KERNEL
+	kern_init ();
+	thread_create ( "console", console_thread, 0, 2, console_stack, CONSOLE_STACK );
+	thread_create ( "monitor", monitor_thread, 0, 4, monitor_stack, MONITOR_STACK );
+	boot_stamp ( B_READY );
+	kern_start ();
+	/* NOTREACHED */
+#endif
+
+	boot_stamp ( B_READY );
 
 	/* Run various tests.
 	 * - usually does not return.
@@ -196,12 +326,12 @@ startup ( void )
 	printf ( "Delay 10 seconds\n" );
 	delay_sec ( 10 );
 
-	serial_puts ( "Main is blinking\n" );
-	led_demo ();
-
-	serial_puts ( "Main is spinning\n" );
+	/* Everything from here on happens in interrupts
+	 * and events (event.c), so we can sleep.
+	 */
+	serial_puts ( "Main is idle\n" );
 	for ( ;; )
-	    ;
+	    cpu_idle ();
 }
 
 /* Could blink a tell-tale pattern */
@@ -14,10 +14,21 @@
  *  0xE000EFD0 - ID space
  */
 
+/* Each group of registers has room for 8 words (240 irq),
+ * we have 68 interrupts so only use the first 3.
+ */
 struct nvic {
-	volatile unsigned long iser[3];	/* 00 */
-	volatile unsigned long icer[3];	/* 0c */
-	/* ... */
+	volatile unsigned long iser[8];	/* 000 - set enable */
+	    long	_pad0[24];
+	volatile unsigned long icer[8];	/* 080 - clear enable */
+	    long	_pad1[24];
+	volatile unsigned long ispr[8];	/* 100 - set pending */
+	    long	_pad2[24];
+	volatile unsigned long icpr[8];	/* 180 - clear pending */
+	    long	_pad3[24];
+	volatile unsigned long iabr[8];	/* 200 - active */
+	    long	_pad4[56];
+	volatile unsigned char ipr[240];	/* 300 - priority */
 };
 
 #define NVIC_BASE	((struct nvic *) 0xe000e100)
@@ -35,6 +46,125 @@ nvic_enable ( int irq )
 	np->iser[irq/32] = 1 << (irq%32);
 }
 
+void
+nvic_disable ( int irq )
+{
+	struct nvic *np = NVIC_BASE;
+
+	if ( irq >= NUM_IRQ )
+	    return;
+
+	np->icer[irq/32] = 1 << (irq%32);
+}
+
+/* Make an interrupt happen, as if the hardware asked */
+void
+nvic_set_pending ( int irq )
+{
+	struct nvic *np = NVIC_BASE;
+
+	if ( irq >= NUM_IRQ )
+	    return;
+
+	np->ispr[irq/32] = 1 << (irq%32);
+}
+
+void
+nvic_clear_pending ( int irq )
+{
+	struct nvic *np = NVIC_BASE;
+
+	if ( irq >= NUM_IRQ )
+	    return;
+
+	np->icpr[irq/32] = 1 << (irq%32);
+}
+
+int
+nvic_pending ( int irq )
+{
+	struct nvic *np = NVIC_BASE;
+
+	if ( irq >= NUM_IRQ )
+	    return 0;
+
+	return (np->ispr[irq/32] >> (irq%32)) & 1;
+}
+
+/* Running, or preempted by something more important */
+int
+nvic_active ( int irq )
+{
+	struct nvic *np = NVIC_BASE;
+
+	if ( irq >= NUM_IRQ )
+	    return 0;
+
+	return (np->iabr[irq/32] >> (irq%32)) & 1;
+}
+
+/* The F103 implements the top 4 bits of each 8 bit
+ * priority field.  0 is the highest priority.
+ * Everything comes out of reset at 0, so nothing
+ * preempts anything else until we change that.
+ * The PRI_ values in protos.h are the plan.
+ *
+ * PRIGROUP in AIRCR splits those 4 bits into a preempt
+ * priority (which decides who can interrupt whom) and a
+ * subpriority (which only decides who goes first when
+ * both are pending).  Out of reset PRIGROUP is 0, and with
+ * only 4 bits implemented that makes them all preempt priority,
+ * which is the way we use it.  nvic_grouping() takes the
+ * number of preempt bits.
+ */
+static int nvic_pre_bits = 4;
+
+void
+nvic_priority ( int irq, int pri )
+{
+	struct nvic *np = NVIC_BASE;
+
+	if ( irq >= NUM_IRQ )
+	    return;
+
+	np->ipr[irq] = pri << 4;
+}
+
+void
+nvic_priority_sub ( int irq, int pre, int sub )
+{
+	int sub_bits = 4 - nvic_pre_bits;
+
+	nvic_priority ( irq, pre << sub_bits | (sub & ((1<<sub_bits)-1)) );
+}
+
+int
+nvic_get_priority ( int irq )
+{
+	struct nvic *np = NVIC_BASE;
+
+	if ( irq >= NUM_IRQ )
+	    return 0;
+
+	return np->ipr[irq] >> 4;
+}
+
+/* -------------------------------------- */
+
+/* Priorities for the system exceptions (4 to 15),
+ * one byte each starting at SHPR1.
+ */
+#define SCB_SHPR	((volatile unsigned char *) 0xe000ed18)
+
+void
+nvic_sys_priority ( int exc, int pri )
+{
+	if ( exc < 4 || exc > 15 )
+	    return;
+
+	SCB_SHPR[exc-4] = pri << 4;
+}
+
 /* -------------------------------------- */
 
 struct scb {
@@ -56,10 +186,105 @@ struct scb {
 
 #define SCB_BASE	((struct scb *) 0xe000ed00)
 
+/* ICSR */
+#define ICSR_PENDSVSET	0x10000000
+
+/* PendSV runs once nothing more important is going on */
+void
+pendsv_raise ( void )
+{
+	struct scb *sp = SCB_BASE;
+
+	sp->icsr = ICSR_PENDSVSET;
+}
+
+/* Sleep until an interrupt shows up */
+void
+cpu_idle ( void )
+{
+	__asm volatile ( "wfi" );
+}
+
+/* The vector table can live in SRAM.
+ * The one in locore.s is in flash, which is where the
+ * processor looks at reset (VTOR is 0, aliased to flash).
+ * vectors_init() copies it to SRAM and points VTOR there,
+ * after which irq_attach() can plug a handler into any slot,
+ * so a driver can bring its own handler without anyone
+ * editing locore.s.  As a bonus the vector fetch on each
+ * interrupt no longer waits on the flash (2 wait states
+ * at 72 Mhz, see rcc.c).
+ *
+ * VTOR wants the table aligned to its size rounded up to
+ * a power of 2, 84 words is 336 bytes so 512.
+ * Call this before any interrupts get enabled.
+ */
+#define NUM_VEC		(16 + NUM_IRQ)
+
+static unsigned long ram_vectors[NUM_VEC] __attribute__ ((aligned(512)));
+static unsigned long *flash_vectors;
+
+void
+vectors_init ( void )
+{
+	struct scb *sp = SCB_BASE;
+	int i;
+
+	flash_vectors = (unsigned long *) sp->vtor;
+	for ( i=0; i<NUM_VEC; i++ )
+	    ram_vectors[i] = flash_vectors[i];
+
+	__asm volatile ( "dsb" ::: "memory" );
+	sp->vtor = (unsigned long) ram_vectors;
+	__asm volatile ( "dsb\n\tisb" ::: "memory" );
+}
+
+/* Install fn as the handler for irq, or put back the
+ * one from locore.s if fn is 0.
+ * Returns -1 if the table is still in flash.
+ */
+int
+irq_attach ( int irq, void (*fn) ( void ) )
+{
+	if ( ! flash_vectors )
+	    return -1;
+	if ( irq < 0 || irq >= NUM_IRQ )
+	    return -1;
+
+	if ( fn )
+	    ram_vectors[16+irq] = (unsigned long) fn;
+	else
+	    ram_vectors[16+irq] = flash_vectors[16+irq];
+	__asm volatile ( "dsb" ::: "memory" );
+
+	return 0;
+}
+
 /* AIRCR  */
 #define AIRCR_RESET         0x05FA0000
 #define AIRCR_RESET_REQ     (AIRCR_RESET | 0x04);
 
+#define AIRCR_VECTKEY	0x05FA0000
+#define AIRCR_PRIGROUP	0x700
+
+/* pre_bits of the 4 are preempt priority, the rest sub.
+ * PRIGROUP counts the sub bits from bit 0 of the 8 bit
+ * field, and we only have the top 4.
+ */
+void
+nvic_grouping ( int pre_bits )
+{
+	struct scb *sp = SCB_BASE;
+	int val;
+
+	if ( pre_bits < 0 || pre_bits > 4 )
+	    return;
+
+	val = sp->aircr & ~(0xffff0000 | AIRCR_PRIGROUP);
+	sp->aircr = AIRCR_VECTKEY | val | (7 - pre_bits) << 8;
+	nvic_pre_bits = pre_bits;
+}
+
 void
 hard_reset ( void )
 {
@@ -118,6 +343,12 @@ struct systick {
 /* This can be whatever you please */
 #define SYSTICK_RELOAD	100
 
+/* The kernel and clock.c hang off this, so it must
+ * not be above PRI_KERNEL (see protos.h).
+ */
+#define SYSTICK_EXC	15
+#define SYSTICK_PRI	4	/* PRI_TIMER */
+
 #ifdef SYSTICK_WAVEFORM
 int ss = 0;
 
@@ -148,6 +379,8 @@ systick_handler ( void )
 	systick_toggle ();
 #endif
 	++systick_count;
+	clock_tick ();
+	kern_tick ();
 }
 
 void
@@ -170,6 +403,7 @@ systick_init_int ( int val )
 	systick_count = 0;
 
 	systick_init ( val );
+	nvic_sys_priority ( SYSTICK_EXC, SYSTICK_PRI );
 	sp->csr = TICK_SYSCLK | TICK_ENABLE | TICK_INTPEND;
 
 #ifdef SYSTICK_WAVEFORM
@@ -186,4 +420,41 @@ systick_wait ( void )
 	    ;
 }
 
+/* -------------------------------------- */
+
+/* The DWT (data watchpoint and trace) unit has a cycle counter.
+ * It counts processor clocks (72 Mhz) and wraps after
+ * about a minute, which is fine for timing short things.
+ * It must be enabled via TRCENA in the debug monitor
+ * control register before it will count.
+ */
+struct dwt {
+	volatile unsigned long ctrl;	/* 00 */
+	volatile unsigned long cyccnt;	/* 04 */
+};
+
+#define DWT_BASE	((struct dwt *) 0xe0001000)
+#define DEMCR		((volatile unsigned long *) 0xe000edfc)
+
+#define DEMCR_TRCENA	0x01000000
+#define DWT_CYCCNTENA	0x1
+
+void
+dwt_init ( void )
+{
+	struct dwt *dp = DWT_BASE;
+
+	*DEMCR |= DEMCR_TRCENA;
+	dp->cyccnt = 0;
+	dp->ctrl |= DWT_CYCCNTENA;
+}
+
+unsigned long
+dwt_read ( void )
+{
+	struct dwt *dp = DWT_BASE;
+
+	return dp->cyccnt;
+}
+
 /* THE END */
@@ -0,0 +1,137 @@
+#!/bin/ruby
+
+# peek.rb
+# Tom Trebisky  12-8-2023
+#
+# Host side of the memory inspector in usb_peek.c
+#
+# This finds symbols in dragoon.elf (using nm), then reads
+# or writes them via vendor control requests on endpoint 0.
+# The target keeps running the whole time.
+#
+#  ./peek.rb usb_state lp_count        -- show values once
+#  ./peek.rb -w 1000 usb_state lp_count -- watch at 1000 Hz
+#  ./peek.rb -s run_test8=1             -- poke a value
+#  ./peek.rb 0x40005c44                 -- addresses work too
+#
+# Everything is read as 32 bit words.
+# This uses the libusb gem (gem install libusb).
+# You may need to run it as root or set up a udev rule.
+# The cp210x driver can stay attached, control requests
+# on endpoint 0 don't care.
+
+require 'libusb'
+
+$vid = 0x10c4
+$pid = 0xea60
+$elf = "dragoon.elf"
+$nm = "arm-none-eabi-nm"
+
+PEEK_READ = 0xd0
+PEEK_WRITE = 0xd1
+PEEK_WATCH = 0xd2
+PEEK_WREAD = 0xd3
+
+# nm gives us lines like:
+#  20000abc b lp_count
+def load_syms
+    syms = {}
+    `#{$nm} #{$elf}`.each_line { |l|
+	w = l.split
+	next unless w.size == 3
+	syms[w[2]] = w[0].hex
+    }
+    syms
+end
+
+class Peek
+    def initialize
+	@usb = LIBUSB::Context.new
+	@dev = @usb.devices( idVendor: $vid, idProduct: $pid ).first
+	if ! @dev
+	    print "Cannot find device %04x:%04x\n" % [ $vid, $pid ]
+	    exit
+	end
+	@h = @dev.open
+    end
+    def read ( addr, count )
+	@h.control_transfer( bmRequestType: 0xc0, bRequest: PEEK_READ,
+	    wValue: addr & 0xffff, wIndex: addr >> 16, dataIn: count )
+    end
+    def write ( addr, data )
+	@h.control_transfer( bmRequestType: 0x40, bRequest: PEEK_WRITE,
+	    wValue: addr & 0xffff, wIndex: addr >> 16, dataOut: data )
+    end
+    def watch ( addrs )
+	@h.control_transfer( bmRequestType: 0x40, bRequest: PEEK_WATCH,
+	    wValue: addrs.size, wIndex: 0, dataOut: addrs.pack("V*") )
+    end
+    def wread ( n )
+	@h.control_transfer( bmRequestType: 0xc0, bRequest: PEEK_WREAD,
+	    wValue: 0, wIndex: 0, dataIn: 4 * n ).unpack("V*")
+    end
+end
+
+def lookup ( syms, name )
+    return name.hex if name =~ /^0x/
+    addr = syms[name]
+    if ! addr
+	print "No such symbol: #{name}\n"
+	exit
+    end
+    addr
+end
+
+if ARGV.size < 1
+    puts "usage: peek [-w rate] [-s sym=val] sym ..."
+    exit
+end
+
+syms = load_syms
+p = Peek.new
+rate = nil
+
+if ARGV[0] == "-w"
+    ARGV.shift
+    rate = ARGV.shift.to_f
+end
+
+if ARGV[0] == "-s"
+    ARGV.shift
+    ARGV.each { |a|
+	name, val = a.split "="
+	addr = lookup syms, name
+	p.write addr, [ Integer(val) ].pack("V")
+	print "%s (%08x) = %s\n" % [ name, addr, val ]
+    }
+    exit
+end
+
+names = ARGV
+addrs = names.map { |n| lookup syms, n }
+
+if ! rate
+    names.each_index { |i|
+	v = p.read( addrs[i], 4 ).unpack("V")[0]
+	if ! v
+	    print "%s (%08x) refused\n" % [ names[i], addrs[i] ]
+	    next
+	end
+	print "%s (%08x) = %08x %d\n" % [ names[i], addrs[i], v, v ]
+    }
+    exit
+end
+
+# Watch mode, the target reads them all in one request
+p.watch addrs
+puts names.join " "
+t0 = Time.now
+loop {
+    vals = p.wread addrs.size
+    t = Time.now - t0
+    print "%.4f " % t
+    puts vals.map { |v| "%d" % v }.join " "
+    sleep 1.0 / rate
+}
+
+# THE END
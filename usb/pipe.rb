@@ -0,0 +1,68 @@
+#!/bin/ruby
+
+# pipe.rb
+# Tom Trebisky  12-12-2023
+#
+# Host side of the vendor bulk pipe (interface 2, endpoint 3).
+#
+#  ./pipe.rb > file      -- copy whatever the target sends to stdout
+#  ./pipe.rb -l [kb]     -- loopback test (run test11 on the target)
+#
+# The cp210x driver grabs interface 2 along with the console,
+# so we have libusb detach it while we have the interface.
+# The console on interface 0 is left alone.
+# This uses the libusb gem (gem install libusb).
+
+require 'libusb'
+
+$vid = 0x10c4
+$pid = 0xea60
+
+PIPE_INTERFACE = 2
+PIPE_IN = 0x83
+PIPE_OUT = 0x03
+
+usb = LIBUSB::Context.new
+dev = usb.devices( idVendor: $vid, idProduct: $pid ).first
+if ! dev
+    print "Cannot find device %04x:%04x\n" % [ $vid, $pid ]
+    exit
+end
+
+h = dev.open
+h.auto_detach_kernel_driver = true
+h.claim_interface PIPE_INTERFACE
+
+# Send kb kilobytes and read them back.
+def loopback ( h, kb )
+    data = (0...1024).map { |i| (i & 0xff).chr }.join
+    got = 0
+    t0 = Time.now
+    kb.times {
+	h.bulk_transfer( endpoint: PIPE_OUT, dataOut: data )
+	while got < data.size
+	    got += h.bulk_transfer( endpoint: PIPE_IN, dataIn: 1024 ).size
+	end
+	got -= data.size
+    }
+    t = Time.now - t0
+    print "%d KB in %.3f seconds, %.1f KB/s\n" % [ kb, t, kb / t ]
+end
+
+if ARGV[0] == "-l"
+    kb = ARGV[1] ? ARGV[1].to_i : 100
+    loopback h, kb
+    h.release_interface PIPE_INTERFACE
+    exit
+end
+
+$stdout.binmode
+loop {
+    begin
+	$stdout.write h.bulk_transfer( endpoint: PIPE_IN, dataIn: 4096, timeout: 0 )
+    rescue LIBUSB::ERROR_OVERFLOW
+	$stderr.puts "overflow"
+    end
+}
+
+# THE END
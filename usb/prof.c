@@ -0,0 +1,185 @@
+/* prof.c
+ * (c) Tom Trebisky  12-29-2023
+ *
+ * A sampling profiler, to see where the cycles go
+ * without sprinkling printf about.
+ *
+ * Timer 4 interrupts PROF_HZ times a second at PRI_PROF,
+ * which nothing else is above, not even an irq_mask().
+ * tim4_handler in locore.s digs the pc out of the frame the
+ * hardware pushed, whichever stack it is on, and hands it
+ * to prof_sample().  So every thread, handler, event and
+ * the idle loop gets sampled in proportion to its time.
+ * 997 Hz keeps us from marching in step with the 1 ms things.
+ *
+ * Samples are counted in a histogram of small bins, one
+ * region for the code in flash and one for the RAMFUNC code
+ * in SRAM (protos.h).  Bins start at 8 bytes and double until
+ * both regions fit in PROF_BINS.  A count stops at 0xffff, and
+ * a pc that is in neither region (there should be none)
+ * counts in prof_other.
+ *
+ * Type 'p' on the console for a dump, which also clears.
+ * prof.rb turns the dump into a flat profile by function.
+ */
+
+#include "protos.h"
+
+struct timer {
+	vu32	cr1;	/* 00 */
+	vu32	cr2;	/* 04 */
+	vu32	smcr;	/* 08 */
+	vu32	dier;	/* 0c */
+	vu32	sr;	/* 10 */
+	vu32	egr;	/* 14 */
+	vu32	ccmr[2];	/* 18 */
+	vu32	ccer;	/* 20 */
+	vu32	cnt;	/* 24 */
+	vu32	psc;	/* 28 */
+	vu32	arr;	/* 2c */
+};
+
+#define TIMER4_BASE	(struct timer *) 0x40000800
+#define TIMER4_IRQ	30
+
+#define CR1_ENABLE	1
+#define EGR_UG		1
+#define TIM_UIF		1
+
+#define TIMER_CLOCK	72000000	/* see timer.c */
+#define PROF_HZ		997
+
+#define PROF_BINS	1024
+
+extern char __text_start[];
+extern char __text_end[];
+extern char __ramfunc_start[];
+extern char __ramfunc_end[];
+
+struct prof_region {
+	u32 base;
+	u32 limit;
+	u16 *bins;
+};
+
+static u16 prof_bins[PROF_BINS];
+static struct prof_region prof_flash;
+static struct prof_region prof_ram;
+static int prof_shift;
+
+static volatile u32 prof_samples;
+static volatile u32 prof_other;
+
+static int
+prof_nbins ( struct prof_region *rp )
+{
+	return (rp->limit - rp->base + (1<<prof_shift) - 1) >> prof_shift;
+}
+
+static int
+prof_bin ( struct prof_region *rp, u32 pc )
+{
+	u16 *bp;
+
+	if ( pc < rp->base || pc >= rp->limit )
+	    return 0;
+
+	bp = &rp->bins[(pc - rp->base) >> prof_shift];
+	if ( *bp != 0xffff )
+	    (*bp)++;
+	return 1;
+}
+
+/* From tim4_handler, with the pc it interrupted */
+void
+prof_sample ( u32 pc )
+{
+	struct timer *tp = TIMER4_BASE;
+
+	tp->sr = ~TIM_UIF;
+
+	prof_samples++;
+	if ( prof_bin ( &prof_flash, pc ) )
+	    return;
+	if ( prof_bin ( &prof_ram, pc ) )
+	    return;
+	prof_other++;
+}
+
+static void
+prof_clear ( void )
+{
+	int i;
+
+	for ( i=0; i<PROF_BINS; i++ )
+	    prof_bins[i] = 0;
+	prof_samples = 0;
+	prof_other = 0;
+}
+
+static void
+prof_dump_region ( struct prof_region *rp )
+{
+	int n = prof_nbins ( rp );
+	int i;
+
+	for ( i=0; i<n; i++ )
+	    if ( rp->bins[i] )
+		printf ( "P %08x %d\n", rp->base + (i << prof_shift), rp->bins[i] );
+}
+
+/* The sampler stops while we print, so the dump
+ * (which is slow) does not show up in the next one.
+ */
+void
+prof_dump ( void *arg )
+{
+	struct timer *tp = TIMER4_BASE;
+
+	tp->cr1 = 0;
+
+	printf ( "Profile: %d Hz, %d samples, %d other, shift %d\n",
+	    PROF_HZ, prof_samples, prof_other, prof_shift );
+	prof_dump_region ( &prof_flash );
+	prof_dump_region ( &prof_ram );
+	printf ( "Profile end\n" );
+
+	prof_clear ();
+	tp->cr1 = CR1_ENABLE;
+}
+
+void
+prof_init ( void )
+{
+	struct timer *tp = TIMER4_BASE;
+
+	prof_flash.base = (u32) __text_start;
+	prof_flash.limit = (u32) __text_end;
+	prof_ram.base = (u32) __ramfunc_start;
+	prof_ram.limit = (u32) __ramfunc_end;
+
+	prof_shift = 3;
+	while ( prof_nbins ( &prof_flash ) + prof_nbins ( &prof_ram ) > PROF_BINS )
+	    prof_shift++;
+
+	prof_flash.bins = prof_bins;
+	prof_ram.bins = prof_bins + prof_nbins ( &prof_flash );
+	prof_clear ();
+
+	/* 1 Mhz into the counter */
+	tp->cr1 = 0;
+	tp->psc = TIMER_CLOCK / 1000000 - 1;
+	tp->arr = 1000000 / PROF_HZ - 1;
+	tp->cnt = 0;
+	tp->egr = EGR_UG;
+	tp->sr = 0;
+	tp->dier = TIM_UIF;
+
+	nvic_priority ( TIMER4_IRQ, PRI_PROF );
+	nvic_enable ( TIMER4_IRQ );
+	tp->cr1 = CR1_ENABLE;
+
+	printf ( "Profiler: %d Hz, %d byte bins\n", PROF_HZ, 1 << prof_shift );
+}
+
+/* THE END */
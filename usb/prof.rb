@@ -0,0 +1,114 @@
+#!/bin/ruby
+
+# prof.rb
+# Tom Trebisky  12-29-2023
+#
+# Host side of the sampling profiler in prof.c
+#
+# Type 'p' on the console, save the output (picocom --logfile
+# or whatever), then:
+#
+#  ./prof.rb console.log
+#
+# Each bin in the dump is charged to the function it starts in,
+# found with nm on dragoon.elf, and the object file that function
+# came from is looked up in dragoon.map (the .text lines).
+# A bin that straddles the end of one function and the start
+# of the next all goes to the first, which is why the bins are
+# kept small.  If the log has several dumps, they add up.
+
+$elf = "dragoon.elf"
+$map = "dragoon.map"
+$nm = "arm-none-eabi-nm"
+
+# nm -n gives us lines like this, sorted by address:
+#  08000abc T usb_lp_handler
+# RAMFUNC code is in .data, and shows up as d or D.
+def load_funcs
+    funcs = []
+    `#{$nm} -n #{$elf}`.each_line { |l|
+	w = l.split
+	next unless w.size == 3
+	next unless w[1] =~ /[tTwWdD]/
+	funcs << [ w[0].hex & ~1, w[2] ]
+    }
+    funcs
+end
+
+# The map has lines like:
+#  .text          0x08000134      0x4c0 main.o
+# or the name alone when it is long, with the rest on the next line.
+def load_objs
+    objs = []
+    return objs unless File.exist? $map
+    name = nil
+    File.open( $map ).each_line { |l|
+	if l =~ /^ \.(text|ramfunc)\S*\s*$/
+	    name = true
+	    next
+	end
+	if l =~ /^ \.(text|ramfunc)\S*\s+0x(\h+)\s+0x(\h+)\s+(\S+)/ ||
+	   ( name && l =~ /^()\s+0x(\h+)\s+0x(\h+)\s+(\S+)/ )
+	    objs << [ $2.hex, $3.hex, File.basename( $4 ) ]
+	end
+	name = nil
+    }
+    objs
+end
+
+# The last function at or before addr
+def find ( funcs, addr )
+    i = funcs.bsearch_index { |f| f[0] > addr }
+    i = funcs.size if ! i
+    return nil if i == 0
+    funcs[i-1]
+end
+
+def find_obj ( objs, addr )
+    o = objs.find { |o| addr >= o[0] && addr < o[0] + o[1] }
+    o ? o[2] : ""
+end
+
+if ARGV.size != 1
+    puts "usage: prof log_file"
+    exit
+end
+
+hz = 0
+total = 0
+other = 0
+bins = Hash.new 0
+
+File.open( ARGV[0] ).each_line { |l|
+    if l =~ /^Profile: (\d+) Hz, (\d+) samples, (\d+) other/
+	hz = $1.to_i
+	total += $2.to_i
+	other += $3.to_i
+    end
+    next unless l =~ /^P (\h+) (\d+)/
+    bins[$1.hex] += $2.to_i
+}
+
+if total == 0
+    puts "No profile dump in #{ARGV[0]}"
+    exit
+end
+
+funcs = load_funcs
+objs = load_objs
+
+counts = Hash.new 0
+bins.each { |addr, n|
+    f = find funcs, addr
+    counts[f ? f : [ addr, "0x%08x" % addr ]] += n
+}
+counts[[ 0, "(other)" ]] = other if other > 0
+
+print "%d samples, %.1f seconds at %d Hz\n\n" % [ total, total.to_f / hz, hz ]
+print "     %   samples  function                        file\n"
+counts.sort_by { |f, n| -n }.each { |f, n|
+    print "%6.2f  %8d  %-30s  %s\n" %
+	[ 100.0 * n / total, n, f[1], find_obj( objs, f[0] ) ]
+}
+
+# THE END
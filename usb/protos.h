@@ -9,6 +9,7 @@
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
+typedef unsigned long long u64;
 
 typedef volatile unsigned int vu32;
 
@@ -17,11 +18,151 @@ typedef volatile unsigned int vu32;
 static inline void enable_irq() { __asm volatile("cpsie i"); }
 static inline void disable_irq() { __asm volatile("cpsid i"); }
 
+/* Interrupt priorities, 0 is the most urgent and only the top
+ * 4 bits of the byte are there (nvic.c).  A handler can only be
+ * cut in on by something with a smaller number.
+ * 0 is kept for the latency test (latency.c) and the
+ * profiler (prof.c), which has to get in on top of everything.
+ * Anything that calls sem_post (or other kernel calls) must be
+ * at PRI_KERNEL or below (bigger numbers), the kernel masks at
+ * that level.  PendSV is always 15 (event.c).
+ */
+#define PRI_LATENCY	0
+#define PRI_PROF	0
+#define PRI_UART	1
+#define PRI_KERNEL	1
+#define PRI_USB_HP	2
+#define PRI_DMA		2
+#define PRI_USB_LP	3
+#define PRI_TIMER	4
+
+/* Critical sections that only keep out interrupts at pri and
+ * below, more urgent ones still get in.  BASEPRI_MAX only ever
+ * raises the mask, so these nest:
+ *
+ *   old = irq_mask ( PRI_TIMER );
+ *   ...
+ *   irq_unmask ( old );
+ */
+static inline u32
+irq_mask ( int pri )
+{
+	u32 old;
+
+	__asm volatile ( "mrs %0, basepri" : "=r" (old) );
+	__asm volatile ( "msr basepri_max, %0" : : "r" (pri << 4) : "memory" );
+	return old;
+}
+
+static inline void
+irq_unmask ( u32 old )
+{
+	__asm volatile ( "msr basepri, %0" : : "r" (old) : "memory" );
+}
+
 
 void panic ( char * );
 
+/* Put a function in SRAM rather than flash.  mem_init()
+ * copies it there along with .data (see dragoon.lds).
+ * Flash at 72 Mhz has 2 wait states, and the prefetch
+ * buffer loses on every branch, SRAM has none.
+ * A call between the two is too far for a BL, the linker
+ * puts in a veneer (a few cycles) to get across.
+ */
+#define RAMFUNC	__attribute__ ((section(".ramfunc"), noinline))
+
 int usb_setup ( char *, int );
 int usb_control ( char *, int );
 int usb_control_tx ( void );
+void pma_copy_in ( u32, char *, int );
+void pma_copy_out ( u32, char *, int );
+
+/* adc.c - samples per half buffer, one USB frame worth */
+#define ADC_HALF	32
+
+void adc_init ( void );
+void adc_stream_start ( int, int );
+void adc_stream_stop ( void );
+u16 *adc_stream_get ( void );
+
+/* nvic.c */
+void nvic_enable ( int );
+void nvic_disable ( int );
+void nvic_priority ( int, int );
+void nvic_set_pending ( int );
+int nvic_pending ( int );
+void vectors_init ( void );
+int irq_attach ( int, void (*) ( void ) );
+
+/* boot.c - milestones, in order */
+#define B_MEM		0
+#define B_CLOCK		1
+#define B_LOG		2
+#define B_USB		3
+#define B_READY		4
+#define B_CONFIG	5
+#define B_NUM		6
+
+void boot_stamp ( int );
+void boot_show ( void );
+
+/* clock.c - see there */
+u64 clock_cycles ( void );
+u64 clock_us ( void );
+void delay_cycles ( u32 );
+void delay_us ( u32 );
+u32 dwt_read ( void );
+
+/* event.c - priorities, 0 runs first */
+#define EV_NPRI		4
+#define EV_HIGH		0
+#define EV_LOW		3
+
+typedef void (*evfptr) ( void * );
+
+int event_post ( int, evfptr, void * );
+
+/* kernel.c */
+struct thread;
+
+struct sem {
+	int count;
+	struct thread *wait;
+};
+
+struct mq {
+	u32 *buf;
+	int size;
+	int head;
+	int tail;
+	struct sem items;
+	struct sem room;
+};
+
+int thread_create ( char *, void (*) ( void * ), void *, int, u32 *, int );
+void thread_sleep ( int );
+void thread_yield ( void );
+int kern_can_block ( void );
+void sem_init ( struct sem *, int );
+void sem_wait ( struct sem * );
+int sem_try ( struct sem * );
+void sem_post ( struct sem * );
+void mq_init ( struct mq *, u32 *, int );
+void mq_send ( struct mq *, u32 );
+int mq_post ( struct mq *, u32 );
+u32 mq_recv ( struct mq * );
+
+/* prof.c */
+void prof_init ( void );
+void prof_dump ( void * );
+
+/* wheel.c - software timers, the callback gets arg */
+typedef void (*tfptr) ( void * );
+
+int timer_after ( int, tfptr, void * );
+int timer_every ( int, tfptr, void * );
+void timer_cancel ( int );
+u32 wheel_now ( void );
 
 /* THE END */
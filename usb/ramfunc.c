@@ -0,0 +1,118 @@
+/* ramfunc.c
+ * (c) Tom Trebisky  12-28-2023
+ *
+ * Does running from SRAM pay?  Cycles per call for the
+ * RAMFUNC functions (see protos.h), run from their copy in
+ * SRAM and from the image in flash that mem_init() copied.
+ *
+ * The flash image is real code, just not at the address it
+ * was linked for.  That is fine for a leaf function, a BL is
+ * pc relative and so are its literals, but a BL out of it
+ * would go astray.  So only the leaf functions get timed here,
+ * not the interrupt handlers.
+ *
+ * Each function gets BENCH_CALLS calls in a row through a
+ * pointer, with everything but priority 0 masked.  The loop
+ * and the call are in both numbers.
+ */
+
+#include "kyulib.h"
+#include "protos.h"
+
+#define BENCH_CALLS	64
+
+/* The btable only uses 4 entries, 020 to 03f is free (see usb.c) */
+#define PMA_SCRATCH	0x020
+#define PMA_BYTES	32
+
+extern char __ramfunc_start[];
+extern char __ramfunc_end[];
+extern char __data_start[];
+extern char __data_load[];
+
+static struct cqueue bench_q;
+static char bench_qbuf[BENCH_CALLS];
+static char bench_buf[PMA_BYTES];
+
+/* Where a RAMFUNC came from in flash */
+static void *
+flash_image ( void *fn )
+{
+	u32 addr = (u32) fn;
+
+	if ( addr < (u32) __ramfunc_start || addr >= (u32) __ramfunc_end )
+	    return fn;
+
+	return (void *) (addr - (u32) __data_start + (u32) __data_load);
+}
+
+static void
+bench_cq ( char *where, void *add_fn, void *rem_fn )
+{
+	void (*add) ( struct cqueue *, int ) = add_fn;
+	int (*rem) ( struct cqueue * ) = rem_fn;
+	u32 t_add, t_rem;
+	u32 old;
+	int i;
+
+	(void) cq_init ( &bench_q, bench_qbuf, BENCH_CALLS );
+
+	old = irq_mask ( PRI_UART );
+
+	t_add = dwt_read ();
+	for ( i=0; i<BENCH_CALLS; i++ )
+	    (*add) ( &bench_q, i );
+	t_add = dwt_read () - t_add;
+
+	t_rem = dwt_read ();
+	for ( i=0; i<BENCH_CALLS; i++ )
+	    (void) (*rem) ( &bench_q );
+	t_rem = dwt_read () - t_rem;
+
+	irq_unmask ( old );
+
+	printf ( "  %s  cq_add %d  cq_remove %d\n", where,
+	    t_add / BENCH_CALLS, t_rem / BENCH_CALLS );
+}
+
+static void
+bench_pma ( char *where, void *in_fn, void *out_fn )
+{
+	void (*in) ( u32, char *, int ) = in_fn;
+	void (*out) ( u32, char *, int ) = out_fn;
+	u32 t_in, t_out;
+	u32 old;
+	int i;
+
+	old = irq_mask ( PRI_UART );
+
+	t_in = dwt_read ();
+	for ( i=0; i<BENCH_CALLS; i++ )
+	    (*in) ( PMA_SCRATCH, bench_buf, PMA_BYTES );
+	t_in = dwt_read () - t_in;
+
+	t_out = dwt_read ();
+	for ( i=0; i<BENCH_CALLS; i++ )
+	    (*out) ( PMA_SCRATCH, bench_buf, PMA_BYTES );
+	t_out = dwt_read () - t_out;
+
+	irq_unmask ( old );
+
+	printf ( "  %s  pma_copy_in %d  pma_copy_out %d  (%d bytes)\n", where,
+	    t_in / BENCH_CALLS, t_out / BENCH_CALLS, PMA_BYTES );
+}
+
+void
+ramfunc_bench ( void )
+{
+	printf ( "RAMFUNC: %d bytes of code in SRAM, cycles per call:\n",
+	    __ramfunc_end - __ramfunc_start );
+
+	bench_cq ( "flash", flash_image ( cq_add ), flash_image ( cq_remove ) );
+	bench_cq ( "sram ", cq_add, cq_remove );
+
+	bench_pma ( "flash", flash_image ( pma_copy_in ), flash_image ( pma_copy_out ) );
+	bench_pma ( "sram ", pma_copy_in, pma_copy_out );
+}
+
+/* THE END */
@@ -42,6 +42,9 @@ struct rcc {
 #define TIMER1_ENABLE	0x0800
 #define UART1_ENABLE	0x4000
 
+#define ADC1_ENABLE	0x200
+#define ADC2_ENABLE	0x400
+
 /* These are in the apb1e register */
 #define TIMER2_ENABLE	0x0001
 #define TIMER3_ENABLE	0x0002
@@ -80,6 +83,15 @@ struct rcc {
 #define APB2_DIV2	(4<<11)	/* 72 Mhz max */
 #define APB2_DIV4	(5<<11)	/* 72 Mhz max */
 
+/* The ADC clock must not exceed 14 Mhz.
+ * Since we set PCLK2 to 72 Mhz, we want to divide by 6
+ * to get 12 Mhz.
+ */
+#define ADC_DIV2	(0<<14)
+#define ADC_DIV4	(1<<14)
+#define ADC_DIV6	(2<<14)
+#define ADC_DIV8	(3<<14)
+
 /* Note that the HSI clock is always divided by 2 pre PLL */
 
 #define PLL_HSI		0x00000
@@ -121,6 +133,52 @@ get_pclk2 ( void )
 	return PCLK2;
 }
 
+#define HSI_HZ		8000000
+#define HSE_HZ		8000000		/* the crystal on our boards */
+
+/* The processor clock, worked out from what the
+ * cfg register says is going on right now.
+ * SWS says where sysclk comes from, then the
+ * AHB prescaler (HPRE) divides it down.
+ */
+int
+get_hclk ( void )
+{
+	struct rcc *rp = RCC_BASE;
+	int cfg = rp->cfg;
+	int clk;
+	int mul;
+	int hpre;
+
+	switch ( (cfg >> 2) & 3 ) {
+	    case SYS_HSE:
+		clk = HSE_HZ;
+		break;
+	    case SYS_PLL:
+		if ( cfg & PLL_HSE )
+		    clk = (cfg & PLL_XTPRE) ? HSE_HZ / 2 : HSE_HZ;
+		else
+		    clk = HSI_HZ / 2;
+		mul = ((cfg >> 18) & 0xf) + 2;
+		if ( mul > 16 )
+		    mul = 16;
+		clk *= mul;
+		break;
+	    default:
+		clk = HSI_HZ;
+		break;
+	}
+
+	/* 8 through 11 divide by 2 to 16, then 64 to 512 */
+	hpre = (cfg >> 4) & 0xf;
+	if ( hpre >= 12 )
+	    clk >>= hpre - 6;
+	else if ( hpre >= 8 )
+	    clk >>= hpre - 7;
+
+	return clk;
+}
+
 /* The processor comes out of reset using HSI (an internal 8 Mhz RC clock)
  * This sets a 9x multiplier for the PLL to give us 72 Mhz.
  * Note that we do NOT set the USB_NODIV bit, so this gets divided
@@ -129,8 +187,13 @@ get_pclk2 ( void )
  * HSE is a high speed external clock, no doubt the 8 Mhz crystal on a
  * blue pill or perhaps a crystal oscillator on a Maple board.
  */
-static void
-rcc_clocks ( void )
+/* The crystal takes a while to start and the PLL a while
+ * to lock after that, so rcc_start() just gets them going,
+ * first thing at boot, and mem_init() gets done meanwhile.
+ * No ram is touched here, it isn't set up yet.
+ */
+void
+rcc_start ( void )
 {
 	struct rcc *rp = RCC_BASE;
 
@@ -147,7 +210,14 @@ rcc_clocks ( void )
 	 * Setting the entire register works.
 	 */
 	rp->cr = CR_NORM | PLL_ENABLE;
+}
 
+static void
+rcc_clocks ( void )
+{
+	struct rcc *rp = RCC_BASE;
+
+	/* Whatever of the lock time is left */
 	while ( ! (rp->cr & PLL_LOCK ) )
 	   ;
 
@@ -159,7 +229,7 @@ rcc_clocks ( void )
 	 * 1 says dvide by 2 (96/2 = 48)
 	 * (The PLL clock runs double the system clock).
 	 */
-	rp->cfg = PLL_HSE | PLL_9 | SYS_PLL | APB1_DIV2;
+	rp->cfg = PLL_HSE | PLL_9 | SYS_PLL | ADC_DIV6 | APB1_DIV2;
 }
 
 void
@@ -183,6 +253,13 @@ rcc_init ( void )
 	// rp->apb2e |= TIMER1_ENABLE;
 	rp->apb1e |= TIMER2_ENABLE;
 
+	/* Timer 3 paces the ADC for isochronous streaming */
+	rp->apb1e |= TIMER3_ENABLE;
+
+	/* Timer 4 drives the profiler (prof.c) */
+	rp->apb1e |= TIMER4_ENABLE;
+	rp->apb2e |= ADC1_ENABLE;
+
 	rp->apb1e |= USB_ENABLE;
 
 	// rp->apb1e |= UART2_ENABLE;
@@ -84,6 +84,11 @@ uart_init ( struct uart *up, int baud )
 static struct cqueue out_queue;
 static char out_buf[OUT_BUF_SIZE];
 
+/* Posted when the queue drains to half full,
+ * a thread waiting for room sleeps on it.
+ */
+static struct sem out_sem;
+
 void
 serial_init ( void )
 {
@@ -95,7 +100,9 @@ serial_init ( void )
 	uart_init ( UART1_BASE, 115200 );
 
 	(void) cq_init ( &out_queue, out_buf, OUT_BUF_SIZE );
+	sem_init ( &out_sem, 0 );
 
+	nvic_priority ( UART1_IRQ, PRI_UART );
 	nvic_enable ( UART1_IRQ );
 
 #ifdef notdef
@@ -123,12 +130,27 @@ serial_putc_basic ( int c )
 	up->data = c;
 }
 
+/* Wake a thread waiting for room.  With nobody waiting we
+ * still leave one count, for a thread that saw the queue full
+ * but has not got to sem_wait() yet, or it would sleep forever
+ * once the queue drains.  Never more than one, an extra count
+ * only costs serial_putc() one more look at the queue.
+ * We run at PRI_UART, which is PRI_KERNEL, so the semaphore
+ * can't change under us.
+ */
+static void
+out_wake ( void )
+{
+	if ( out_sem.wait || out_sem.count < 1 )
+	    sem_post ( &out_sem );
+}
+
 /* interrupt comes here.
  * interrupts are cleared by reading from
  * or writing to the data register.
  */
 // void USART1_IRQ_Handler ( void )
-void
+void RAMFUNC
 uart1_handler ( void )
 {
 	struct uart *up = UART1_BASE;
@@ -139,14 +161,24 @@ uart1_handler ( void )
 	    // Just read it and discard
 	}
 
+	/* Once the queue is half empty, every Tx interrupt wakes
+	 * one thread waiting for room, so they all get going,
+	 * and when it runs dry, whoever is left goes at once.
+	 */
 	if ( up->status & ST_TXE ) {
 	    if ( cq_count ( &out_queue ) < 1 ) {
 		up->cr1 &= ~C1_TXE;
+		while ( out_sem.wait )
+		    sem_post ( &out_sem );
+		out_wake ();
 		return;
 	    }
 
 	    c = cq_remove ( &out_queue );
 	    up->data = c;
+
+	    if ( cq_space ( &out_queue ) >= OUT_BUF_SIZE / 2 )
+		out_wake ();
 	}
 }
 
@@ -177,20 +209,23 @@ serial_flush ( void )
 void
 serial_putc ( int c )
 {
+	u32 old;
 
 	// spin waiting for space
 	// waiting for 2 would be enough
+	// a thread can sleep until it drains some
 	while ( cq_space ( &out_queue ) < 10 )
-	    ;
+	    if ( kern_can_block () )
+		sem_wait ( &out_sem );
 
-	disable_irq ();
+	old = irq_mask ( PRI_UART );
 
 	if ( c == '\n' )
 	    cq_add ( &out_queue, '\r' );
 
 	cq_add ( &out_queue, c );
 
-	enable_irq ();
+	irq_unmask ( old );
 
 	// sort of brutal
 	serial_start ();
@@ -8,6 +8,7 @@ extern unsigned int __text_end;
 
 extern unsigned int __data_start;
 extern unsigned int __data_end;
+extern unsigned int __data_load;
 
 extern unsigned int __bss_start;
 extern unsigned int __bss_end;
@@ -20,17 +21,21 @@ extern unsigned int __bss_end;
 void
 mem_init ( void )
 {
-	unsigned int *src = &__text_end;
-	unsigned int *p;
+	unsigned int *src = &__data_load;
 	int count;
 
 	// printf ( "Bss: %08x\n", &__bss_start );
 	// printf ( "Bss: %08x\n", &__bss_end );
 	// printf ( "P  : %08x\n", &p );
 
-	/* Zero BSS */
-	for ( p = &__bss_start; p < &__bss_end; p++ )
-	    *p = 0;
+	/* Zero BSS.
+	 * mem_zero and mem_copy (locore.s) go 16 bytes
+	 * at a time with stm/ldm, about 4 times faster
+	 * than the word loops we used to have here.
+	 * This runs before the PLL is up (see startup in
+	 * main.c), at 8 Mhz, so it all counts.
+	 */
+	mem_zero ( &__bss_start, &__bss_end );
 
 	count = &__bss_end - &__bss_start;
 	count--;
@@ -39,9 +44,14 @@ mem_init ( void )
 
 	// init_vars ();
 
-	/* Copy initialized data from flash */
-	for ( p = &__data_start; p < &__data_end; p++ )
-	    *p = *src++;
+	/* Copy initialized data from flash.
+	 * This also brings the RAMFUNC code along, it sits
+	 * at the start of .data, so nothing tagged RAMFUNC
+	 * can be called before this.
+	 * The linker says where the image is (__data_load),
+	 * it is not always right at __text_end.
+	 */
+	mem_copy ( &__data_start, &__data_end, src );
 
 	count = &__data_end - &__data_start;
 	count--;
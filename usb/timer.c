@@ -46,6 +46,12 @@ struct timer {
 
 #define	UPDATE_IE	1	/* enable update interrupts */
 
+#define EGR_UG		1	/* force an update */
+
+/* Master mode selection in cr2, what drives TRGO */
+#define MMS_RESET	(0<<4)
+#define MMS_UPDATE	(2<<4)
+
 #define	EGR_CC1		2
 #define	EGR_CC2		4
 #define	EGR_CC3		8
@@ -76,6 +82,11 @@ struct timer {
  * A downcounting timer counts from the ARR value to 0.
  */
 
+/* Timer 2 now belongs to the software timers in wheel.c,
+ * which has the interrupt handler.  These first tests
+ * are kept for reference.
+ */
+#ifdef TIMER2_DEMO
 static int talk;
 static int tcount;
 
@@ -100,6 +111,8 @@ tim2_handler ( void )
 	}
 }
 
+#endif
+
 int
 timer_get ( void )
 {
@@ -129,6 +142,7 @@ timer_cc ( int chan, int load )
 	tp->ccmr[mr] = val;
 }
 
+#ifdef TIMER2_DEMO
 static void
 test1 ( void )
 {
@@ -178,12 +192,53 @@ test2 ( void )
 
 	tp->cr1 = CR1_ENABLE;
 }
+#endif
+
+/* All the timers get 72 Mhz (see above) */
+#define TIMER_CLOCK	72000000
+
+/* Set up timer 3 to generate TRGO at some rate.
+ * This is what paces the ADC when we stream samples.
+ * No interrupts, the ADC takes it from here.
+ * 72 Mhz / 65536 is 1099 Hz, so slower rates than
+ * that need the prescaler.
+ */
+void
+timer3_trgo ( int rate )
+{
+	struct timer *tp = TIMER3_BASE;
+	int div;
+	int psc;
+
+	div = TIMER_CLOCK / rate;
+	psc = div / 65536;
+
+	tp->cr1 = 0;
+	tp->psc = psc;
+	tp->arr = div / (psc+1) - 1;
+	tp->cr2 = MMS_UPDATE;
+
+	/* load psc right now */
+	tp->egr = EGR_UG;
+
+	tp->cr1 = CR1_ENABLE;
+}
+
+void
+timer3_stop ( void )
+{
+	struct timer *tp = TIMER3_BASE;
+
+	tp->cr1 = 0;
+}
 
+#ifdef TIMER2_DEMO
 void
 timer_init ( void )
 {
 	// test1 ();
 	test2 ();
 }
+#endif
 
 /* THE END */
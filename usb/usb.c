@@ -45,6 +45,7 @@ int strlen ( char * );
 static void force_reset ( void );
 void endpoint_show ( int );
 void usb_show ( void );
+void usb_stats_show ( void );
 void enum_logger ( int );
 void usb_debug ( void );
 static void usb_hw_init ( void );
@@ -53,8 +54,6 @@ static void pma_clear ( void );
 void usb_set_address ( int );
 static void endpoint_init ( void );
 void endpoint_recv_ready ( int );
-static void pma_copy_in ( u32, char *, int );
-static void pma_copy_out ( u32, char *, int );
 void enum_log_watch ( void );
 static void endpoint_rem ( int );
 void print_buf ( char *, int );
@@ -63,7 +62,12 @@ static void endpoint_set_tx_nak ( int );
 static void endpoint_clear_rx ( int );
 static void endpoint_clear_tx ( int );
 static void endpoint_stall ( int );
+static void endpoint_set_tx_valid ( int );
+static void endpoint_set_tx_dis ( int );
 void endpoint_send_zlp ( int );
+static void iso_ctr ( void );
+static void pipe_ctr ( void );
+static void pipe_reset ( void );
 
 static void data_ctr ( int );
 void ep_send ( int, char *, int );
@@ -193,6 +197,8 @@ struct usb {
 
 #define EP_CONTROL	0
 #define EP_DATA		1
+#define EP_ISO		2
+#define EP_PIPE		3
 
 /* ====================================================== */
 /* ====================================================== */
@@ -215,10 +221,16 @@ struct endpoint ep_info[NUM_EP];
 static struct cqueue in_queue;
 static char in_buf[IN_BUF_SIZE];
 
+/* Posted for each packet that goes into in_queue,
+ * so a thread in ep_recv can sleep (see kernel.c).
+ */
+static struct sem in_sem;
+
 void
 usb_init ( void )
 {
         (void) cq_init ( &in_queue, in_buf, IN_BUF_SIZE );
+	sem_init ( &in_sem, 0 );
 
 	usb_hw_init ();
 	usb_reset ();
@@ -263,20 +275,7 @@ usb_init ( void )
  * The values we write into it are for the USB controller,
  * which lives in the 16 bit world, so it sees 512 bytes
  * at addresses from 0x000 to 0x1ff.
- * Here is the layout:
- *
- * 000 to 01f - btable is here, 4 entries, 8 bytes each
- * 020 to 0f7 - unused.
- * 
- * 0f8 to 137 - 64 bytes, endpoint 1 tx serial data out
- * 138 to 177 - 64 bytes, endpoint 3 Rx serial data in
- * 178 to 17f - 8 bytes, endpoint 2 Tx (ACM)
- * 180 to 1bf - 64 bytes, endpoint 0 Rx
- * 1c0 to 1ff - 64 bytes, endpoint 0 Tx
- *
- * Would I do things this way?  No.
- * I would stick the ACM thing at the start (or get rid of it entirely).
- * I would put serial in/out in the same endpoint number.
+ * The layout is below, just ahead of endpoint_init().
  */
 
 /* For the Rx count field in the btable, we leave the 10 low bits
@@ -293,23 +292,50 @@ usb_init ( void )
 // This yields 0x8400 for 64 byte buffers
 #define BT_64		(BT_CLICK_32 | 1<<10)
 
+// And 0x8000 for 32 byte buffers
+#define BT_32		(BT_CLICK_32 | 0<<10)
+
 /* Called both during initialization and
  * during a USB reset event.
  */
 static void
 usb_reset ( void )
 {
+	usb_iso_enable ( 0 );
 	endpoint_init ();
 
 	usb_set_address ( 0 );
 }
 
-/* Which btable buffer is used for what
+/* Where the buffers are in PMA (these are PMA offsets).
+ * With the vendor pipe on endpoint 3 we need 9 buffers
+ * and there is only room for 7 of size 64 after the btable.
+ * The console is the one that can get along with less,
+ * so endpoint 1 gets two 32 byte buffers that share a slot.
+ *
+ * 000 to 03f - btable (only 4 entries used)
+ * 040 to 07f - endpoint 0 Tx
+ * 080 to 0bf - endpoint 0 Rx
+ * 0c0 to 0df - endpoint 1 Tx (console, 32 bytes)
+ * 0e0 to 0ff - endpoint 1 Rx (console, 32 bytes)
+ * 100 to 13f - endpoint 3 Tx (vendor pipe)
+ * 140 to 17f - endpoint 2 Tx buffer 0 (iso)
+ * 180 to 1bf - endpoint 2 Tx buffer 1 (iso)
+ * 1c0 to 1ff - endpoint 3 Rx (vendor pipe)
  */
-#define EP0_TX_BUF_INDEX	1
-#define EP0_RX_BUF_INDEX	2
-#define EP1_TX_BUF_INDEX	3
-#define EP1_RX_BUF_INDEX	4
+#define EP0_TX_PMA	0x040
+#define EP0_RX_PMA	0x080
+#define EP1_TX_PMA	0x0c0
+#define EP1_RX_PMA	0x0e0
+#define EP3_TX_PMA	0x100
+#define EP3_RX_PMA	0x1c0
+
+/* The isochronous endpoint is always double buffered.
+ * The hardware uses the rx_addr and rx_count fields
+ * in the btable for the second Tx buffer.
+ */
+#define ISO_BUF0_PMA	0x140
+#define ISO_BUF1_PMA	0x180
 
 static void
 endpoint_init ( void )
@@ -323,29 +349,50 @@ endpoint_init ( void )
 	up->epr[EP_CONTROL] = EP_TYPE_CONTROL | 0;
 	up->epr[EP_DATA] = EP_TYPE_BULK | 1;
 
-	PMA_btable[EP_CONTROL].tx_addr = EP0_TX_BUF_INDEX * 64;
+	PMA_btable[EP_CONTROL].tx_addr = EP0_TX_PMA;
 	PMA_btable[EP_CONTROL].tx_count = 0;
-	PMA_btable[EP_CONTROL].rx_addr = EP0_RX_BUF_INDEX * 64;
+	PMA_btable[EP_CONTROL].rx_addr = EP0_RX_PMA;
 	PMA_btable[EP_CONTROL].rx_count = BT_64;
 
 	endpoint_set_rx_ready ( EP_CONTROL );
 	endpoint_set_tx_nak ( EP_CONTROL );
 
-	PMA_btable[EP_DATA].tx_addr = EP1_TX_BUF_INDEX * 64;
+	PMA_btable[EP_DATA].tx_addr = EP1_TX_PMA;
 	PMA_btable[EP_DATA].tx_count = 0;
-	PMA_btable[EP_DATA].rx_addr = EP1_RX_BUF_INDEX * 64;
-	PMA_btable[EP_DATA].rx_count = BT_64;
+	PMA_btable[EP_DATA].rx_addr = EP1_RX_PMA;
+	PMA_btable[EP_DATA].rx_count = BT_32;
 
 	endpoint_set_rx_ready ( EP_DATA );
 	endpoint_set_tx_nak ( EP_DATA );
 
+	up->epr[EP_PIPE] = EP_TYPE_BULK | EP_PIPE;
+
+	PMA_btable[EP_PIPE].tx_addr = EP3_TX_PMA;
+	PMA_btable[EP_PIPE].tx_count = 0;
+	PMA_btable[EP_PIPE].rx_addr = EP3_RX_PMA;
+	PMA_btable[EP_PIPE].rx_count = BT_64;
+
+	endpoint_set_rx_ready ( EP_PIPE );
+	endpoint_set_tx_nak ( EP_PIPE );
+	pipe_reset ();
+
 	ep_info[EP_CONTROL].tx_buf = PMA_buf[1].buf;
 	ep_info[EP_CONTROL].rx_buf = PMA_buf[2].buf;
 	ep_info[EP_CONTROL].flags = 0;
 
-	ep_info[EP_DATA].tx_buf = PMA_buf[3].buf;
-	ep_info[EP_DATA].rx_buf = PMA_buf[4].buf;
+	ep_info[EP_DATA].tx_buf = &PMA_buf[3].buf[0];
+	ep_info[EP_DATA].rx_buf = &PMA_buf[3].buf[16];
 	ep_info[EP_DATA].flags = 0;
+
+	/* Stays disabled until the host selects
+	 * alternate setting 1 on interface 1.
+	 */
+	up->epr[EP_ISO] = EP_TYPE_ISO | EP_ISO;
+
+	PMA_btable[EP_ISO].tx_addr = ISO_BUF0_PMA;
+	PMA_btable[EP_ISO].tx_count = 0;
+	PMA_btable[EP_ISO].rx_addr = ISO_BUF1_PMA;
+	PMA_btable[EP_ISO].rx_count = 0;
 }
 
 static void
@@ -358,7 +405,15 @@ usb_hw_init ( void )
 	up->daddr = 0;
 	up->btable = 0;
 
-	/* We only ever see LP interrupts */
+	/* Isochronous traffic (hp) must not wait for
+	 * control traffic (lp), so lp gets a lower priority.
+	 * Both are below the uart, so printing from here
+	 * does not hang waiting for the uart to drain.
+	 */
+	nvic_priority ( USB_HP_IRQ, PRI_USB_HP );
+	nvic_priority ( USB_LP_IRQ, PRI_USB_LP );
+	nvic_priority ( USB_WK_IRQ, PRI_USB_LP );
+
 	nvic_enable ( USB_HP_IRQ );
 	nvic_enable ( USB_LP_IRQ );
 	nvic_enable ( USB_WK_IRQ );
@@ -427,16 +482,70 @@ unexpected ( void )
 	for ( ;; ) ;
 }
 
+/* Interrupt statistics, shown by usb_stats_show().
+ * Cycles come from the DWT counter and include all
+ * the printing that data_ctr() still does.
+ * The interesting numbers are entries and cycles per KB.
+ */
+struct usb_stats {
+	int	lp_entries;
+	int	hp_entries;
+	int	ctr_events;
+	int	ctr_max;	/* most CTR events in one entry */
+	u32	lp_cycles;
+	u32	hp_cycles;
+	u32	bytes;
+};
+
+static struct usb_stats usb_stats;
+
+/* Just in case some endpoint leaves its CTR bit set,
+ * we won't loop forever in an interrupt handler.
+ */
+#define CTR_LIMIT	16
+
+/* Endpoints that the hardware routes to the hp interrupt.
+ * That is isochronous and double buffered bulk endpoints,
+ * which for us is just the ADC stream.
+ */
+#define EP_HP_MASK	BIT(EP_ISO)
+
 /* Interrupt handlers,
  * called by vectors in locore.s
  * There are 3 interrupts assigned to USB,
  * but I have only ever seen "lp".
+ * That changed with the isochronous endpoint.
+ * CTR events for isochronous (and double buffered
+ * bulk) endpoints come in via "hp", which has a
+ * higher priority than "lp" (see usb_hw_init).
+ * So streaming data preempts control traffic.
+ *
+ * When several endpoints have CTR pending, the
+ * hardware puts the hp endpoints first in EP_ID.
+ * So we can stop when we see anything else and
+ * leave it for the lp handler.
  */
-void
+void RAMFUNC
 usb_hp_handler ( void )
 {
-	printf ( "USB hp interrupt\n" );
-	unexpected ();
+        struct usb *up = USB_BASE;
+	u32 start = dwt_read ();
+	int ep;
+	int n;
+
+	usb_stats.hp_entries++;
+
+	for ( n=0; n < CTR_LIMIT; n++ ) {
+	    if ( ! (up->isr & INT_CTR) )
+		break;
+	    ep = up->isr & EP_ADDR;
+	    if ( ! (EP_HP_MASK & BIT(ep)) )
+		break;
+	    iso_ctr ();
+	}
+
+	usb_stats.ctr_events += n;
+	usb_stats.hp_cycles += dwt_read () - start;
 }
 
 void
@@ -456,7 +565,11 @@ static int lp_count = 0;
 static int sof_count = 0;
 #endif
 
-#define SETUP_BUF	10
+/* Setup packets are 8 bytes, but control OUT data stages
+ * (like the watch list for the memory inspector) can be
+ * a full 64 byte packet.
+ */
+#define SETUP_BUF	64
 
 /* Here when I want to try to handle CTR on endpoint 0
  *
@@ -570,6 +683,31 @@ ctr0 ( void )
 
 int xx_count = 0;
 
+/* The '?' report, lots of printing, so it runs as an event
+ * (event.c) rather than in the USB interrupt.
+ */
+static void
+data_status ( void *arg )
+{
+        struct usb *up = USB_BASE;
+	int ep = (int) arg;
+
+	printf ( "inqueue size = %d\n", cq_count ( &in_queue ) );
+	if ( ep_info[ep].flags & F_TX_BUSY )
+	    printf ( "Tx BUSY on endpoint %d, epr = %04x\n", ep, up->epr[ep] );
+	else
+	    printf ( "Tx ready on endpoint %d, epr = %04x\n", ep, up->epr[ep] );
+	iso_show ();
+	usb_stats_show ();
+	event_show ();
+}
+
+static void
+data_dump ( void *arg )
+{
+	enum_log_dump ();
+}
+
 /* Called from interrupt code on any CTR event
  * on a non-zero endpoint
  */
@@ -584,12 +722,25 @@ data_ctr ( int ep )
 
 	// ep = up->isr & 0xf;
 
+	/* This comes every millisecond once streaming,
+	 * so we don't want any printing.
+	 */
+	if ( ep == EP_ISO ) {
+	    iso_ctr ();
+	    return;
+	}
+
+	/* The vendor pipe must not print either */
+	if ( ep == EP_PIPE ) {
+	    pipe_ctr ();
+	    return;
+	}
+
 	// if ( xx_count++ < 10 ) {
 	//     printf ( "Data CTR on endpoint %d isr=%04x epr=%04x\n", ep, up->isr, up->epr[ep] );
 	// }
 
-	/* If it ain't 2, it must be 3.
-	 * We only ever send data on 3.
+	/* If it ain't 2 or 3, it must be 1, the console.
 	 * We should clear the * CTR bit
 	 * either here or when we send new
 	 * data (we do the latter).
@@ -615,20 +766,25 @@ data_ctr ( int ep )
 	    pma_copy_in ( bte->rx_addr, inbuf, count );
 
 	    printf ( "%d bytes of data received: %02x\n", count, inbuf[0] );
+	    usb_stats.bytes += count;
 
 	    for ( i=0; i<count; i++ ) {
 		if ( cq_space ( &in_queue ) > 0 )
 		    cq_add ( &in_queue, inbuf[i] );
 	    }
+	    sem_post ( &in_sem );
 
 	    /* What is going on ?? */
-	    if ( count > 0 && inbuf[0] == '?' ) {
-		printf ( "inqueue size = %d\n", cq_count ( &in_queue ) );
-		if ( ep_info[ep].flags & F_TX_BUSY )
-		    printf ( "Tx BUSY on endpoint %d, epr = %04x\n", ep, up->epr[ep] );
-		else
-		    printf ( "Tx ready on endpoint %d, epr = %04x\n", ep, up->epr[ep] );
-	    }
+	    if ( count > 0 && inbuf[0] == '?' )
+		event_post ( EV_LOW, data_status, (void *) ep );
+
+	    /* Dump the enumeration log for enum2pcap.rb */
+	    if ( count > 0 && inbuf[0] == '!' )
+		event_post ( EV_LOW, data_dump, 0 );
+
+	    /* Dump the profile for prof.rb */
+	    if ( count > 0 && inbuf[0] == 'p' )
+		event_post ( EV_LOW, prof_dump, 0 );
 
 #ifdef notdef
 	printf ( "Data CTR on endpoint %d %04x\n", ep, up->isr );
@@ -658,11 +814,15 @@ data_ctr ( int ep )
 static int int_count = 0;
 static int int_first = 1;
 
-void
+void RAMFUNC
 usb_lp_handler ( void )
 {
         struct usb *up = USB_BASE;
+	u32 start = dwt_read ();
 	int ep;
+	int n;
+
+	usb_stats.lp_entries++;
 
 	if ( int_first && int_count++ > 2000 ) {
 	    int_first = 0;
@@ -699,8 +859,17 @@ usb_lp_handler ( void )
 	/* Correct transfer interrupt.
 	 * We handle some of these for endpoint 0
 	 * We handle all of them for other endpoints
+	 *
+	 * We used to handle just one and return, then take
+	 * another interrupt for the next one.  Now we keep
+	 * going until none are left.  This also takes care
+	 * of the Tx CTR that shows up while we are still
+	 * busy with the Rx CTR that caused it.
+	 *
+	 * The CTR bit in the isr is read only, it goes away
+	 * when we clear the CTR bits in the endpoint registers.
 	 */
-	if ( up->isr & INT_CTR ) {
+	for ( n=0; n < CTR_LIMIT && (up->isr & INT_CTR); n++ ) {
 	    ep = up->isr & 0xf;
 	    // endpoint_show ( ep );
 	    // usb_show ();
@@ -711,11 +880,31 @@ usb_lp_handler ( void )
 	    } else {
 		data_ctr ( ep );
 	    }
-
-	    up->isr &= ~INT_CTR;
 	}
+
+	usb_stats.ctr_events += n;
+	if ( n > usb_stats.ctr_max )
+	    usb_stats.ctr_max = n;
+	usb_stats.lp_cycles += dwt_read () - start;
 } // end of usr_lp_handler()
 
+void
+usb_stats_show ( void )
+{
+	struct usb_stats *sp = &usb_stats;
+	int kb = sp->bytes / 1024;
+
+	printf ( "USB lp: %d entries, %d cycles\n", sp->lp_entries, sp->lp_cycles );
+	printf ( "USB hp: %d entries, %d cycles\n", sp->hp_entries, sp->hp_cycles );
+	printf ( "USB %d CTR events (at most %d per entry), %d bytes\n",
+	    sp->ctr_events, sp->ctr_max, sp->bytes );
+
+	if ( kb > 0 )
+	    printf ( "USB per KB: %d entries, %d cycles\n",
+		(sp->lp_entries + sp->hp_entries) / kb,
+		(sp->lp_cycles + sp->hp_cycles) / kb );
+}
+
 #ifdef SOF_DEBUG
 	/* This was an interesting experiment.  Once.
 	 * We saw 913 SOF per second.
@@ -782,7 +971,7 @@ pma_clear ( void )
 }
 
 /* Copy from PMA memory to buffer */
-static void
+void RAMFUNC
 pma_copy_in ( u32 pma_off, char *buf, int count )
 {
 	int i;
@@ -800,7 +989,7 @@ pma_copy_in ( u32 pma_off, char *buf, int count )
 }
 
 /* Copy from buffer to PMA memory */
-static void
+void RAMFUNC
 pma_copy_out ( u32 pma_off, char *buf, int count )
 {
 	int i;
@@ -1004,6 +1193,29 @@ endpoint_set_tx_valid ( int ep )
 	// printf ( "Set tx out: %04x --> %04x\n", val, up->epr[ep] );
 }
 
+/* With isochronous endpoints there is no NAK,
+ * the choices are VALID or DISABLED.
+ * Since DISABLED is 00, the xor does nothing
+ * and we just write back the current bits
+ * (which toggles them all off).
+ */
+static void
+endpoint_set_tx_dis ( int ep )
+{
+        struct usb *up = USB_BASE;
+	u32 val;
+
+	val = up->epr[ep];
+
+	val &= ~EP_CTR_TX;
+	val |= EP_CTR_RX;
+	val &= ~ EP_TOGGLE_TX;
+
+	val ^= EP_TX_DIS;
+
+	up->epr[ep] = val;
+}
+
 static void
 endpoint_set_tx_nak ( int ep )
 {
@@ -1079,8 +1291,10 @@ endpoint_send ( int ep, char *buf, int count )
 	    bte->tx_count = count;
 	    pma_copy_out ( bte->tx_addr, buf, count );
 	    endpoint_set_tx_valid ( ep );
-	    if ( ep != 0 )
+	    if ( ep != 0 ) {
 		printf ( "EP send, %d %d, Tx valid %04x %s\n", ep, count, up->epr[ep], usb_state_str() );
+		usb_stats.bytes += count;
+	    }
 	    return;
 	}
 
@@ -1189,6 +1403,289 @@ endpoint_recv_ready ( int ep )
 	endpoint_set_rx_ready ( ep );
 }
 
+/* ====================================================== */
+
+/* The isochronous ADC stream.
+ *
+ * Every frame (1 ms) the host reads one packet from
+ * endpoint 2.  There are no retries and no NAK, if we
+ * have nothing ready it just gets an empty packet.
+ * The ADC hands us 32 samples per millisecond (see adc.c)
+ * which is exactly one 64 byte packet per frame.
+ *
+ * The hardware toggles DTOG_TX after each transfer,
+ * then tells us with CTR_TX.  At that point it is
+ * using one buffer for the next frame and we fill
+ * the other one (the one just sent) for the frame
+ * after that.  So samples are 1 to 2 ms old when
+ * they go out.
+ *
+ * ISO_CHAN is A0.
+ */
+#define ISO_CHAN	0
+#define ISO_RATE	(ADC_HALF * 1000)
+#define ISO_PACKET	(ADC_HALF * 2)
+
+static int iso_running;
+static int iso_frames;
+static int iso_empty;
+
+static void
+iso_ctr ( void )
+{
+        struct usb *up = USB_BASE;
+	struct btable_entry *bte;
+	u16 *samples;
+	u32 epr;
+	int count;
+
+	epr = up->epr[EP_ISO];
+
+	/* Only a finished IN packet wants a new one.
+	 * Anything else (there should be nothing) just
+	 * gets cleared, so it does not cost us a block.
+	 */
+	if ( ! (epr & EP_CTR_TX) ) {
+	    if ( epr & EP_CTR_RX )
+		endpoint_clear_rx ( EP_ISO );
+	    return;
+	}
+
+	endpoint_clear_tx ( EP_ISO );
+
+	bte = & ((struct btable_entry *) USB_RAM) [EP_ISO];
+	samples = adc_stream_get ();
+	count = samples ? ISO_PACKET : 0;
+
+	if ( ! samples )
+	    iso_empty++;
+	iso_frames++;
+	usb_stats.bytes += count;
+
+	if ( epr & EP_DTOG_TX ) {
+	    bte->tx_count = count;
+	    if ( count )
+		pma_copy_out ( bte->tx_addr, (char *) samples, count );
+	} else {
+	    bte->rx_count = count;
+	    if ( count )
+		pma_copy_out ( bte->rx_addr, (char *) samples, count );
+	}
+}
+
+/* Called from usb_enum.c when the host selects
+ * an alternate setting on the streaming interface.
+ */
+void
+usb_iso_enable ( int on )
+{
+	if ( on == iso_running )
+	    return;
+
+	if ( on ) {
+	    PMA_btable[EP_ISO].tx_count = 0;
+	    PMA_btable[EP_ISO].rx_count = 0;
+	    iso_frames = 0;
+	    iso_empty = 0;
+	    adc_stream_start ( ISO_CHAN, ISO_RATE );
+	    endpoint_set_tx_valid ( EP_ISO );
+	} else {
+	    endpoint_set_tx_dis ( EP_ISO );
+	    adc_stream_stop ();
+	}
+
+	iso_running = on;
+}
+
+/* ====================================================== */
+
+/* The vendor bulk pipe on endpoint 3.
+ *
+ * This is for binary data, so it gets its own queues
+ * and nothing else (like printf) ever touches it.
+ * Host software talks to it via libusb on interface 2.
+ *
+ * Rx: each packet from the host goes into pipe_rx_queue.
+ * If there isn't room for a whole packet, we leave the
+ * endpoint NAK and the host just waits.  pipe_read()
+ * makes it VALID again once it has made room.
+ *
+ * Tx: pipe_write() fills pipe_tx_queue and gets things
+ * going if the endpoint is idle.  Each Tx CTR sends the
+ * next 64 bytes.  When the queue runs dry right after a
+ * full size packet, we send a ZLP so the host knows the
+ * transfer is over.
+ *
+ * The queue counts are shared with interrupt level,
+ * so the non-interrupt side blocks interrupts.
+ */
+#define PIPE_PACKET	64
+#define PIPE_QUEUE_SIZE	2048
+
+static struct cqueue pipe_rx_queue;
+static struct cqueue pipe_tx_queue;
+static char pipe_rx_buf[PIPE_QUEUE_SIZE];
+static char pipe_tx_buf[PIPE_QUEUE_SIZE];
+
+static int pipe_tx_busy;
+static int pipe_tx_last;	/* size of last packet sent */
+static int pipe_rx_held;	/* Rx left NAK for lack of room */
+
+static void
+pipe_reset ( void )
+{
+	(void) cq_init ( &pipe_rx_queue, pipe_rx_buf, PIPE_QUEUE_SIZE );
+	(void) cq_init ( &pipe_tx_queue, pipe_tx_buf, PIPE_QUEUE_SIZE );
+
+	pipe_tx_busy = 0;
+	pipe_tx_last = 0;
+	pipe_rx_held = 0;
+}
+
+/* Send the next packet, called with interrupts blocked
+ * (or from the interrupt handler).
+ */
+static void
+pipe_tx_next ( void )
+{
+	struct btable_entry *bte;
+	char buf[PIPE_PACKET];
+	int count;
+	int i;
+
+	count = cq_count ( &pipe_tx_queue );
+	if ( count > PIPE_PACKET )
+	    count = PIPE_PACKET;
+
+	if ( count == 0 && pipe_tx_last != PIPE_PACKET ) {
+	    pipe_tx_busy = 0;
+	    pipe_tx_last = 0;
+	    return;
+	}
+
+	for ( i=0; i<count; i++ )
+	    buf[i] = cq_remove ( &pipe_tx_queue );
+
+	bte = & ((struct btable_entry *) USB_RAM) [EP_PIPE];
+	bte->tx_count = count;
+	pma_copy_out ( bte->tx_addr, buf, count );
+	endpoint_set_tx_valid ( EP_PIPE );
+
+	pipe_tx_busy = 1;
+	pipe_tx_last = count;
+	usb_stats.bytes += count;
+}
+
+static void
+pipe_rx_take ( void )
+{
+	struct btable_entry *bte;
+	char buf[PIPE_PACKET];
+	int count;
+	int i;
+
+	bte = & ((struct btable_entry *) USB_RAM) [EP_PIPE];
+	count = bte->rx_count & 0x3ff;
+
+	if ( cq_space ( &pipe_rx_queue ) < count ) {
+	    pipe_rx_held = 1;
+	    return;
+	}
+
+	pma_copy_in ( bte->rx_addr, buf, count );
+	for ( i=0; i<count; i++ )
+	    cq_add ( &pipe_rx_queue, buf[i] );
+
+	pipe_rx_held = 0;
+	usb_stats.bytes += count;
+	endpoint_recv_ready ( EP_PIPE );
+}
+
+static void
+pipe_ctr ( void )
+{
+        struct usb *up = USB_BASE;
+
+	if ( up->epr[EP_PIPE] & EP_CTR_TX ) {
+	    endpoint_clear_tx ( EP_PIPE );
+	    pipe_tx_next ();
+	}
+
+	if ( up->epr[EP_PIPE] & EP_CTR_RX ) {
+	    endpoint_clear_rx ( EP_PIPE );
+	    pipe_rx_take ();
+	}
+}
+
+/* Queue up data for the host.
+ * Returns how much we took, which may be less
+ * than count if the queue is full.
+ */
+int
+pipe_write ( char *buf, int count )
+{
+	int n;
+	int i;
+	u32 old;
+
+	if ( usb_state != CONFIGURED )
+	    return 0;
+
+	old = irq_mask ( PRI_USB_LP );
+
+	n = cq_space ( &pipe_tx_queue );
+	if ( n > count )
+	    n = count;
+	for ( i=0; i<n; i++ )
+	    cq_add ( &pipe_tx_queue, buf[i] );
+
+	if ( ! pipe_tx_busy )
+	    pipe_tx_next ();
+
+	irq_unmask ( old );
+
+	return n;
+}
+
+/* Get whatever the host has sent, does not block.
+ */
+int
+pipe_read ( char *buf, int limit )
+{
+	int n;
+	int i;
+	u32 old;
+
+	old = irq_mask ( PRI_USB_LP );
+
+	n = cq_count ( &pipe_rx_queue );
+	if ( n > limit )
+	    n = limit;
+	for ( i=0; i<n; i++ )
+	    buf[i] = cq_remove ( &pipe_rx_queue );
+
+	if ( pipe_rx_held )
+	    pipe_rx_take ();
+
+	irq_unmask ( old );
+
+	return n;
+}
+
+int
+pipe_pending ( void )
+{
+	return cq_count ( &pipe_tx_queue );
+}
+
+void
+iso_show ( void )
+{
+	printf ( "ISO stream %s: %d frames, %d empty\n",
+	    iso_running ? "on" : "off", iso_frames, iso_empty );
+	adc_stream_show ();
+}
+
 #ifdef notdef
 /* Not useful */
 static void
@@ -1248,6 +1745,7 @@ static void test1 ( void );
 static void test6 ( void );
 static void test7 ( void );
 static void test10 ( void );
+static void test11 ( void );
 
 void
 enum_wait ( void )
@@ -1294,6 +1792,7 @@ usb_debug ( void )
 
 	// run echo demo
 	test1 ();
+	// test11 ();
 	// test2 ();
 	// test3 ();
 	// test4 ();
@@ -1366,6 +1865,10 @@ test4 ( void )
 }
 #endif
 
+/* Tests 6, 7 and 8 used to send on endpoint 3, which
+ * is the vendor pipe now, so they use the console (EP_DATA).
+ */
+
 /* Works beautifully sending single characters.
  * try sending 2 and you get nothing at the other end.
  * Perhaps this is part of the ACM specification?
@@ -1386,8 +1889,8 @@ test6 ( void )
 		buf[0] = '-';
 	    else
 		buf[0] = '7';
-	    endpoint_send ( 3, buf, 1 );
-	    // endpoint_send ( 3, buf, 2 );
+	    endpoint_send ( EP_DATA, buf, 1 );
+	    // endpoint_send ( EP_DATA, buf, 2 );
 	    delay_ms ( 5 );
 	}
 }
@@ -1407,7 +1910,7 @@ test7 ( void )
 	buf[1] = '8';
 
 	for ( ;; ) {
-	    endpoint_send ( 3, buf, 2 );
+	    endpoint_send ( EP_DATA, buf, 2 );
 	    delay_ms ( 5 );
 	}
 }
@@ -1433,7 +1936,7 @@ test8_send ( void )
 
 	buf[0] = '5';
 
-	endpoint_send ( 3, buf, 1 );
+	endpoint_send ( EP_DATA, buf, 1 );
 }
 
 static void
@@ -1494,9 +1997,12 @@ ep_recv ( int ep, char *buf, int limit )
 {
 	int i, n;
 
-	/* Spin here waiting for input */
+	/* Spin here waiting for input,
+	 * or sleep if we are a thread.
+	 */
 	while ( cq_count ( &in_queue ) < 1 )
-	    ;
+	    if ( kern_can_block () )
+		sem_wait ( &in_sem );
 
 	n = cq_count ( &in_queue );
 	if ( n > limit )
@@ -1565,6 +2071,27 @@ test10 ( void )
 	}
 }
 
+/* Loopback on the vendor pipe.
+ * Whatever the host sends comes right back.
+ * pipe.rb -l uses this to measure throughput.
+ */
+static void
+test11 ( void )
+{
+	char buf[PIPE_PACKET];
+	int count;
+	int n;
+
+	printf ( "Running vendor pipe loopback (test11)\n" );
+
+	for ( ;; ) {
+	    count = pipe_read ( buf, PIPE_PACKET );
+	    n = 0;
+	    while ( n < count )
+		n += pipe_write ( &buf[n], count - n );
+	}
+}
+
 void
 ep_btable_show ( int ep )
 {
@@ -16,4 +16,29 @@ enum uart_state {
 	ENABLED,
 };
 
+/* The 8 byte setup packet that arrives on endpoint 0.
+ * Now shared so that handlers outside of usb_enum.c
+ * (like the memory inspector in usb_peek.c) can see it.
+ */
+struct setup {
+	u8	rtype;
+	u8	request;
+	u16	value;
+	u16	index;
+	u16	length;
+};
+
+/* usb_peek.c */
+int peek_request ( int );
+int peek_setup ( struct setup * );
+int peek_control ( char *, int );
+void peek_reset ( void );
+
+/* usb.c */
+void usb_iso_enable ( int );
+void iso_show ( void );
+int pipe_write ( char *, int );
+int pipe_read ( char *, int );
+int pipe_pending ( void );
+
 /* THE END */
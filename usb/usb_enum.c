@@ -24,15 +24,20 @@ extern enum uart_state uart_state;
 #define DESC_TYPE_INTERFACE	4
 #define DESC_TYPE_ENDPOINT	5
 
+#define DESC_TYPE_IAD		11	/* interface association */
+
 /* Act like we are a CP2102
+ * The class triple EF/02/01 says "look for interface
+ * association descriptors", which is how a composite
+ * device tells the host which interfaces go together.
  */
 static const u8 my_device_desc[] = {
     0x12,   // bLength
     DESC_TYPE_DEVICE,
     0x00, 0x02,   // bcdUSB = 2.00
-    0x00,   // bDeviceClass: 0 (device)
-    0x00,   // bDeviceSubClass
-    0x00,   // bDeviceProtocol
+    0xef,   // bDeviceClass: miscellaneous
+    0x02,   // bDeviceSubClass: common class
+    0x01,   // bDeviceProtocol: interface association
     0x40,   // bMaxPacketSize0
 
     0xc4,   // idVendor = 0x10c4 (silicon labs)
@@ -49,24 +54,74 @@ static const u8 my_device_desc[] = {
     1       // bNumConfigurations
 };
 
+#define CONSOLE_INTERFACE	0
+#define ISO_INTERFACE		1
+#define PIPE_INTERFACE		2
+
+#define DATA_ENDPOINT_OUT	1
+#define DATA_ENDPOINT_IN	1
+#define ISO_ENDPOINT_IN		2
+#define PIPE_ENDPOINT_OUT	3
+#define PIPE_ENDPOINT_IN	3
+
+/* The console doesn't need bandwidth, so it gets 32 byte
+ * packets to make room in PMA for the pipe (see usb.c)
+ */
+#define CONSOLE_DATA_SIZE	32
+#define ISO_DATA_SIZE		64
+#define PIPE_DATA_SIZE		64
+
+#define ENDPOINT_DIR_IN	0x80
+#define ENDPOINT_TYPE_ISO	1
+#define ENDPOINT_TYPE_BULK	2
+#define ENDPOINT_TYPE_INTERRUPT	3
+
+/* Isochronous sync type (bits 3:2 of bmAttributes) */
+#define ENDPOINT_ISO_ASYNC	(1<<2)
+
+/* A composite device with 3 functions, each with an IAD
+ * ahead of its interface:
+ *
+ *  interface 0 - the CP2102 console (endpoint 1 in/out)
+ *  interface 1 - the ADC stream (endpoint 2 iso in)
+ *  interface 2 - the vendor pipe (endpoint 3 in/out)
+ *
+ *  9 + (8 + 9 + 7 + 7) + (8 + 9 + 9 + 7) + (8 + 9 + 7 + 7)
+ *  is 104 bytes (0x68), so this goes in 2 transfers.
+ *
+ * The cp210x driver in Linux grabs any interface with
+ * bulk endpoints, so it will claim interface 2 as a
+ * second ttyUSB.  Host software needs to detach it
+ * (libusb can do this for us, see pipe.rb).
+ */
 static const u8  my_config_desc[] = {
     // Configuration Descriptor
     0x09,   // bLength: Configuration Descriptor size
     DESC_TYPE_CONFIG,
-    0x20,   // wTotalLength: including sub-descriptors
+    0x68,   // wTotalLength: including sub-descriptors
     0x00,   //      "      : MSB of uint16_t
 
-    0x01,   // bNumInterfaces: 1
+    0x03,   // bNumInterfaces: 3
     0x01,   // bConfigurationValue: 1
     0x00,   // iConfiguration: Index of string descriptor for configuration
     0xC0,   // bmAttributes: self powered (CP2102 would use 0x80)
     0x32,   // MaxPower 0 mA
 
+    // IAD for the console
+    0x08,   // bLength
+    DESC_TYPE_IAD,
+    CONSOLE_INTERFACE,	// bFirstInterface
+    1,      // bInterfaceCount
+    0xff,   // bFunctionClass: Vendor specific
+    0x00,   // bFunctionSubClass
+    0x00,   // bFunctionProtocol
+    0x02,   // iFunction
+
     // Interface Descriptor
     0x09,   // bLength: Interface Descriptor size
     // static_cast<uint8_t>(UsbDev::DescriptorType::INTERFACE),
     DESC_TYPE_INTERFACE,	// Interface descriptor type
-    0x00,   // bInterfaceNumber: Number of Interface
+    CONSOLE_INTERFACE,	// bInterfaceNumber: Number of Interface
     0x00,   // bAlternateSetting: Alternate setting
     2,      // bNumEndpoints: 2
     0xff,   // bInterfaceClass: Vendor specific
@@ -74,33 +129,105 @@ static const u8  my_config_desc[] = {
     0x00,   // bInterfaceProtocol:
     0x02,   // iInterface: (weird)
 
-#define DATA_ENDPOINT_OUT	1
-#define DATA_ENDPOINT_IN	1
+    // Endpoint 1 Descriptor
+    0x07,                               // bLength: Endpoint Descriptor size
+    DESC_TYPE_ENDPOINT,
+    DATA_ENDPOINT_IN | ENDPOINT_DIR_IN,	// bEndpointAddress
+    ENDPOINT_TYPE_BULK,			// bmAttributes: Bulk
+    CONSOLE_DATA_SIZE,			// wMaxPacketSize:
+    0x00,				// ^ MSB
+    0x00,                               // bInterval
 
-#define ACM_DATA_SIZE	8
-#define CDC_OUT_DATA_SIZE	64
-#define CDC_IN_DATA_SIZE	64
+    // Endpoint 1 Descriptor
+    0x07,   			// bLength: Endpoint Descriptor size
+    DESC_TYPE_ENDPOINT,
+    DATA_ENDPOINT_OUT,		// bEndpointAddress: (OUT1)
+    ENDPOINT_TYPE_BULK,		// bmAttributes: Bulk
+    CONSOLE_DATA_SIZE,		// wMaxPacketSize: 32
+    0x00,			// ^ MSB
+    0x00,			   // bInterval: ignore for Bulk transfer
+
+    /* The ADC stream.
+     * Alternate setting 0 has no endpoints and so reserves
+     * no bandwidth on the bus, that is what we come up in.
+     * The host selects alternate setting 1 to start
+     * the stream and goes back to 0 to stop it.
+     * The cp210x driver looks at this interface too,
+     * but gives up on it since it has no bulk endpoints.
+     */
+    0x08,   // bLength
+    DESC_TYPE_IAD,
+    ISO_INTERFACE,	// bFirstInterface
+    1,      // bInterfaceCount
+    0xff,   // bFunctionClass: Vendor specific
+    0x00,   // bFunctionSubClass
+    0x00,   // bFunctionProtocol
+    0x00,   // iFunction
 
-#define ENDPOINT_DIR_IN	0x80
-#define ENDPOINT_TYPE_BULK	2
-#define ENDPOINT_TYPE_INTERRUPT	3
+    0x09,   // bLength: Interface Descriptor size
+    DESC_TYPE_INTERFACE,
+    ISO_INTERFACE,	// bInterfaceNumber
+    0x00,   // bAlternateSetting
+    0,      // bNumEndpoints
+    0xff,   // bInterfaceClass: Vendor specific
+    0x00,   // bInterfaceSubClass:
+    0x00,   // bInterfaceProtocol:
+    0x00,   // iInterface:
 
+    0x09,   // bLength: Interface Descriptor size
+    DESC_TYPE_INTERFACE,
+    ISO_INTERFACE,	// bInterfaceNumber
+    0x01,   // bAlternateSetting
+    1,      // bNumEndpoints
+    0xff,   // bInterfaceClass: Vendor specific
+    0x00,   // bInterfaceSubClass:
+    0x00,   // bInterfaceProtocol:
+    0x00,   // iInterface:
 
-    // Endpoint 1 Descriptor
+    // Endpoint 2 Descriptor
     0x07,                               // bLength: Endpoint Descriptor size
     DESC_TYPE_ENDPOINT,
-    DATA_ENDPOINT_IN | ENDPOINT_DIR_IN,	// bEndpointAddress
+    ISO_ENDPOINT_IN | ENDPOINT_DIR_IN,	// bEndpointAddress
+    ENDPOINT_TYPE_ISO | ENDPOINT_ISO_ASYNC,	// bmAttributes
+    ISO_DATA_SIZE,			// wMaxPacketSize:
+    0x00,				// ^ MSB
+    0x01,                               // bInterval: every frame
+
+    /* The vendor pipe, for binary data */
+    0x08,   // bLength
+    DESC_TYPE_IAD,
+    PIPE_INTERFACE,	// bFirstInterface
+    1,      // bInterfaceCount
+    0xff,   // bFunctionClass: Vendor specific
+    0x00,   // bFunctionSubClass
+    0x00,   // bFunctionProtocol
+    0x00,   // iFunction
+
+    0x09,   // bLength: Interface Descriptor size
+    DESC_TYPE_INTERFACE,
+    PIPE_INTERFACE,	// bInterfaceNumber
+    0x00,   // bAlternateSetting
+    2,      // bNumEndpoints
+    0xff,   // bInterfaceClass: Vendor specific
+    0x00,   // bInterfaceSubClass:
+    0x00,   // bInterfaceProtocol:
+    0x00,   // iInterface:
+
+    // Endpoint 3 Descriptor
+    0x07,                               // bLength: Endpoint Descriptor size
+    DESC_TYPE_ENDPOINT,
+    PIPE_ENDPOINT_IN | ENDPOINT_DIR_IN,	// bEndpointAddress
     ENDPOINT_TYPE_BULK,			// bmAttributes: Bulk
-    64,					// wMaxPacketSize:
+    PIPE_DATA_SIZE,			// wMaxPacketSize:
     0x00,				// ^ MSB
     0x00,                               // bInterval
 
-    // Endpoint 1 Descriptor
+    // Endpoint 3 Descriptor
     0x07,   			// bLength: Endpoint Descriptor size
     DESC_TYPE_ENDPOINT,
-    DATA_ENDPOINT_OUT,		// bEndpointAddress: (OUT3)
+    PIPE_ENDPOINT_OUT,		// bEndpointAddress: (OUT3)
     ENDPOINT_TYPE_BULK,		// bmAttributes: Bulk
-    64,				// wMaxPacketSize: 64
+    PIPE_DATA_SIZE,		// wMaxPacketSize: 64
     0x00,			// ^ MSB
     0x00			   // bInterval: ignore for Bulk transfer
 };
@@ -266,14 +393,6 @@ static const u8 my_language_string_desc[] = {
 /* ========================================================================= */
 /* ========================================================================= */
 
-struct setup {
-	u8	rtype;
-	u8	request;
-	u16	value;
-	u16	index;
-	u16	length;
-};
-
 static int device_request ( struct setup * );
 static int descriptor_request ( struct setup * );
 static int interface_request ( struct setup * );
@@ -288,6 +407,8 @@ static void would_send ( char *, char *, int );
 static int get_descriptor ( struct setup * );
 static int set_address ( struct setup * );
 static int set_configuration ( struct setup * );
+static int set_interface ( struct setup * );
+static int get_interface ( struct setup * );
 static int string_send ( int );
 
 static int cp21_vendor ( struct setup * );
@@ -330,26 +451,35 @@ usb_setup ( char *buf, int count )
 	int tag;
 	int rv = 0;
 
-	if ( usb_state == CONFIGURED ) {
-	    printf ( "Setup packet: %d bytes -- " );
-	    print_buf ( buf, count );
-	}
-
 	/* Just ignore ZLP (zero length packets) */
 	if ( count == 0 )
 	    return 0;
 
 	sp = (struct setup *) buf;
+	tag = sp->rtype << 8 | sp->request;
+
+	/* The memory inspector gets polled at kHz rates,
+	 * so it must not chatter on the console.
+	 * (the vendor requests are in usb_peek.c)
+	 */
+	if ( peek_request ( tag ) ) {
+	    cp21_control = NONE;
+	    return peek_setup ( sp );
+	}
+
+	if ( usb_state == CONFIGURED ) {
+	    printf ( "Setup packet: %d bytes -- " );
+	    print_buf ( buf, count );
+	}
 
 	if ( sp->rtype == 0x21 ) {
 	    usb_class ( sp );
 	    return 1;
 	}
 
-	tag = sp->rtype << 8 | sp->request;
-
 	// reset this.
 	cp21_control = NONE;
+	peek_reset ();
 
 	switch ( tag ) {
 	    case 0x8006:
@@ -361,6 +491,12 @@ usb_setup ( char *buf, int count )
 	    case 0x0009:
 		rv = set_configuration ( sp );
 		break;
+	    case 0x010b:
+		rv = set_interface ( sp );
+		break;
+	    case 0x810a:
+		rv = get_interface ( sp );
+		break;
 	    case 0xc0ff:
 		rv = cp21_vendor ( sp );
 		break;
@@ -446,6 +582,14 @@ cp21_vendor ( struct setup *sp )
 static int
 cp21_enable ( struct setup *sp )
 {
+	/* The cp210x driver also sends this for the pipe
+	 * interface if it has grabbed it, wIndex tells us.
+	 */
+	if ( sp->index != CONSOLE_INTERFACE ) {
+	    endpoint_send_zlp ( 0 );
+	    return 1;
+	}
+
 	if ( sp->value == 1 ) {
 	    uart_state = ENABLED;
 	    printf ( "Uart enabled\n" );
@@ -727,6 +871,11 @@ set_address ( struct setup *sp )
 	return 1;
 }
 
+/* Only the ADC stream interface has alternate settings.
+ * This gets sent in reply to get interface.
+ */
+static u8 iso_alt[2];
+
 /* We get a command to set configuration "1", but of course
  * we only have one configuration, so we just reply and
  * ignore this.
@@ -734,8 +883,38 @@ set_address ( struct setup *sp )
 static int
 set_configuration ( struct setup *sp )
 {
+	/* This puts all interfaces back to alternate setting 0 */
+	iso_alt[0] = 0;
+	usb_iso_enable ( 0 );
+
 	endpoint_send_zlp ( 0 );
 	usb_state = CONFIGURED;
+	boot_stamp ( B_CONFIG );
+	return 1;
+}
+
+/* Setup packet: 8 bytes --  010B010001000000
+ * value is the alternate setting, index the interface.
+ */
+static int
+set_interface ( struct setup *sp )
+{
+	if ( sp->index == ISO_INTERFACE && sp->value <= 1 ) {
+	    iso_alt[0] = sp->value;
+	    usb_iso_enable ( sp->value );
+	}
+
+	endpoint_send_zlp ( 0 );
+	return 1;
+}
+
+static int
+get_interface ( struct setup *sp )
+{
+	if ( sp->index == ISO_INTERFACE )
+	    endpoint_send ( 0, iso_alt, 1 );
+	else
+	    endpoint_send ( 0, &iso_alt[1], 1 );
 	return 1;
 }
 
@@ -756,6 +935,10 @@ set_configuration ( struct setup *sp )
 int
 usb_control ( char *buf, int count )
 {
+	/* data stage for a poke or watch list */
+	if ( peek_control ( buf, count ) )
+	    return 1;
+
 	if ( cp21_control == BAUD )
 	    memcpy ( cp21_baud, buf, count );
 	else if ( cp21_control == CHARS )
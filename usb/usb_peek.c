@@ -0,0 +1,245 @@
+/* usb_peek.c
+ *
+ * (c) Tom Trebisky  12-8-2023
+ *
+ * A memory inspector that works via vendor specific
+ * control requests on endpoint 0.
+ *
+ * The idea is to be able to watch (and poke at) variables
+ * in a running program without stopping it with gdb
+ * and without cluttering up the serial console.
+ * The host side is peek.rb, which looks up symbol
+ * addresses in dragoon.elf and then polls away.
+ *
+ * These live right alongside the CP2102 requests that
+ * the Linux cp210x driver sends us.  That driver uses
+ * request codes 0x00 to 0x1e and 0xff, so we stay
+ * well away from those.
+ *
+ * C0 D0 - peek: read "length" bytes at an address
+ * 40 D1 - poke: write the data stage at an address
+ * 40 D2 - load a watch list of up to 16 addresses
+ * C0 D3 - read the watch list (4 bytes per entry)
+ *
+ * For peek and poke the address is split between the
+ * value (low 16 bits) and index (high 16 bits) fields.
+ * For the watch list, value gives the number of entries.
+ *
+ * Everything is limited to a single 64 byte packet.
+ * That keeps us out of the "two transaction" business
+ * in endpoint_send() and is plenty for watching variables.
+ *
+ * All of this runs in the USB interrupt handler.
+ */
+
+#include "protos.h"
+#include "usb.h"
+
+#define PEEK_READ	0xc0d0
+#define PEEK_WRITE	0x40d1
+#define PEEK_WATCH	0x40d2
+#define PEEK_WREAD	0xc0d3
+
+#define PEEK_MAX	64
+#define WATCH_MAX	(PEEK_MAX/4)
+
+/* What we expect in the next control OUT packet */
+enum peek_pending {
+	P_NONE,
+	P_WRITE,
+	P_WATCH
+};
+
+static enum peek_pending peek_pending;
+static u32 peek_addr;
+static int peek_count;
+
+static u32 watch_list[WATCH_MAX];
+static int watch_count;
+
+/* The reply must not be on the stack since the
+ * hardware sends it after we return.
+ */
+static u32 peek_buf[WATCH_MAX];
+
+/* Reading something like reserved address space
+ * gives us a bus fault, and we don't handle those.
+ * So we only allow access to these regions.
+ */
+struct peek_region {
+	u32	start;
+	u32	end;
+	int	write;
+};
+
+static const struct peek_region peek_regions[] = {
+	{ 0x08000000, 0x08020000, 0 },	/* flash (128K on the Maple) */
+	{ 0x1ffff000, 0x20000000, 0 },	/* boot rom and option bytes */
+	{ 0x20000000, 0x20005000, 1 },	/* sram */
+	{ 0x40000000, 0x40023400, 1 },	/* peripherals */
+	{ 0xe0000000, 0xe0100000, 1 },	/* private peripheral bus (NVIC, DWT, ...) */
+	{ 0, 0, 0 }
+};
+
+static int
+peek_valid ( u32 addr, int count, int write )
+{
+	const struct peek_region *rp;
+
+	if ( count <= 0 || count > PEEK_MAX )
+	    return 0;
+
+	for ( rp = peek_regions; rp->end; rp++ ) {
+	    /* Not addr + count, that can wrap past 0xffffffff */
+	    if ( addr < rp->start || addr >= rp->end )
+		continue;
+	    if ( count > rp->end - addr )
+		continue;
+	    if ( write && ! rp->write )
+		return 0;
+	    return 1;
+	}
+
+	return 0;
+}
+
+/* Many peripheral registers must be accessed as words,
+ * so we do that whenever the alignment allows it.
+ */
+static void
+peek_copy ( char *dst, char *src, int count )
+{
+	int i;
+
+	if ( ((u32) dst | (u32) src | count) & 3 ) {
+	    for ( i=0; i<count; i++ )
+		dst[i] = src[i];
+	    return;
+	}
+
+	for ( i=0; i<count/4; i++ )
+	    ((vu32 *) dst)[i] = ((vu32 *) src)[i];
+}
+
+/* Is this setup tag one of ours?
+ */
+int
+peek_request ( int tag )
+{
+	return tag == PEEK_READ || tag == PEEK_WRITE ||
+	    tag == PEEK_WATCH || tag == PEEK_WREAD;
+}
+
+void
+peek_reset ( void )
+{
+	peek_pending = P_NONE;
+}
+
+/* We reply with a ZLP to anything we refuse.
+ * The host sees a short (empty) read and knows.
+ */
+static int
+peek_read ( struct setup *sp )
+{
+	u32 addr = sp->index << 16 | sp->value;
+	int count = sp->length;
+
+	if ( ! peek_valid ( addr, count, 0 ) ) {
+	    endpoint_send_zlp ( 0 );
+	    return 1;
+	}
+
+	peek_copy ( (char *) peek_buf, (char *) addr, count );
+	endpoint_send ( 0, (char *) peek_buf, count );
+	return 1;
+}
+
+static int
+peek_wread ( struct setup *sp )
+{
+	int i;
+	int count;
+
+	for ( i=0; i<watch_count; i++ )
+	    peek_buf[i] = * (vu32 *) watch_list[i];
+
+	count = watch_count * 4;
+	if ( count > sp->length )
+	    count = sp->length;
+
+	endpoint_send ( 0, (char *) peek_buf, count );
+	return 1;
+}
+
+/* As with the CP2102 set baud request, we queue the
+ * ZLP for the status stage right away and the data
+ * shows up later via peek_control()
+ */
+int
+peek_setup ( struct setup *sp )
+{
+	peek_pending = P_NONE;
+
+	switch ( sp->rtype << 8 | sp->request ) {
+	    case PEEK_READ:
+		return peek_read ( sp );
+	    case PEEK_WREAD:
+		return peek_wread ( sp );
+	    case PEEK_WRITE:
+		peek_addr = sp->index << 16 | sp->value;
+		peek_count = sp->length;
+		if ( peek_valid ( peek_addr, peek_count, 1 ) )
+		    peek_pending = P_WRITE;
+		break;
+	    case PEEK_WATCH:
+		peek_count = sp->value;
+		if ( peek_count <= WATCH_MAX )
+		    peek_pending = P_WATCH;
+		break;
+	    default:
+		return 0;
+	}
+
+	endpoint_send_zlp ( 0 );
+	return 1;
+}
+
+/* Called with each control OUT packet.
+ * Returns 1 if the packet was for us.
+ */
+int
+peek_control ( char *buf, int count )
+{
+	int i;
+	u32 addr;
+
+	if ( peek_pending == P_NONE )
+	    return 0;
+
+	if ( peek_pending == P_WRITE ) {
+	    if ( count > peek_count )
+		count = peek_count;
+	    peek_copy ( (char *) peek_addr, buf, count );
+	}
+
+	/* Entries that are not word aligned or that
+	 * point at something we won't touch get
+	 * quietly dropped.
+	 */
+	if ( peek_pending == P_WATCH ) {
+	    watch_count = 0;
+	    for ( i=0; i<peek_count && (i+1)*4 <= count; i++ ) {
+		addr = ((u8) buf[4*i]) | ((u8) buf[4*i+1]) << 8 |
+		    ((u8) buf[4*i+2]) << 16 | ((u8) buf[4*i+3]) << 24;
+		if ( (addr & 3) || ! peek_valid ( addr, 4, 0 ) )
+		    continue;
+		watch_list[watch_count++] = addr;
+	    }
+	}
+
+	peek_pending = P_NONE;
+	return 1;
+}
+
+/* THE END */
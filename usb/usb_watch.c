@@ -11,6 +11,7 @@
  *	void enum_log_init ( void );
  *	void enum_handler ( void );
  *	void enum_log_show ( void );
+ *	void enum_log_dump ( void );
  *
  * The trick is knowing when to call "show"
  *
@@ -22,6 +23,13 @@
  *	0 = Rx CTR
  *	1 = Tx CTR
  *	2 = Reset
+ *
+ * Each entry gets a timestamp from the DWT cycle counter
+ * (72 Mhz ticks since enum_log_init) and the USB frame number.
+ * enum_log_dump() prints the whole log as hex encoded
+ * binary records that enum2pcap.rb turns into a pcap file
+ * for wireshark.  Capture the console with picocom or
+ * whatever and feed the log file to enum2pcap.rb.
  */
 
 typedef unsigned char u8;
@@ -168,16 +176,29 @@ struct enum_log_e {
 	u32 istr;
 	u32 epr;
 	char *data;
+	u32 stamp;
+	u16 frame;
 };
 
-#define ENUM_LIMIT	50
+/* We see 36 entries and 363 bytes for a plain enumeration.
+ * The defaults leave room for picocom connecting and
+ * a few retries, and these can be set in the Makefile
+ * (-DENUM_LIMIT=200) if we are chasing something bigger.
+ */
+#ifndef ENUM_LIMIT
+#define ENUM_LIMIT	100
+#endif
+
+#ifndef SAVE_SIZE
+#define SAVE_SIZE	1536
+#endif
+
+#define ENUM_CLOCK	72000000
 
-/* We see 36 entries */
 static struct enum_log_e e_log[ENUM_LIMIT];
 static int e_count = 0;
-
-/* We see 363 bytes */
-#define SAVE_SIZE	400
+static int e_lost = 0;
+static u32 e_start;
 
 static char save_buf[SAVE_SIZE];
 static int s_count = 0;
@@ -200,15 +221,20 @@ enum_logger ( int what )
 
 	bte = &bt[0];
 
-	if ( e_count >= ENUM_LIMIT )
+	if ( e_count >= ENUM_LIMIT ) {
+	    e_lost++;
 	    return;
+	}
 
 	// Even printing this breaks enumeration.
 	// printf ( "enum %d\n", what );
 
 	ep = &e_log[e_count];
+	ep->stamp = dwt_read () - e_start;
+	ep->frame = up->fnr & 0x7ff;
 	ep->what = what;
 	ep->count = 0;
+	ep->data = (char *) 0;
 	ep->istr = up->isr;
 	ep->epr = up->epr[0];
 
@@ -249,7 +275,7 @@ enum_log_show ( void )
 	for ( i=0; i<e_count; i++ ) {
 	    ep = &e_log[i];
 	    if ( ep->what == 2 ) {
-		printf ( "%3d Enum Reset\n", i );
+		printf ( "%3d %8d Enum Reset\n", i, ep->stamp / (ENUM_CLOCK/1000000) );
 		continue;
 	    }
 
@@ -258,11 +284,66 @@ enum_log_show ( void )
 
 	    // printf ( "%3d Enum %s %2d %08x", i, wstr, ep->count, ep->addr );
 	    // printf ( "%3d Enum %s %s %04x %2d %08x", i, wstr, sstr, ep->epr, ep->count, ep->addr );
-	    printf ( "%3d Enum %s %s %04x %04x %2d", i, wstr, sstr, ep->istr, ep->epr, ep->count );
-	    print_buf ( ep->data, ep->count );
+	    // printf ( "%3d Enum %s %s %04x %04x %2d", i, wstr, sstr, ep->istr, ep->epr, ep->count );
+	    printf ( "%3d %8d Enum %s %s %04x %04x %2d", i, ep->stamp / (ENUM_CLOCK/1000000),
+		wstr, sstr, ep->istr, ep->epr, ep->count );
+
+	    /* data is 0 when save_buf filled up */
+	    print_buf ( ep->data, ep->data ? ep->count : 0 );
 	}
 
 	printf ( "Total bytes saved: %d\n", s_count );
+	if ( e_lost )
+	    printf ( "Entries lost: %d\n", e_lost );
+}
+
+static void
+dump_bytes ( u32 val, int n )
+{
+	while ( n-- ) {
+	    printf ( "%02x", val & 0xff );
+	    val >>= 8;
+	}
+}
+
+/* One line per entry, "E " then the record in hex.
+ * Records are little endian:
+ *	u32	stamp (cycles since enum_log_init)
+ *	u16	frame number
+ *	u8	what
+ *	u8	1 if this was a setup packet
+ *	u16	istr
+ *	u16	epr
+ *	u8	count
+ *	...	count bytes of data
+ */
+void
+enum_log_dump ( void )
+{
+	int i;
+	int j;
+	struct enum_log_e *ep;
+
+	printf ( "Enum log: %d entries, clock %d\n", e_count, ENUM_CLOCK );
+
+	for ( i=0; i<e_count; i++ ) {
+	    ep = &e_log[i];
+	    printf ( "E " );
+	    dump_bytes ( ep->stamp, 4 );
+	    dump_bytes ( ep->frame, 2 );
+	    dump_bytes ( ep->what, 1 );
+	    dump_bytes ( (ep->epr & EP_SETUP) ? 1 : 0, 1 );
+	    dump_bytes ( ep->istr, 2 );
+	    dump_bytes ( ep->epr, 2 );
+	    dump_bytes ( ep->data ? ep->count : 0, 1 );
+	    if ( ep->data ) {
+		for ( j=0; j<ep->count; j++ )
+		    dump_bytes ( ep->data[j], 1 );
+	    }
+	    printf ( "\n" );
+	}
+
+	printf ( "Enum log end\n" );
 }
 
 void
@@ -270,6 +351,8 @@ enum_log_init ( void )
 {
 	e_count = 0;
 	s_count = 0;
+	e_lost = 0;
+	e_start = dwt_read ();
 	memset ( save_buf, 0xaa, SAVE_SIZE );
 }
 
@@ -309,6 +392,9 @@ enum_saver ( u32 addr, int count )
 	if ( count == 0 )
 	    return (char *) 0;
 
+	if ( s_count + count > SAVE_SIZE )
+	    return (char *) 0;
+
 	rv = &save_buf[s_count];
 	pma_copy_in ( addr, rv, count );
 
@@ -0,0 +1,383 @@
+/* wheel.c
+ * (c) Tom Trebisky  12-21-2023
+ *
+ * Software timers on a hashed timer wheel, driven by timer 2.
+ *
+ *   id = timer_after ( ms, func, arg );	call func(arg) once
+ *   id = timer_every ( ms, func, arg );	call it every ms
+ *   timer_cancel ( id );
+ *
+ * All our waiting used to be busy loops (delay_ms), so the
+ * processor could only wait for one thing at a time.
+ * Now anything can ask to be called back later and get on
+ * with its life.  The callbacks run in the timer 2 interrupt,
+ * so keep them short, and they may start or cancel timers.
+ * Don't call any of this from an interrupt more urgent than
+ * PRI_TIMER (protos.h), that is as far as we mask.
+ *
+ * Timer 2 runs free at TICK_HZ, the prescaler takes 72 Mhz
+ * down to 2 kHz (the slowest it can do is 1099 Hz) so a tick
+ * is half a millisecond and the 16 bit counter wraps every
+ * 32.768 seconds.  The update interrupt at each wrap extends
+ * the count to 32 bits (24 days).  There is no periodic tick,
+ * compare channel 1 is set for the next expiry and that is
+ * the only other interrupt we get.
+ *
+ * Pending timers hang on WHEEL_SLOTS lists by expiry time,
+ * each slot covering SLOT_TICKS, and each list is kept sorted.
+ * One trip around the wheel is 512 ms, anything further out
+ * shares a slot with nearer timers and sorts behind them.
+ * Finding the next one to go is a walk of at most WHEEL_SLOTS
+ * list heads, starting from where we last ran.
+ */
+
+#include "protos.h"
+
+struct timer {
+	vu32	cr1;	/* 00 */
+	vu32	cr2;	/* 04 */
+	vu32	smcr;	/* 08 */
+	vu32	dier;	/* 0c */
+	vu32	sr;	/* 10 */
+	vu32	egr;	/* 14 */
+	vu32	ccmr[2];	/* 18 */
+	vu32	ccer;	/* 20 */
+	vu32	cnt;	/* 24 */
+	vu32	psc;	/* 28 */
+	vu32	arr;	/* 2c */
+	    long	_pad0;
+	vu32	ccr[4];	/* 34 */
+};
+
+#define TIMER2_BASE	(struct timer *) 0x40000000
+#define TIMER2_IRQ	28
+
+#define CR1_ENABLE	1
+#define EGR_UG		1
+#define EGR_CC1		2
+
+/* Bits in SR and DIER */
+#define TIM_UIF		0x01
+#define TIM_CC1IF	0x02
+
+#define TIMER_CLOCK	72000000	/* see timer.c */
+#define TICK_HZ		2000
+#define MS_TICKS	(TICK_HZ / 1000)
+
+#define WHEEL_SLOTS	64
+#define SLOT_SHIFT	4
+#define SLOT_TICKS	(1<<SLOT_SHIFT)
+
+#define NUM_TIMERS	16
+
+struct callout {
+	struct callout *next;
+	u32 when;		/* in ticks */
+	u32 period;		/* 0 for a one shot */
+	tfptr func;
+	void *arg;
+	int gen;
+	int pending;
+};
+
+static struct callout callouts[NUM_TIMERS];
+static struct callout *wheel[WHEEL_SLOTS];
+
+static volatile u32 wheel_hi;		/* counter wraps */
+static u32 wheel_base;			/* everything before this has run */
+
+static int wheel_fired;
+static int wheel_ints;
+static int wheel_lost;			/* no free callout */
+
+static int
+slot_of ( u32 when )
+{
+	return (when >> SLOT_SHIFT) & (WHEEL_SLOTS-1);
+}
+
+/* Ticks since wheel_init, called with the timer masked.
+ * A wrap can happen between reading wheel_hi and the
+ * counter, or be waiting for us to get out of the way
+ * if we are in an interrupt ourselves, so the update
+ * flag tells us to count one more.
+ */
+static u32
+now_locked ( void )
+{
+	struct timer *tp = TIMER2_BASE;
+	u32 hi, lo;
+
+	hi = wheel_hi;
+	lo = tp->cnt;
+	if ( (tp->sr & TIM_UIF) && lo < 0x8000 )
+	    hi++;
+
+	return (hi << 16) | lo;
+}
+
+u32
+wheel_now ( void )
+{
+	u32 rv;
+	u32 old;
+
+	old = irq_mask ( PRI_TIMER );
+	rv = now_locked ();
+	irq_unmask ( old );
+
+	return rv;
+}
+
+/* Called with the timer masked */
+static void
+wheel_insert ( struct callout *cp )
+{
+	struct callout **pp;
+
+	pp = &wheel[slot_of(cp->when)];
+	while ( *pp && (int) ((*pp)->when - cp->when) <= 0 )
+	    pp = &(*pp)->next;
+
+	cp->next = *pp;
+	*pp = cp;
+	cp->pending = 1;
+}
+
+/* Called with the timer masked */
+static void
+wheel_remove ( struct callout *cp )
+{
+	struct callout **pp;
+
+	pp = &wheel[slot_of(cp->when)];
+	while ( *pp && *pp != cp )
+	    pp = &(*pp)->next;
+
+	if ( *pp )
+	    *pp = cp->next;
+	cp->pending = 0;
+}
+
+/* The next timer to go, or 0.
+ * Walk the slots from wheel_base, the first head that
+ * falls in this trip around the wheel is the one.
+ * If nothing does, it is the earliest of the heads.
+ */
+static struct callout *
+wheel_next ( void )
+{
+	struct callout *cp;
+	struct callout *best = 0;
+	u32 base_slot = wheel_base >> SLOT_SHIFT;
+	int s = slot_of ( wheel_base );
+	int i;
+
+	for ( i=0; i<WHEEL_SLOTS; i++ ) {
+	    cp = wheel[(s+i) & (WHEEL_SLOTS-1)];
+	    if ( ! cp )
+		continue;
+	    if ( (cp->when >> SLOT_SHIFT) - base_slot == i )
+		return cp;
+	    if ( ! best || (int) (cp->when - best->when) < 0 )
+		best = cp;
+	}
+	return best;
+}
+
+/* Set compare 1 for the next expiry.
+ * If it is more than a counter wrap away, the
+ * update interrupt will get us back here in time.
+ */
+static void
+wheel_arm ( void )
+{
+	struct timer *tp = TIMER2_BASE;
+	struct callout *cp;
+	u32 now;
+	u32 old;
+
+	old = irq_mask ( PRI_TIMER );
+	cp = wheel_next ();
+	if ( cp ) {
+	    now = now_locked ();
+	    if ( (int) (cp->when - now) < 0x10000 ) {
+		tp->sr = ~TIM_CC1IF;
+		tp->ccr[0] = cp->when & 0xffff;
+		tp->dier = TIM_UIF | TIM_CC1IF;
+
+		/* We may already be past it */
+		if ( (int) (cp->when - now_locked ()) <= 0 )
+		    tp->egr = EGR_CC1;
+	    }
+	} else
+	    tp->dier = TIM_UIF;
+	irq_unmask ( old );
+}
+
+void
+tim2_handler ( void )
+{
+	struct timer *tp = TIMER2_BASE;
+	struct callout *cp;
+	tfptr func;
+	void *arg;
+	u32 now;
+	u32 old;
+
+	wheel_ints++;
+
+	if ( tp->sr & TIM_UIF ) {
+	    tp->sr = ~TIM_UIF;
+	    wheel_hi++;
+	}
+	tp->sr = ~TIM_CC1IF;
+	tp->dier = TIM_UIF;
+
+	now = wheel_now ();
+
+	for ( ;; ) {
+	    old = irq_mask ( PRI_TIMER );
+	    cp = wheel_next ();
+	    if ( ! cp || (int) (cp->when - now) > 0 ) {
+		irq_unmask ( old );
+		break;
+	    }
+
+	    wheel_remove ( cp );
+	    wheel_base = cp->when;
+	    func = cp->func;
+	    arg = cp->arg;
+
+	    if ( cp->period ) {
+		cp->when += cp->period;
+		/* Don't try to catch up if we fell way behind */
+		if ( (int) (cp->when - now) <= 0 )
+		    cp->when = now + cp->period;
+		wheel_insert ( cp );
+	    }
+	    irq_unmask ( old );
+
+	    wheel_fired++;
+	    (*func) ( arg );
+	}
+
+	wheel_base = now;
+	wheel_arm ();
+}
+
+/* ---------------------------------------------------------- */
+
+static int
+timer_start ( int ms, int period, tfptr func, void *arg )
+{
+	struct callout *cp;
+	int i;
+	u32 old;
+
+	old = irq_mask ( PRI_TIMER );
+	for ( i=0; i<NUM_TIMERS; i++ ) {
+	    cp = &callouts[i];
+	    if ( ! cp->pending )
+		break;
+	}
+	if ( i == NUM_TIMERS ) {
+	    wheel_lost++;
+	    irq_unmask ( old );
+	    return -1;
+	}
+
+	cp->func = func;
+	cp->arg = arg;
+	cp->period = period * MS_TICKS;
+	cp->when = now_locked () + ms * MS_TICKS;
+	cp->gen++;
+	wheel_insert ( cp );
+	irq_unmask ( old );
+
+	wheel_arm ();
+
+	/* The low bits say which callout, the rest make
+	 * a stale id (for a timer that has come and gone
+	 * and been reused) miss.
+	 */
+	return (cp->gen & 0x7fffff) << 8 | i;
+}
+
+int
+timer_after ( int ms, tfptr func, void *arg )
+{
+	return timer_start ( ms, 0, func, arg );
+}
+
+int
+timer_every ( int ms, tfptr func, void *arg )
+{
+	if ( ms <= 0 )
+	    return -1;
+	return timer_start ( ms, ms, func, arg );
+}
+
+/* It is fine to cancel a timer that has already gone off */
+void
+timer_cancel ( int id )
+{
+	struct callout *cp;
+	int i = id & 0xff;
+	u32 old;
+
+	if ( id < 0 || i >= NUM_TIMERS )
+	    return;
+
+	cp = &callouts[i];
+
+	old = irq_mask ( PRI_TIMER );
+	if ( ((cp->gen & 0x7fffff) << 8 | i) == id && cp->pending )
+	    wheel_remove ( cp );
+	irq_unmask ( old );
+}
+
+void
+wheel_show ( void )
+{
+	int i, n = 0;
+
+	for ( i=0; i<NUM_TIMERS; i++ )
+	    if ( callouts[i].pending )
+		n++;
+
+	printf ( "Timers: %d pending, %d fired, %d interrupts, %d lost, now %d\n",
+	    n, wheel_fired, wheel_ints, wheel_lost, wheel_now () / MS_TICKS );
+}
+
+void
+wheel_init ( void )
+{
+	struct timer *tp = TIMER2_BASE;
+	int i;
+
+	for ( i=0; i<WHEEL_SLOTS; i++ )
+	    wheel[i] = 0;
+	for ( i=0; i<NUM_TIMERS; i++ )
+	    callouts[i].pending = 0;
+
+	wheel_hi = 0;
+	wheel_base = 0;
+
+	tp->cr1 = 0;
+	tp->psc = TIMER_CLOCK / TICK_HZ - 1;
+	tp->arr = 0xffff;
+	tp->ccmr[0] = 0;	/* channel 1 is a plain compare */
+	tp->cnt = 0;
+
+	/* load psc right now, this sets UIF so clear it */
+	tp->egr = EGR_UG;
+	tp->sr = 0;
+	tp->dier = TIM_UIF;
+
+	nvic_priority ( TIMER2_IRQ, PRI_TIMER );
+	nvic_enable ( TIMER2_IRQ );
+	tp->cr1 = CR1_ENABLE;
+}
+
+/* THE END */